@@ -1,7 +1,10 @@
 #include "mai.h"
 #include <getopt.h>
+#include <setjmp.h>
 
 /* ######################################################################## */
+static jmp_buf args_stop;				// usage, help and version return from mai_args_init()
+
 static int usage(const char *fmt, ...) {
 	if (fmt) {
 		va_list ap;
@@ -17,17 +20,56 @@ static int usage(const char *fmt, ...) {
 	fprintf(stderr, "Usage: mai <args>\n\n");
 	
 	fprintf(stderr, "-m,--mode      <send|recv>           AES67 sender or receiver  - REQUIRED\n");
-	fprintf(stderr, "-a,--address   <ip>[:<port=5004>]    AES67 multicast address   - REQUIRED\n");
-	fprintf(stderr, "-i,--interface <interface>           AES67 multicast interface\n\n");
+	fprintf(stderr, "-a,--address   <ip>[:<port=5004>]    AES67 multicast address   - REQUIRED (or receiver session)\n");
+	fprintf(stderr, "                                     receiver: repeat to mix up to %d streams\n", MAI_STREAM_MAX);
+	fprintf(stderr, "-O,--dest      <ip>[:<port>]         sender: also send every packet to this unicast address\n");
+	fprintf(stderr, "                                     repeat for up to %d destinations, port defaults to the stream's\n", MAI_DEST_MAX);
+	fprintf(stderr, "-i,--interface <interface>           AES67 multicast interface\n");
+	fprintf(stderr, "-T,--transport <udp|l2>              PTP transport: UDP/IPv4 or IEEE 802.3 (layer 2)\n");
+	fprintf(stderr, "-G,--grandmaster[=<priority1>]       PTP grandmaster if no better clock <1-255, 250>\n");
+	fprintf(stderr, "-F,--fast                            start audio before PTP locks (clock slews on lock)\n");
+	fprintf(stderr, "-S,--state     <file>                save/restore clock calibration across restarts\n\n");
 	
-	fprintf(stderr, "-s,--session   <session name>        AES67 sender Session Name\n");
+	fprintf(stderr, "-s,--session   <session name>        AES67 Session Name (receiver: subscribe via SAP)\n");
 	fprintf(stderr, "-t,--title     <session title>       AES67 sender Session Title\n\n");
 	
 	fprintf(stderr, "-b,--bits      <bits>                AES67 encoding bits <16,24,32>\n");
-	fprintf(stderr, "-r,--rate      <samplerate>          AES67 sample rate <44100,48000,96000>\n");
+	fprintf(stderr, "-r,--rate      <samplerate>          AES67 sample rate <44100,48000,88200,96000,176400,192000>\n");
 	fprintf(stderr, "-c,--channels  <channels>            AES67 channels in stream <1-8>\n");
-	fprintf(stderr, "-p,--ptime     <ptime>               AES67 audio per packet <4000,1000,333,250,125>us\n\n");
+	fprintf(stderr, "-p,--ptime     <ptime>               AES67 audio per packet <4000,1000,333,250,125>us\n");
+	
+	fprintf(stderr, "-R,--ring                            receiver: memory mapped packet ring (TPACKET_V3)\n");
+	fprintf(stderr, "-U,--uring[=<cpu>]                   receive all sockets in one io_uring thread, pinned to cpu\n");
+	fprintf(stderr, "-Q,--shards    <workers>             receiver: stream sockets spread over <1-%d> workers, one cpu each\n", MAI_STREAM_MAX);
+	fprintf(stderr, "-P,--thread    <name>:<cpus>[:<policy>[:<prio>]]\n");
+	fprintf(stderr, "                                     thread <rtp,ptp,sap,loop,shard,fec,stat,audio,record,control> affinity and <fifo,rr,other> priority\n");
+	fprintf(stderr, "-B,--busy-poll <us>                  RTP/PTP socket busy polling time\n");
+	fprintf(stderr, "-N,--rcvbuf    <bytes>               RTP/PTP socket receive buffer size\n");
+	fprintf(stderr, "-D,--batch     <us>[,gso]            sender: packets due within <us> go in one sendmmsg (or UDP GSO) call\n");
+	fprintf(stderr, "-J,--fec       <L>[x<D>]             XOR repairs: rows of L packets (port+4), columns of D rows (port+2)\n");
+	fprintf(stderr, "-w,--window    <packets>             receiver: packets to wait for a missing one <1-128, 6 or LxD>\n");
+	fprintf(stderr, "-H,--local     <name>                same host shared memory: sender publishes to it as well, receiver\n");
+	fprintf(stderr, "                                     takes its first stream from it (/dev/shm/<name>), or from the\n");
+	fprintf(stderr, "                                     network without a publisher of the same format\n\n");
+	
+	fprintf(stderr, "-X,--shm       <name>                publish statistics in shared memory (/dev/shm/<name>)\n");
+	fprintf(stderr, "-M,--metrics   <path>                serve statistics (prometheus text) on a unix socket\n");
+	fprintf(stderr, "-C,--control   <path>                control socket: add/del streams, buffer target, gain, connect\n\n");
+	
+	fprintf(stderr, "-W,--replay    <file.pcap|gen[:<s>]> receiver: replay a capture or generated stream, not the network\n");
+	fprintf(stderr, "-I,--impair    <key=value,...>       replay impairments: loss=%%,dup=%%,reorder=%%,depth=<packets>,\n");
+	fprintf(stderr, "                                     jitter=<us>,step=<ptp ns>,at=<s>\n");
+	fprintf(stderr, "-A,--asap                            replay as fast as possible, not in real time\n");
+	fprintf(stderr, "-L,--measure                         time code on the last channel: latency, drift and glitches\n");
+	fprintf(stderr, "-Z,--align     <ms>                  receiver: play every stream at its RTP time plus a link offset\n");
+	fprintf(stderr, "-x,--mix       <port>=<stream>.<channel>[@<dB>]\n");
+	fprintf(stderr, "                                     receiver: route a stream channel to an output port (repeatable)\n");
+	fprintf(stderr, "-Y,--record    <dir>[,float][,rotate=<s>]\n");
+	fprintf(stderr, "                                     receiver: record each stream to its own BWF/RF64 files, rotated <3600>s\n\n");
 	
+	fprintf(stderr, "-E,--backend   <jack|null|tone|file:<path>>\n");
+	fprintf(stderr, "                                     audio backend: JACK, or headless silence, 1kHz tone or raw float file\n");
+	fprintf(stderr, "-K,--period    <frames>              headless backend process period <16-%d, 256>\n", MAI_PERIOD_MAX);
 	fprintf(stderr, "-l,--client    <name>                JACK client name\n");
 	fprintf(stderr, "-o,--ports     <names>               JACK port connection list\n\n");
 	
@@ -38,25 +80,59 @@ static int usage(const char *fmt, ...) {
 	fprintf(stderr, "-v,--verbose                         Verbose Debugging Output\n");
 	fprintf(stderr, "-h,--help                            Show this Help Screen\n\n");
 	
-	exit(-1);
+	longjmp(args_stop, -1);
 }
 
 /* ######################################################################## */
 struct mai mai;
 
-void mai_args_init(int argc, char *argv[]) {
-	// clear structure now
-	memset(&mai, 0, sizeof(mai));
+int mai_args_rate(uint32_t rate) {
+	// 44.1k and 48k families, single to quad rate
+	static const uint32_t rates[] = { 44100, 48000, 88200, 96000, 176400, 192000 };
+	
+	for (size_t lp=0; lp < (sizeof(rates) / sizeof(rates[0])); lp++) {
+		if (rate == rates[lp])
+			return(0);
+	}
+	return(-1);
+}
 
-	// set command line defaults
+int mai_args_init(int argc, char *argv[]) {
+	// -1: usage or error printed, 1: version printed
+	switch (setjmp(args_stop)) {
+		case  0: break;
+		case  1: return(1);
+		default: return(-1);
+	}
+	
+	// clear structure now, getopt starts over for every open
+	memset(&mai, 0, sizeof(mai));
+	optind = 0;
+	
+	// set command line defaults, also in the modules an earlier open configured
+	mai.args.backend = "jack";
 	mai.args.client	= "mai";
 	mai.args.ptime	= 1000;
 	
+	mai_backend_set(mai.args.backend);
+	mai_sock_if_set(NULL);
+	mai_mix_route(NULL);
+	mai_record_config(NULL);
+	mai_replay_impair(NULL);
+	mai_rtp_batch(NULL);
+	mai_fec_set(NULL);
+	mai_thread_config(NULL);
+	
 	// long options structure
 	static struct option options[] = {
 		{ "mode",	required_argument,	0, 'm'	},
 		{ "address",	required_argument,	0, 'a'	},
+		{ "dest",	required_argument,	0, 'O'	},
 		{ "interface",	required_argument,	0, 'i'	},
+		{ "transport",	required_argument,	0, 'T'	},
+		{ "grandmaster",optional_argument,	0, 'G'	},
+		{ "fast",	no_argument,		0, 'F'	},
+		{ "state",	required_argument,	0, 'S'	},
 		
 		{ "session",	required_argument,	0, 's'	},
 		{ "title",	required_argument,	0, 't'	},
@@ -65,6 +141,29 @@ void mai_args_init(int argc, char *argv[]) {
 		{ "channels",	required_argument,	0, 'c'	},
 		{ "ptime",	required_argument,	0, 'p'	},
 		
+		{ "ring",	no_argument,		0, 'R'	},
+		{ "uring",	optional_argument,	0, 'U'	},
+		{ "shards",	required_argument,	0, 'Q'	},
+		{ "thread",	required_argument,	0, 'P'	},
+		{ "busy-poll",	required_argument,	0, 'B'	},
+		{ "rcvbuf",	required_argument,	0, 'N'	},
+		{ "batch",	required_argument,	0, 'D'	},
+		{ "fec",	required_argument,	0, 'J'	},
+		{ "window",	required_argument,	0, 'w'	},
+		{ "local",	required_argument,	0, 'H'	},
+		{ "shm",	required_argument,	0, 'X'	},
+		{ "metrics",	required_argument,	0, 'M'	},
+		{ "control",	required_argument,	0, 'C'	},
+		{ "replay",	required_argument,	0, 'W'	},
+		{ "impair",	required_argument,	0, 'I'	},
+		{ "asap",	no_argument,		0, 'A'	},
+		{ "measure",	no_argument,		0, 'L'	},
+		{ "align",	required_argument,	0, 'Z'	},
+		{ "mix",	required_argument,	0, 'x'	},
+		{ "record",	required_argument,	0, 'Y'	},
+		
+		{ "backend",	required_argument,	0, 'E'	},
+		{ "period",	required_argument,	0, 'K'	},
 		{ "client",	required_argument,	0, 'l'	},
 		{ "ports",	required_argument,	0, 'o'	},
 		
@@ -79,7 +178,9 @@ void mai_args_init(int argc, char *argv[]) {
 
 	char *ptr;
 	
-	for (int ch; (ch = getopt_long(argc, argv, ":m:a:i:s:t:b:r:c:p:l:o:u:g:Vvh", options, NULL)) != -1; ) { switch (ch) {
+	char spec[64];
+	
+	for (int ch; (ch = getopt_long(argc, argv, ":m:a:O:i:T:G::FS:s:t:b:r:c:p:RU::Q:P:B:N:D:J:w:H:X:M:C:W:I:ALZ:x:Y:E:K:l:o:u:g:Vvh", options, NULL)) != -1; ) { switch (ch) {
 		case 'm':
 			     if (optarg[0] == 's') mai.args.mode = 's';
 			else if (optarg[0] == 'r') mai.args.mode = 'r';
@@ -93,13 +194,143 @@ void mai_args_init(int argc, char *argv[]) {
 			
 			break;
 			
+		case 'T':
+			     if (!strcmp(optarg, "udp")) mai.args.ptp_l2 = 0;
+			else if (!strcmp(optarg, "l2"))  mai.args.ptp_l2 = 1;
+			else usage("ERROR: 'transport' argument must be 'udp' or 'l2', got '%s'.", optarg);
+			
+			break;
+			
+		case 'G':
+			mai.args.grandmaster = optarg ? atoi(optarg) : 250;
+			if ((mai.args.grandmaster < 1) || (mai.args.grandmaster > 255))
+				usage("ERROR: 'grandmaster' priority must be 1..255 (got: %d)", mai.args.grandmaster);
+				
+			break;
+			
 		case 's': mai.args.session = optarg ? strdup(optarg) : NULL; 	break;
 		case 't': mai.args.title   = optarg ? strdup(optarg) : NULL; 	break;
 		case 'l': mai.args.client  = optarg ? strdup(optarg) : NULL; 	break;
 		case 'o': mai.args.ports   = optarg ? strdup(optarg) : NULL; 	break;
+		case 'S': mai.args.state   = optarg ? strdup(optarg) : NULL; 	break;
+		case 'M': mai.args.metrics = optarg ? strdup(optarg) : NULL; 	break;
+		case 'C': mai.args.control = optarg ? strdup(optarg) : NULL; 	break;
+		case 'W': mai.args.replay  = optarg ? strdup(optarg) : NULL; 	break;
+		case 'A': mai.args.asap    = 1;					break;
+		case 'L': mai.args.measure = 1;					break;
+		
+		case 'E':
+			if (mai_backend_set(optarg) || (!strncmp(optarg, "file", 4) && (strlen(optarg) < 6)))
+				usage("ERROR: 'backend' must be jack, null, tone or file:<path> (got: %s)", optarg);
+				
+			mai.args.backend = strdup(optarg);
+			break;
+			
+		case 'K':
+			mai.args.period = atoi(optarg);
+			if ((mai.args.period < 16) || (mai.args.period > MAI_PERIOD_MAX))
+				usage("ERROR: 'period' must be 16..%d frames (got: %s)", MAI_PERIOD_MAX, optarg);
+				
+			break;
+			
+		case 'Z':
+			mai.args.align = atof(optarg);
+			if ((mai.args.align <= 0) || (mai.args.align > 100))
+				usage("ERROR: 'align' link offset must be within 0..100ms (got: %s)", optarg);
+				
+			break;
+			
+		case 'x':
+			if (mai_mix_route(optarg))
+				usage("ERROR: 'mix' must be <port>=<stream>.<channel>[@<dB>] (got: %s)", optarg);
+				
+			break;
+			
+		case 'Y':
+			if (mai_record_config(optarg))
+				usage("ERROR: 'record' must be <dir>[,float][,rotate=<seconds>] (got: %s)", optarg);
+				
+			mai.args.record = optarg;
+			break;
+			
+		case 'I':
+			if (mai_replay_impair(optarg))
+				usage("ERROR: 'impair' must be a list of loss,dup,reorder,depth,jitter,step,at=<value> (got: %s)", optarg);
+				
+			break;
+		
+		case 'X':
+			// shm_open names are "/<name>"
+			if (asprintf((char **)&mai.args.shm, "/%s", optarg + (optarg[0] == '/')) < 0)
+				usage("ERROR: 'shm' name allocation failed");
+				
+			break;
+			
 		case 'u': mai.args.uid	   = atoi(optarg); 			break;
 		case 'g': mai.args.gid	   = atoi(optarg); 			break;
 		case 'v': mai.args.verbose = 1;	    				break;
+		case 'F': mai.args.fast    = 1;					break;
+		case 'R': mai.args.ring    = 1;					break;
+		
+		case 'U':
+			mai.args.uring = 1;
+			if (optarg && (snprintf(spec, sizeof(spec), "loop:%s", optarg) >= (int)sizeof(spec) || mai_thread_config(spec)))
+				usage("ERROR: 'uring' cpu list error (got: %s)", optarg);
+				
+			break;
+			
+		case 'Q':
+			mai.args.shards = atoi(optarg);
+			if ((mai.args.shards < 1) || (mai.args.shards > MAI_STREAM_MAX))
+				usage("ERROR: 'shards' must be within 1..%d (got: %s)", MAI_STREAM_MAX, optarg);
+				
+			break;
+			
+		case 'P':
+			if (mai_thread_config(optarg))
+				usage("ERROR: 'thread' must be <rtp,ptp,sap,loop,shard,fec,audio,record,control>:<cpus>[:<fifo,rr,other>[:<prio>]] (got: %s)", optarg);
+				
+			break;
+			
+		case 'B':
+			mai.args.busy_poll = atoi(optarg);
+			if (mai.args.busy_poll < 1)
+				usage("ERROR: 'busy-poll' must be > 0us (got: %s)", optarg);
+				
+			break;
+			
+		case 'N':
+			mai.args.rcvbuf = atoi(optarg);
+			if (mai.args.rcvbuf < 1)
+				usage("ERROR: 'rcvbuf' must be > 0 bytes (got: %s)", optarg);
+				
+			break;
+			
+		case 'D':
+			if (mai_rtp_batch(optarg))
+				usage("ERROR: 'batch' must be <1-20000>us[,gso] (got: %s)", optarg);
+				
+			mai.args.batch = optarg;
+			break;
+			
+		case 'J':
+			if (mai_fec_set(optarg))
+				usage("ERROR: 'fec' must be <1-20>[x<1-20>], at most 100 packets (got: %s)", optarg);
+				
+			mai.args.fec = optarg;
+			break;
+			
+		case 'w':
+			mai.args.window = atoi(optarg);
+			if ((mai.args.window < 1) || (mai.args.window > 128))
+				usage("ERROR: 'window' must be within 1..128 packets (got: %s)", optarg);
+				
+			break;
+			
+		case 'H':
+			mai.args.local = optarg;
+			break;
+			
 		case 'h': usage(NULL);						break;
 		
 		case 'V': 
@@ -107,12 +338,12 @@ void mai_args_init(int argc, char *argv[]) {
 				"MAI: Mark's AES67 Implementation. Version %s.\n\n%s\n\n%s\n\n%s\n", 
 				MAI_VERSION, MAI_COPYRIGHT, MAI_LICENSE, MAI_DISCLAIMER
 			);
-			exit(0);
+			longjmp(args_stop, 1);
 		
 		case 'r':
 			mai.args.rate = atoi(optarg);
-			if ((mai.args.rate != 44100) && (mai.args.rate != 48000) && (mai.args.rate != 96000))
-				usage("ERROR: 'rate' argument must be 44100, 48000 or 96000 (got: %d)", mai.args.rate);
+			if (mai_args_rate(mai.args.rate))
+				usage("ERROR: 'rate' argument must be 44100, 48000, 88200, 96000, 176400 or 192000 (got: %d)", mai.args.rate);
 				
 			break;
 		
@@ -138,21 +369,45 @@ void mai_args_init(int argc, char *argv[]) {
 			break;
 			
 		case 'a':
-			if (!optarg || ((mai.args.addr = strdup(optarg)) == NULL))
+			if (mai.args.streams >= MAI_STREAM_MAX)
+				usage("ERROR: at most %d 'address' arguments", MAI_STREAM_MAX);
+				
+			if (!optarg || ((mai.args.stream[mai.args.streams].addr = ptr = strdup(optarg)) == NULL))
 				break;
 			
-			if ((ptr = strchr(mai.args.addr, ':')) != NULL) {
+			if ((ptr = strchr(ptr, ':')) != NULL) {
 				*ptr++ = 0;
 				
 				int port = *ptr ? atoi(ptr) : 5004;
 				if ((port < 1025) || (port > 49152))
 					usage("ERROR: 'port' argument must be within 1025..49152");
 					
-				mai.args.port = port;
+				mai.args.stream[mai.args.streams].port = port;
 			} else {
-				mai.args.port = 5004;
+				mai.args.stream[mai.args.streams].port = 5004;
+			}
+			
+			mai.args.streams += 1;
+			break;
+			
+		case 'O':
+			if (mai.args.dests >= MAI_DEST_MAX)
+				usage("ERROR: at most %d 'dest' arguments", MAI_DEST_MAX);
+				
+			if ((mai.args.dest[mai.args.dests].addr = ptr = strdup(optarg)) == NULL)
+				break;
+				
+			if ((ptr = strchr(ptr, ':')) != NULL) {
+				*ptr++ = 0;
+				
+				int port = atoi(ptr);
+				if ((port < 1025) || (port > 49152))
+					usage("ERROR: 'dest' port must be within 1025..49152");
+					
+				mai.args.dest[mai.args.dests].port = port;
 			}
 			
+			mai.args.dests += 1;
 			break;
 			
 		case ':':
@@ -167,19 +422,64 @@ void mai_args_init(int argc, char *argv[]) {
 	// check required parameters
 	if (!mai.args.mode)
 		usage("ERROR: 'mode' argument was not supplied!");
+		
+	// the first address is the stream for everything that handles only one
+	if (mai.args.streams) {
+		mai.args.addr = mai.args.stream[0].addr;
+		mai.args.port = mai.args.stream[0].port;
+	}
+	
+	if ((mai.args.streams > 1) && ((mai.args.mode != 'r') || mai.args.ring))
+		usage("ERROR: more than one 'address' needs receive mode without 'ring'!");
+		
+	if (mai.args.shards && ((mai.args.mode != 'r') || mai.args.ring || mai.args.uring))
+		usage("ERROR: 'shards' needs receive mode without 'ring' or 'uring'!");
+		
+	// receivers can subscribe to an announced session instead
+	if ((mai.args.mode == 'r') && !mai.args.addr && mai.args.session)
+		mai.args.discover = 1;
 	
-	if (!mai.args.addr)
+	if (!mai.args.addr && !mai.args.discover)
 		usage("ERROR: 'address' argument was not supplied!");
 		
-	if (!mai.args.bits)
+	if (!mai.args.bits && !mai.args.discover)
 		usage("ERROR: 'bits' argument was not supplied!");
 		
-	if (!mai.args.channels)
+	if (!mai.args.channels && !mai.args.discover)
 		usage("ERROR: 'channels' argument was not supplied!");
 		
-	if (!mai.args.rate)
+	if (!mai.args.rate && !mai.args.discover)
 		usage("ERROR: 'rate' argument was not supplied!");
 		
+	if (mai.args.ptp_l2 && !mai_sock_if_name())
+		usage("ERROR: 'transport' l2 requires the 'interface' argument!");
+		
+	// replay feeds the udp receive handlers, audio runs before ptp locks
+	if (mai.args.replay && ((mai.args.mode != 'r') || mai.args.discover || mai.args.ring || mai.args.ptp_l2))
+		usage("ERROR: 'replay' needs receive mode with 'address', and no 'ring' or l2 'transport'!");
+		
+	if (mai.args.replay)
+		mai.args.fast = 1;
+		
+	if (mai.args.record && (mai.args.mode != 'r'))
+		usage("ERROR: 'record' needs receive mode!");
+		
+	if (mai.args.align && (mai.args.mode != 'r'))
+		usage("ERROR: 'align' needs receive mode!");
+		
+	if (mai.args.batch && (mai.args.mode != 's'))
+		usage("ERROR: 'batch' needs send mode!");
+		
+	if (mai.args.dests && (mai.args.mode != 's'))
+		usage("ERROR: 'dest' needs send mode!");
+		
+	if (mai.args.window && (mai.args.mode != 'r'))
+		usage("ERROR: 'window' needs receive mode!");
+		
+	// local receive: the first stream never reaches the packet handlers
+	if (mai.args.local && (mai.args.mode == 'r') && (mai.args.ring || mai.args.replay))
+		usage("ERROR: 'local' receive takes the first stream, no 'ring' or 'replay'!");
+		
 	// check and fill optional parameters
 	if (!mai.args.session) {
 		char host[HOST_NAME_MAX];
@@ -195,6 +495,8 @@ void mai_args_init(int argc, char *argv[]) {
 		if (asprintf((char **)&mai.args.title, "Jack 1-%d", mai.args.channels) <= 0)
 			usage("ERROR: unable to create default 'title' argument!");
 	}
+	
+	return(0);
 }
 
 /* ######################################################################## */
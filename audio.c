@@ -2,14 +2,29 @@
 #include <samplerate.h>
 
 /* ######################################################################## */
-static jack_ringbuffer_t	 *buf;			// rtp/jack ipc audio buffer
+#define AUDIO_ALIGN_SLACK	8			// frames the aligned streams may wander from the media clock
+
+static jack_ringbuffer_t	 *buf[MAI_STREAM_MAX];	// rtp/jack ipc audio buffer per stream
 static size_t			  buf_frames;		// frames in buffer
 static size_t			  buf_stride;		// channels * sizeof(float)
+static size_t			  buf_count;		// ringbuffers (sender: 1, receiver: MAI_STREAM_MAX)
+static size_t			  buf_rate;		// backend frames per second
+
+static uint32_t			  buf_want = 0;		// streams switched on (control)
+static uint32_t			  buf_on   = 0;		// streams read this period (process)
+static size_t			  buf_target[MAI_STREAM_MAX];	// buffer fill to hold (frames, 0: any)
+static int			  buf_hold[MAI_STREAM_MAX];	// silence until the target has filled
+
+static uint64_t			  buf_mark[MAI_STREAM_MAX];	// writer: frames written (high), next rtp time (low)
+static uint32_t			  buf_read[MAI_STREAM_MAX];	// reader: frames read
+static size_t			  buf_pad[MAI_STREAM_MAX];	// reader: silence to play before the buffer
+static int32_t			  buf_skew[MAI_STREAM_MAX];	// last skew from the first aligned stream (frames)
+static uint32_t			  buf_offset = 0;		// aligned playout: link offset (frames)
 
 static pthread_cond_t 		  buf_cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t		  buf_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static SRC_STATE		 *src	    = NULL;	// sample rate converter
+static SRC_STATE		 *src[MAI_STREAM_MAX];	// sample rate converter per stream
 static double			  src_ratio = 1.0;	// output / input ratio
 static int			  src_mult  = 1;	// integer ratio for buffer scaling
 
@@ -64,26 +79,45 @@ static void cvt_float16(uint8_t *out, int32_t raw) {
 }
 
 /* ######################################################################## */
-size_t mai_audio_write(const void *data, size_t frames) {
-	// resample: ensure we consume all input frames in this process
-        if (src) {
-                const size_t oframes = frames * src_mult;
-                
-                SRC_DATA d = (SRC_DATA){
-                        .input_frames  = frames,  .data_in   = (void *)data,     
-                        .output_frames = oframes, .data_out  = alloca(oframes * buf_stride),
-                        .end_of_input  = 0,       .src_ratio = src_ratio
-                };
-                
-                if (src_process(src, &d))
-                        return(0);
-                        
-		data   = d.data_out;
-		frames = d.output_frames_gen;
-	}
+static void cvt_packet_int(float *out, const char *data, size_t samples) {
+	// network integer samples to float
+	for (size_t lp=samples; lp--; data += cvt_unit)
+		*out++ = cvt_int_clip(data);
+}
+
+static void cvt_packet_float(char *data, const float *in, size_t samples) {
+	// float samples to network integer, with noise shaped dither
+	int32_t quant;
+	float raw, rand, samp, *dither;
+	
+	for (size_t lp=0; lp < samples; data += cvt_unit) {
+		dither = cvt_dither[lp++ % mai.args.channels];
 	
+		// scale then do noise shaping
+		raw = (*in++ * cvt_max) + dither[0] - dither[1] + dither[2];
+		
+		// bias and dither
+		rand = (drand48() - 0.5) * cvt_scale;
+		samp = (raw + 0.5f) + (rand - dither[3]);
+		
+		// clip
+		if (((samp > cvt_max) && (raw > (samp = cvt_max))) || ((samp < cvt_min) && (raw < (samp = cvt_min))))
+			raw = samp;
+		
+		// update dither noise and error feedback
+		dither[3] = rand;
+		dither[2] = dither[1];
+		dither[1] = dither[0] / 2;
+		dither[0] = raw - (quant = nearbyintf(samp));
+		
+		(*cvt_float)((uint8_t *)data, quant);
+	}
+}
+
+/* ######################################################################## */
+static size_t audio_put(size_t stream, const void *data, size_t frames) {
 	// write as many whole frames as we can to the buffer
-	size_t bytes = jack_ringbuffer_write_space(buf);
+	size_t bytes = jack_ringbuffer_write_space(buf[stream]);
 	
 	if ((bytes -= bytes % buf_stride) == 0) {
 		MAI_STAT_INC(audio.overrun);
@@ -94,30 +128,130 @@ size_t mai_audio_write(const void *data, size_t frames) {
 	if ((frames *= buf_stride) < bytes)
 		bytes = frames;
 	
-	bytes = jack_ringbuffer_write(buf, data, bytes);
+	bytes = jack_ringbuffer_write(buf[stream], data, bytes);
 	
 	pthread_cond_signal(&buf_cond);
 	return(bytes);
 }
 
-size_t mai_audio_write_int(const char *data, size_t bytes) {
+size_t mai_audio_write(size_t stream, const void *data, size_t frames) {
+	// resample: ensure we consume all input frames in this process
+        if (src[stream]) {
+                const size_t oframes = frames * src_mult;
+                
+                SRC_DATA d = (SRC_DATA){
+                        .input_frames  = frames,  .data_in   = (void *)data,     
+                        .output_frames = oframes, .data_out  = alloca(oframes * buf_stride),
+                        .end_of_input  = 0,       .src_ratio = src_ratio
+                };
+                
+                if (src_process(src[stream], &d))
+                        return(0);
+                        
+		data   = d.data_out;
+		frames = d.output_frames_gen;
+	}
+	
+	return(audio_put(stream, data, frames));
+}
+
+size_t mai_audio_write_int(size_t stream, const char *data, size_t bytes, uint32_t time) {
 	size_t samples = bytes / cvt_unit;
 	size_t frames  = samples / mai.args.channels;
 	
 	float *out = alloca(samples * sizeof(float));
-	float *ptr = out;
 	
-	for (size_t lp=samples; lp--; data += cvt_unit)
-		*ptr++ = cvt_int_clip(data);
+	cvt_packet_int(out, data, samples);
+	mai_meter_block(stream, out, frames);
+	
+	if (mai.args.record)
+		mai_record_tap(stream, data, out, samples, time);
+		
+	// aligned playout: lost packets keep their place in time as silence,
+	// smaller steps (a sender slewing its clock) are left to mai_audio_align()
+	uint64_t mark    = buf_mark[stream];
+	uint32_t written = mark >> 32;
+	int32_t  gap     = time - (uint32_t)mark;
+	
+	if (buf_offset && written && (gap >= (int32_t)frames) && ((size_t)gap < (buf_frames / 2))) {
+		float *silence = alloca(gap * buf_stride);
+		
+		memset(silence, 0, gap * buf_stride);
+		written += mai_audio_write(stream, silence, gap) / buf_stride;
+	}
+	
+	written += mai_audio_write(stream, out, frames) / buf_stride;
+	
+	// publish count and time together, the reader works out the time at its end
+	__atomic_store_n(&buf_mark[stream], ((uint64_t)written << 32) | (uint32_t)(time + frames), __ATOMIC_RELEASE);
+	return(frames);
+}
+
+size_t mai_audio_write_local(size_t stream, const float *data, size_t frames, uint32_t time) {
+	// shared memory: frames are at the backend rate already, the rtp time is stream rate
+	mai_meter_block(stream, data, frames);
+	
+	// recorded like a received stream, which needs both rates to match (mai_local_start)
+	if (mai.args.record) {
+		char *wire = alloca(frames * mai.args.channels * cvt_unit);
 		
-	return(mai_audio_write(out, frames));
+		cvt_packet_float(wire, data, frames * mai.args.channels);
+		mai_record_tap(stream, wire, data, frames * mai.args.channels, time);
+	}
+	
+	uint32_t written = (buf_mark[stream] >> 32) + (audio_put(stream, data, frames) / buf_stride);
+	
+	__atomic_store_n(&buf_mark[stream], ((uint64_t)written << 32) | (uint32_t)(time + lround(frames / src_ratio)), __ATOMIC_RELEASE);
+	return(frames);
 }
 
 /* ######################################################################## */
-size_t mai_audio_read(void *data, size_t frames) {
+static void audio_advance(size_t stream, size_t bytes) {
+	// process thread: drop audio, counted so the read end keeps its rtp time
+	jack_ringbuffer_read_advance(buf[stream], bytes);
+	buf_read[stream] += bytes / buf_stride;
+}
+
+size_t mai_audio_read(size_t stream, void *data, size_t frames) {
 	// read as many whole frames as we can from the buffer
-	size_t avail = jack_ringbuffer_read_space(buf);
-	size_t bytes = frames * buf_stride;
+	size_t avail  = jack_ringbuffer_read_space(buf[stream]);
+	size_t bytes  = frames * buf_stride;
+	size_t target = __atomic_load_n(&buf_target[stream], __ATOMIC_RELAXED) * buf_stride;
+	
+	MAI_HIST_ADD(hist.fill, avail / buf_stride);
+	
+	// a buffer target holds latency: trim what is more than a period over it,
+	// and play silence after the target was raised until the buffer catches up
+	if (target && (avail > (target + (bytes * 2)))) {
+		size_t trim = avail - (target + bytes);
+		
+		audio_advance(stream, trim);
+		MAI_STAT_ADD(audio.trimmed, trim / buf_stride);
+		
+		avail -= trim;
+	}
+	
+	// aligned playout: silence first while the stream is ahead of the media clock
+	if (buf_pad[stream]) {
+		size_t pad = (buf_pad[stream] < frames) ? buf_pad[stream] : frames;
+		
+		memset(data, 0, pad * buf_stride);
+		
+		buf_pad[stream] -= pad;
+		data             = (char *)data + (pad * buf_stride);
+		bytes           -= pad * buf_stride;
+		
+		if (!bytes)
+			return(0);
+	}
+	
+	if (__atomic_load_n(&buf_hold[stream], __ATOMIC_ACQUIRE)) {
+		if (avail < (target + bytes)) {
+			memset(data, 0, bytes);
+			return(0);
+		}
+		__atomic_store_n(&buf_hold[stream], 0, __ATOMIC_RELEASE);
+	}
 	
 	if (avail < bytes) {
 		MAI_STAT_INC(audio.underrun);
@@ -126,48 +260,158 @@ size_t mai_audio_read(void *data, size_t frames) {
 		return(0);
 	}
 	
-	return(jack_ringbuffer_read(buf, data, bytes));
+	bytes = jack_ringbuffer_read(buf[stream], data, bytes);
+	buf_read[stream] += bytes / buf_stride;
+	
+	return(bytes);
+}
+
+static void buf_unlock(void *lock) {
+	pthread_mutex_unlock(lock);
 }
 
 size_t mai_audio_read_int(char *data, size_t bytes) {
 	size_t samples = bytes / cvt_unit;
 	size_t buflen  = samples * sizeof(float);
 	
-	while (jack_ringbuffer_read_space(buf) < buflen) {
+	// sender: one stream
+	while (jack_ringbuffer_read_space(buf[0]) < buflen) {
 		pthread_mutex_lock(&buf_lock);
+		pthread_cleanup_push(buf_unlock, &buf_lock);		// cancelled while waiting
 		pthread_cond_wait(&buf_cond, &buf_lock);
-		pthread_mutex_unlock(&buf_lock);
+		pthread_cleanup_pop(1);
 	}
 	
+	MAI_HIST_ADD(hist.fill, jack_ringbuffer_read_space(buf[0]) / buf_stride);
+	
 	float *in = alloca(buflen);
-	jack_ringbuffer_read(buf, (void *)in, buflen);
+	jack_ringbuffer_read(buf[0], (void *)in, buflen);
 	
-	int32_t quant;
-	float raw, rand, samp, *dither;
+	cvt_packet_float(data, in, samples);
+	return(bytes);
+}
+
+int mai_audio_ready(size_t bytes) {
+	// sender: a packet of audio is waiting, mai_audio_read_int() will not block
+	return(jack_ringbuffer_read_space(buf[0]) >= ((bytes / cvt_unit) * sizeof(float)));
+}
+
+/* ######################################################################## */
+void mai_audio_stream(size_t stream, int on) {
+	// control: takes effect at the next period
+	if (on) __atomic_or_fetch( &buf_want,  (1u << stream), __ATOMIC_RELEASE);
+	else    __atomic_and_fetch(&buf_want, ~(1u << stream), __ATOMIC_RELEASE);
+}
+
+uint32_t mai_audio_streams(void) {
+	// process thread, between periods: streams coming on start from an empty buffer
+	uint32_t want = __atomic_load_n(&buf_want, __ATOMIC_ACQUIRE);
 	
-	for (size_t lp=0; lp < samples; data += cvt_unit) {
-		dither = cvt_dither[lp++ % mai.args.channels];
+	for (uint32_t up = want & ~buf_on; up; up &= (up - 1)) {
+		size_t s = __builtin_ctz(up);
+		
+		audio_advance(s, jack_ringbuffer_read_space(buf[s]));
+		buf_pad[s] = 0;
+	}
 	
-		// scale then do noise shaping
-		raw = (*in++ * cvt_max) + dither[0] - dither[1] + dither[2];
+	return(buf_on = want);
+}
+
+void mai_audio_align(uint32_t on, uint64_t tai, size_t frames) {
+	// process thread: the next frame of every stream is the one whose rtp time,
+	// plus the link offset, is the ptp media clock at tai (the first frame's playout)
+	tai = mai_ptp_media(tai);
+	
+	const uint32_t media = (((tai / 1000000000) * mai.args.rate) + (((tai % 1000000000) * mai.args.rate) / 1000000000)) - buf_offset;
+	
+	int32_t  error[MAI_STREAM_MAX];
+	uint32_t fill[MAI_STREAM_MAX];
+	uint32_t timed = 0;
+	
+	for (uint32_t left = on; left; left &= (left - 1)) {
+		size_t   s    = __builtin_ctz(left);
+		uint64_t mark = __atomic_load_n(&buf_mark[s], __ATOMIC_ACQUIRE);
 		
-		// bias and dither
-		rand = (drand48() - 0.5) * cvt_scale;
-		samp = (raw + 0.5f) + (rand - dither[3]);
+		fill[s] = (uint32_t)(mark >> 32) - buf_read[s];
 		
-		// clip
-		if (((samp > cvt_max) && (raw > (samp = cvt_max))) || ((samp < cvt_min) && (raw < (samp = cvt_min))))
-			raw = samp;
+		// ring frames are backend rate, rtp time is stream rate
+		uint32_t head = (uint32_t)mark - (uint32_t)lround((fill[s] + buf_pad[s]) / src_ratio);
 		
-		// update dither noise and error feedback
-		dither[3] = rand;
-		dither[2] = dither[1];
-		dither[1] = dither[0] / 2;
-		dither[0] = raw - (quant = nearbyintf(samp));
+		// nothing buffered, or further off than the buffer (not on this media clock)
+		if (!fill[s] || ((size_t)abs(error[s] = head - media) > buf_frames))
+			continue;
+			
+		timed |= 1u << s;
+	}
+	
+	if (!timed)
+		return;
 		
-		(*cvt_float)((uint8_t *)data, quant);
+	// streams follow the first one exactly, the group follows the media clock within a
+	// slack: early it waits, late it catches up only with audio already buffered,
+	// so streams timestamped later than the link offset allows still play, aligned
+	size_t  first = __builtin_ctz(timed);
+	int32_t ref   = error[first];
+	int32_t base  = ref;
+	
+	if (ref > AUDIO_ALIGN_SLACK) {
+		base = 0;
+	} else if (ref < -AUDIO_ALIGN_SLACK) {
+		int64_t spare = lround(fill[first] / src_ratio) - (int64_t)(frames * 2);
+		
+		if (spare > 0)
+			base += (spare < -ref) ? spare : -ref;
+	}
+	
+	for (uint32_t left = timed; left; left &= (left - 1)) {
+		size_t  s    = __builtin_ctz(left);
+		int64_t move = lround((error[s] - base) * src_ratio);
+		
+		if ((buf_skew[s] = error[s] - ref) != 0)
+			MAI_HIST_ADD(hist.skew, (abs(buf_skew[s]) * 1000000ULL) / mai.args.rate);
+			
+		if (!move)
+			continue;
+			
+		MAI_STAT_ADD(audio.aligned, llabs(move));
+		
+		// early: more silence first, late: less silence, then drop what already played
+		if ((move += buf_pad[s]) >= 0) {
+			buf_pad[s] = move;
+			continue;
+		}
+		
+		size_t drop = -move * buf_stride, avail = jack_ringbuffer_read_space(buf[s]);
+		
+		buf_pad[s] = 0;
+		audio_advance(s, (drop < avail) ? drop : (avail - (avail % buf_stride)));
 	}
-	return(bytes);
+}
+
+int mai_audio_target(size_t stream, size_t frames) {
+	// the target plus two periods must fit the buffer, aligned streams have none
+	if (((frames * 2) > buf_frames) || buf_offset)
+		return(-1);
+		
+	if (frames > __atomic_exchange_n(&buf_target[stream], frames, __ATOMIC_RELAXED))
+		__atomic_store_n(&buf_hold[stream], 1, __ATOMIC_RELEASE);
+		
+	return(0);
+}
+
+size_t mai_audio_fill(size_t stream, size_t *target) {
+	if (target)
+		*target = buf_target[stream];
+		
+	return(jack_ringbuffer_read_space(buf[stream]) / buf_stride);
+}
+
+int32_t mai_audio_skew(size_t stream) {
+	return(buf_skew[stream]);
+}
+
+size_t mai_audio_rate(void) {
+	return(buf_rate);
 }
 
 /* ######################################################################## */
@@ -181,6 +425,29 @@ size_t mai_audio_size(size_t frames) {
 
 /* ######################################################################## */
 int mai_audio_init(size_t rate) {
+	buf_count = MAI_SENDER ? 1 : MAI_STREAM_MAX;
+	buf_rate  = rate;
+	buf_want  = MAI_SENDER ? 1 : ((1u << mai.args.streams) - 1);
+	buf_on    = 0;
+	
+	// stream state from an earlier open
+	memset(buf_target, 0, sizeof(buf_target));
+	memset(buf_hold,   0, sizeof(buf_hold));
+	memset(buf_mark,   0, sizeof(buf_mark));
+	memset(buf_read,   0, sizeof(buf_read));
+	memset(buf_pad,    0, sizeof(buf_pad));
+	memset(buf_skew,   0, sizeof(buf_skew));
+	
+	// receivers: room for a buffer target of up to 50ms
+	if (!MAI_SENDER)
+		mai_audio_size(mai.args.rate / 20);
+		
+	// aligned playout: the link offset plus a period of jitter (at 50ms)
+	if (!MAI_SENDER && mai.args.align) {
+		buf_offset = lround((mai.args.align * mai.args.rate) / 1000);
+		mai_audio_size(buf_offset + (mai.args.rate / 20));
+	}
+	
 	// setup resampler if rates don't match
 	if (rate != mai.args.rate) {
 		// ratio is output / input
@@ -190,16 +457,20 @@ int mai_audio_init(size_t rate) {
 		// integer ratio size multipler
 		src_mult = ceil(src_ratio);
 		
-		if ((src = src_new(SRC_SINC_FASTEST, mai.args.channels, NULL)) == NULL)
-			return(mai_error("failed to create resample engine!"));
+		for (size_t s=0; s < buf_count; s++) {
+			if ((src[s] = src_new(SRC_SINC_FASTEST, mai.args.channels, NULL)) == NULL)
+				return(mai_error("failed to create resample engine!"));
+		}
 	}
 	
-	// create the audio ringbuffer
+	// create the audio ringbuffers, receivers have one for every stream slot
 	buf_stride = mai.args.channels * sizeof(float);
-
-	if ((buf = jack_ringbuffer_create(buf_stride * buf_frames)) == NULL)
-		return(mai_error("failed to create audio ringbuffer!"));
-		
+	
+	for (size_t s=0; s < buf_count; s++) {
+		if ((buf[s] = jack_ringbuffer_create(buf_stride * buf_frames)) == NULL)
+			return(mai_error("failed to create audio ringbuffer!"));
+	}
+	
 	// ensure dither is zero
 	memset(cvt_dither, 0, sizeof(cvt_dither));
 	
@@ -228,4 +499,23 @@ int mai_audio_init(size_t rate) {
 	return(mai_debug("Format: %u-bit signed-integer\n", mai.args.bits));
 }
 
+void mai_audio_fini(void) {
+	// after the backend stopped: the next open sizes its buffers from scratch
+	for (size_t s=0; s < MAI_STREAM_MAX; s++) {
+		if (buf[s])
+			jack_ringbuffer_free(buf[s]);
+			
+		if (src[s])
+			src_delete(src[s]);
+			
+		buf[s] = NULL;
+		src[s] = NULL;
+	}
+	
+	buf_frames = 0;
+	buf_offset = 0;
+	src_ratio  = 1.0;
+	src_mult   = 1;
+}
+
 /* ######################################################################## */
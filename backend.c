@@ -0,0 +1,292 @@
+#include "mai.h"
+
+/* ######################################################################## */
+struct backend {
+	const char	*name;				// -E argument
+	int		(*init)(void);			// open, mai_audio_init() and start processing
+	uint32_t	(*frames)(void);		// backend frame clock (drift against ptp)
+	int		(*stop)(void);			// stop processing (optional)
+};
+
+static const struct backend backend_list[] = {
+	{ "jack",	mai_jack_init,		mai_jack_frames,	mai_jack_stop		},
+	{ "null",	mai_headless_init,	mai_headless_frames,	mai_headless_stop	},
+	{ "tone",	mai_headless_init,	mai_headless_frames,	mai_headless_stop	},
+	{ "file",	mai_headless_init,	mai_headless_frames,	mai_headless_stop	},
+	{ "embed",	mai_lib_init,		mai_lib_frames,		NULL			},
+	{ NULL }
+};
+
+static const struct backend *backend = &backend_list[0];	// selected backend
+
+static int64_t		  backend_error = 0;	// clock error: -=backend too fast, +=backend too slow
+static double		  backend_ratio = 0;	// learned clock error per frame (ptp-backend)/ptp
+
+static uint32_t		  bias_count = 0;	// process: frames since the last bias
+static double		  bias_ffwd  = 0;	// process: learned ratio not yet in backend_error
+
+static int64_t		  clk_backend  = 0;	// ptp: backend frames at the last sync
+static int64_t		  clk_ptp      = 0;	// ptp: media clock at the last sync
+static double		  clk_residual = 0;	// ptp: error below one frame
+
+/* ######################################################################## */
+static int backend_bias(uint32_t frames) {
+	static const uint32_t limit = 10000;
+	
+	// a bias every limit frames, more often when the learned ratio needs it:
+	// twice its rate leaves room for the residual, at most one per period
+	const double   need    = fabs(backend_ratio) * 2;
+	const uint32_t trigger = ((need * limit) > 1.0) ? ((uint32_t)(1.0 / need) + 1) : limit;
+	
+	int bias = 0;
+	
+	// feed forward the learned clock ratio, measurements only correct the residual
+	if (((bias_ffwd += frames * backend_ratio) >= 1.0) || (bias_ffwd <= -1.0)) {
+		int64_t whole = bias_ffwd;
+		
+		bias_ffwd -= whole;
+		__sync_fetch_and_add(&backend_error, whole);
+	}
+	
+	if ((bias_count += frames) >= trigger) {
+		bias_count %= trigger;
+		
+		     if (backend_error < 0) bias = -1;
+		else if (backend_error > 0) bias =  1;
+		
+		MAI_STAT_ADD(audio.drift, bias);
+		__sync_fetch_and_sub(&backend_error, bias);
+	}
+	
+	return(bias);
+}
+
+/* ######################################################################## */
+static void backend_interleave(float *buffer, float * const *ports, size_t channels, uint32_t frames, int bias) {
+	float *input, *output;
+	
+	for (uint32_t ch=channels; ch--; ) {				// for all ports/channels:
+		if ((input = ports[ch]) == NULL)
+			continue;
+			
+		const float * const end = input + frames;
+		
+		output = &buffer[ch];					// offset interleave output pointer
+		
+		if (bias == 1) {					// too slow: add a sample to frame
+			*output  = input[0];				// output[0] = input[0]
+			 output += channels;
+			*output  = (input[0]+input[1])/2;		// output[1] = avg(input[0..1])
+			 output += channels;
+			
+			 input  += 1;					// output[2] = input[1], ...
+			
+		} else if (bias == -1) {				// too fast: drop a sample from frame
+			*output  = (input[0]+input[1])/2;		// output[0] = avg(input[0..1])
+			 output += channels;
+			
+			 input  += 2;					// output[1] = input[2], ...
+		}
+		
+		for (; input < end; output += channels)			// for all samples in interleave
+			*output = *input++;				// copy sample
+	}
+}
+
+static void backend_deinterleave(float * const *ports, const float *buffer, size_t channels, uint32_t frames, int bias) {
+	const float *input;
+	float       *output;
+	
+	for (uint32_t ch=channels; ch--; ) {				// for all ports/channels:
+		input = &buffer[ch];					// offset interleave input pointer
+		
+		if ((output = ports[ch]) == NULL)
+			continue;
+			
+		const float * const end = output + frames;
+		
+		if (bias == 1) {					// too slow: drop a sample from frame
+			*output  = (input[0] + input[channels])/2;	// output[0] = avg(deinterleave(input[0..1]))
+			 output += 1;
+			
+			input += (channels * 2);			// make output[1] = input[2], ...
+			
+		} else if (bias == -1) {				// too fast: add a sample to frame
+			*output  = input[0];				// make output[0] = input[1], ...
+			 output += 1;
+			
+			*output  = (input[0] + input[channels])/2;	// output[1] = avg(deinterleave(input[0..1]))
+			 output += 1;
+			
+			input += channels;				// make output[2] = input[1], ...
+		}
+		
+		for (; output < end; input += channels)			// for all samples in interleave
+			*output++ = *input;				// copy sample
+	}
+}
+
+/* ######################################################################## */
+void mai_backend_send(float * const *ports, uint32_t frames, uint64_t tai) {
+	const size_t channels = mai.args.channels;			// channels
+	const size_t buflen   = (frames+1) * channels * sizeof(float);	// length of interleaved samples
+	
+	float *buffer = alloca(buflen);					// interleaved samples
+	
+	// match network clock rate
+	int bias = backend_bias(frames);
+	
+	backend_interleave(buffer, ports, channels, frames, bias);
+	mai_meter_block(0, buffer, frames+bias);
+	
+	if (mai.args.measure)
+		mai_measure_encode(buffer, frames+bias, tai);
+		
+	mai_local_write(buffer, frames+bias);			// same host receivers
+	mai_audio_write(0, buffer, frames+bias);			// send audio to RTP
+}
+
+void mai_backend_recv(float * const *ports, uint32_t frames, uint64_t tai) {
+	const size_t channels = mai.args.channels;			// channels
+	const size_t buflen   = (frames+1) * channels * sizeof(float);	// length of interleaved samples
+	
+	float *buffer[MAI_STREAM_MAX];					// interleaved samples per stream
+	
+	// match network clock rate, every stream is on the same ptp clock
+	int bias = backend_bias(frames);
+	
+	// streams added or removed at runtime change here, between periods
+	uint32_t on = mai_audio_streams();
+	
+	// same host sender: the first stream straight from its shared memory
+	if (mai.args.local && (on & 1))
+		mai_local_read(frames+bias);
+		
+	// aligned playout: every stream at its rtp time for this period
+	if (mai.args.align)
+		mai_audio_align(on, tai, frames+bias);
+		
+	for (uint32_t left = on; left; left &= (left - 1)) {
+		size_t s = __builtin_ctz(left);
+		
+		buffer[s] = alloca(buflen);
+		mai_audio_read(s, buffer[s], frames+bias);		// try to get samples from buffer
+	}
+	
+	if (!(on & 1))
+		memset(buffer[0] = alloca(buflen), 0, buflen);		// first stream removed: silence
+		
+	if (mai.args.measure)
+		mai_measure_decode(buffer[0], frames+bias, tai);
+		
+	// one stream straight through: nothing to mix
+	if (!mai_mix_active(on)) {
+		backend_deinterleave(ports, buffer[0], channels, frames, bias);
+		return;
+	}
+	
+	// mixed frames are MAI_MIX_WIDTH ports wide, unused ports are skipped
+	float *mixed = (float *)(((uintptr_t)alloca(((frames+1) * MAI_MIX_WIDTH * sizeof(float)) + 32) + 31) & ~(uintptr_t)31);
+	float *out[MAI_MIX_WIDTH] = { NULL };
+	
+	memcpy(out, ports, channels * sizeof(float *));
+	
+	mai_mix_process(mixed, buffer, frames+bias, on);
+	backend_deinterleave(out, mixed, MAI_MIX_WIDTH, frames, bias);
+}
+
+/* ######################################################################## */
+void mai_backend_clock(int64_t ptp_now) {
+	int64_t backend_now  = backend->frames();
+	
+	int64_t backend_diff = backend_now - clk_backend;
+	int64_t ptp_diff     = ptp_now - clk_ptp;
+	
+	clk_backend = backend_now;
+	clk_ptp     = ptp_now;
+	
+	// ptp=100, backend=101, diff=-1 -- backend too fast
+	// ptp=101, backend=100, diff=+1 -- backend too slow
+	int64_t error = ptp_diff - backend_diff;
+	
+	// during XRUNs and other NTP/PTP events the backend or PTP sample
+	// clock can have large non-linear jumps;  since we're only
+	// interested in preventing small sample rate drift and because RTP
+	// has it's own correction mechanism,  we filter large errors out
+	if ((error < -16) || (error > 16) || (ptp_diff <= 0))
+		return;
+		
+	// learn the clock ratio slowly, the process callback feeds it forward
+	clk_residual  += error - (ptp_diff * backend_ratio);
+	backend_ratio += ((((double)error) / ptp_diff) - backend_ratio) / 64;
+	
+	// backend_error is shared with the process callback threads
+	int64_t whole = clk_residual;
+	
+	clk_residual -= whole;
+	__sync_fetch_and_add(&backend_error, whole);
+}
+
+/* ######################################################################## */
+double mai_backend_ratio(void) {
+	return(backend_ratio);
+}
+
+void mai_backend_ratio_set(double ratio) {
+	backend_ratio = ratio;
+}
+
+/* ######################################################################## */
+int mai_backend_set(const char *name) {
+	// <jack|null|tone|file>[:<argument>]
+	size_t len = strcspn(name, ":");
+	
+	for (const struct backend *b = backend_list; b->name; b++) {
+		if ((strlen(b->name) == len) && !strncmp(b->name, name, len)) {
+			backend = b;
+			return(0);
+		}
+	}
+	return(-1);
+}
+
+int mai_backend_init(void) {
+	// set realtime scheduling with highest priority, an embedding engine keeps its own
+	struct sched_param p = (struct sched_param){ .sched_priority = 99 };
+	
+	if ((backend->init != mai_lib_init) && sched_setscheduler(0, SCHED_RR, &p))
+		return(mai_error("could not set realtime scheduler: %m\n"));
+		
+	// change process privileges
+	if (mai.args.gid && (setgid(mai.args.gid) || setegid(mai.args.gid)))
+		return(mai_error("could not change to group(%d): %m\n", mai.args.gid));
+		
+	if (mai.args.uid && (setuid(mai.args.uid) || seteuid(mai.args.uid)))
+		return(mai_error("could not change to user(%d): %m\n", mai.args.uid));
+		
+	if (!MAI_SENDER && mai_mix_init())
+		return(-1);
+		
+	mai_debug("Backend: %s\n", backend->name);
+	return(backend->init());
+}
+
+int mai_backend_stop(void) {
+	// packet receive has stopped: nothing else uses the audio buffers
+	if (backend->stop)
+		backend->stop();
+		
+	mai_audio_fini();
+	
+	// the next open learns from scratch, or from its state file
+	backend_error = 0;
+	backend_ratio = 0;
+	bias_count    = 0;
+	bias_ffwd     = 0;
+	clk_backend   = 0;
+	clk_ptp       = 0;
+	clk_residual  = 0;
+	return(0);
+}
+
+/* ######################################################################## */
@@ -0,0 +1,60 @@
+#ifndef __MAI_BENCH_H
+#define __MAI_BENCH_H
+
+/* ######################################################################## */
+#define BENCH_NS	100000000ULL			// run each case for at least 100ms
+#define BENCH_RATE	48000				// network sample rate
+#define BENCH_LEN(a)	(sizeof(a) / sizeof((a)[0]))
+
+static const uint32_t bench_bits[]     = { 16, 24, 32 };
+static const uint32_t bench_channels[] = { 1, 2, 8 };
+static const uint32_t bench_ptime[]    = { 125, 1000, 4000 };
+
+/* ######################################################################## */
+// time a statement, returns ns per execution
+#define BENCH_RUN(body) ({								\
+	uint64_t _count = 0, _start = mai_clock_ns(CLOCK_MONOTONIC), _now;		\
+	do {										\
+		for (int _lp=0; _lp < 16; _lp++) {					\
+			body;								\
+			__asm__ volatile("" ::: "memory");				\
+		}									\
+		_count += 16;								\
+	} while (((_now = mai_clock_ns(CLOCK_MONOTONIC)) - _start) < BENCH_NS);		\
+	((double)(_now - _start)) / _count;						\
+})
+
+// all formats: bits x channels x ptime
+#define BENCH_FORMATS(b,c,p)								\
+	for (size_t _b=0; _b < BENCH_LEN(bench_bits); _b++)				\
+	for (size_t _c=0; _c < BENCH_LEN(bench_channels); _c++)				\
+	for (size_t _p=0; _p < BENCH_LEN(bench_ptime); _p++)				\
+	for (uint32_t b = bench_bits[_b], c = bench_channels[_c], p = bench_ptime[_p], _once = 1; _once; _once = 0)
+	
+/* ######################################################################## */
+static inline void bench_setup(uint32_t bits, uint32_t channels, uint32_t ptime) {
+	mai.args.mode     = 'r';
+	mai.args.bits     = bits;
+	mai.args.channels = channels;
+	mai.args.ptime    = ptime;
+	mai.args.rate     = BENCH_RATE;
+	mai.args.streams  = 1;
+}
+
+static inline size_t bench_samples(uint32_t ptime) {
+	// samples per channel in one packet
+	return(((uint64_t)ptime * BENCH_RATE) / 1000000);
+}
+
+static inline void bench_report(const char *name, uint32_t bits, uint32_t channels, uint32_t ptime, double ns) {
+	size_t samples = bench_samples(ptime) * channels;
+	
+	printf("%-20s L%-2u %uch %4uus  %10.1f ns/packet  %7.3f ns/sample\n", name, bits, channels, ptime, ns, ns / samples);
+}
+
+static inline void bench_fill(float *pcm, size_t samples) {
+	for (size_t lp=0; lp < samples; lp++)
+		pcm[lp] = (drand48() * 2.0) - 1.0;
+}
+
+#endif
@@ -0,0 +1,45 @@
+#include "../audio.c"
+#include "bench.h"
+
+/* ######################################################################## */
+static void bench_audio(uint32_t bits, uint32_t channels, uint32_t ptime) {
+	const size_t frames  = bench_samples(ptime);
+	const size_t samples = frames * channels;
+	
+	float *pcm = malloc(samples * sizeof(float));
+	char  *net = malloc(samples * sizeof(int32_t));
+	
+	bench_setup(bits, channels, ptime);
+	bench_fill(pcm, samples);
+	
+	mai_audio_size(frames * 4);
+	mai_audio_init(BENCH_RATE);
+	
+	// network integer to float, then float to integer with dither
+	bench_report("cvt_int", bits, channels, ptime, BENCH_RUN(cvt_packet_int(pcm, net, samples)));
+	bench_report("cvt_float+dither", bits, channels, ptime, BENCH_RUN(cvt_packet_float(net, pcm, samples)));
+	bench_report("meter", bits, channels, ptime, BENCH_RUN(mai_meter_block(0, pcm, frames)));
+	
+	// resample 44.1k jack to 48k network (sender), buffer drained every packet
+	mai.args.mode = 's';
+	mai_audio_init(44100);
+	
+	bench_report("src_write", bits, channels, ptime, BENCH_RUN({ mai_audio_write(0, pcm, frames); jack_ringbuffer_reset(buf[0]); }));
+	
+	src_delete(src[0]);
+	src[0] = NULL;
+	
+	jack_ringbuffer_free(buf[0]);
+	free(pcm);
+	free(net);
+}
+
+/* ######################################################################## */
+int main(void) {
+	srand48(1);
+	
+	BENCH_FORMATS(bits, channels, ptime)
+		bench_audio(bits, channels, ptime);
+		
+	return(0);
+}
@@ -0,0 +1,41 @@
+#include "../backend.c"
+#include "bench.h"
+
+/* ######################################################################## */
+static void bench_backend(uint32_t channels, uint32_t frames) {
+	float *ports[8], *buffer = malloc((frames + 1) * channels * sizeof(float));
+	
+	for (uint32_t ch=0; ch < channels; ch++) {
+		ports[ch] = malloc(frames * sizeof(float));
+		bench_fill(ports[ch], frames);
+	}
+	
+	// jack period sized, reported per packet of <frames> samples
+	for (int bias=-1; bias <= 1; bias++) {
+		char name[32];
+		
+		snprintf(name, sizeof(name), "interleave %+d", bias);
+		bench_report(name, 32, channels, (frames * 1000000) / BENCH_RATE, BENCH_RUN(backend_interleave(buffer, ports, channels, frames, bias)));
+		
+		snprintf(name, sizeof(name), "deinterleave %+d", bias);
+		bench_report(name, 32, channels, (frames * 1000000) / BENCH_RATE, BENCH_RUN(backend_deinterleave(ports, buffer, channels, frames, bias)));
+	}
+	
+	for (uint32_t ch=0; ch < channels; ch++)
+		free(ports[ch]);
+		
+	free(buffer);
+}
+
+/* ######################################################################## */
+int main(void) {
+	srand48(1);
+	
+	// interleave is format independent (float): channels x period size
+	for (size_t c=0; c < BENCH_LEN(bench_channels); c++) {
+		for (size_t p=0; p < BENCH_LEN(bench_ptime); p++)
+			bench_backend(bench_channels[c], bench_samples(bench_ptime[p]));
+	}
+	
+	return(0);
+}
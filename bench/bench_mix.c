@@ -0,0 +1,53 @@
+#include "../mix.c"
+#include "bench.h"
+
+/* ######################################################################## */
+static void bench_mix(uint32_t channels, uint32_t frames, size_t streams) {
+	float *in[MAI_STREAM_MAX], *out;
+	char   name[32];
+	
+	bench_setup(32, channels, 1000);
+	mai.args.streams = streams;
+	
+	for (size_t s=0; s < streams; s++) {
+		in[s] = malloc(frames * channels * sizeof(float));
+		bench_fill(in[s], frames * channels);
+	}
+	
+	if (posix_memalign((void **)&out, 32, frames * MAI_MIX_WIDTH * sizeof(float)))
+		return;
+		
+	mai_mix_init();
+	
+	// per packet of <frames>, all streams summed into <channels> ports
+	snprintf(name, sizeof(name), "mix %zu streams", streams);
+	bench_report(name, 32, channels, (frames * 1000000) / BENCH_RATE, BENCH_RUN(mai_mix_process(out, in, frames, (1u << streams) - 1)));
+	
+	// every input ramping for the whole packet
+	snprintf(name, sizeof(name), "mix %zu ramping", streams);
+	bench_report(name, 32, channels, (frames * 1000000) / BENCH_RATE, BENCH_RUN({
+		for (size_t s=0; s < streams; s++)
+			for (size_t ch=0; ch < channels; ch++)
+				mai_mix_gain(ch, s, ch, (_lp & 1) ? 1.0f : 0.5f, frames * 2);
+		mai_mix_process(out, in, frames, (1u << streams) - 1);
+	}));
+	
+	for (size_t s=0; s < streams; s++)
+		free(in[s]);
+		
+	free(out);
+}
+
+/* ######################################################################## */
+int main(void) {
+	static const size_t streams[] = { 1, 2, 4, 8 };
+	
+	srand48(1);
+	
+	for (size_t c=0; c < BENCH_LEN(bench_channels); c++) {
+		for (size_t s=0; s < BENCH_LEN(streams); s++)
+			bench_mix(bench_channels[c], bench_samples(1000), streams[s]);
+	}
+	
+	return(0);
+}
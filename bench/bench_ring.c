@@ -0,0 +1,61 @@
+#include "../ring.c"
+#include "bench.h"
+
+/* ######################################################################## */
+static int bench_send(int sk[2], uint8_t proto, uint32_t dst, uint16_t frag, uint16_t port) {
+	// ip header (20 bytes) and udp header, as the packet socket sees them
+	uint8_t pkt[28] = { 0x45 };
+	uint8_t got[sizeof(pkt)];
+	
+	pkt[6]  = frag >> 8;
+	pkt[7]  = frag & 0xFF;
+	pkt[9]  = proto;
+	pkt[16] = dst >> 24;
+	pkt[17] = dst >> 16;
+	pkt[18] = dst >> 8;
+	pkt[19] = dst;
+	pkt[22] = port >> 8;
+	pkt[23] = port & 0xFF;
+	
+	// a dropped datagram still sends, it just never arrives
+	if (send(sk[0], pkt, sizeof(pkt), 0) != sizeof(pkt))
+		return(-1);
+		
+	return(recv(sk[1], got, sizeof(got), MSG_DONTWAIT) == sizeof(pkt));
+}
+
+/* ######################################################################## */
+int main(void) {
+	// the ring filter on a datagram socket pair: it runs from the first payload byte
+	static const struct {
+		const char	*name;
+		uint8_t		 proto;
+		uint32_t	 dst;
+		uint16_t	 frag;
+		uint16_t	 port;
+		int		 keep;
+	} cases[] = {
+		{ "stream",		IPPROTO_UDP,	0xEF450909,	0x4000,	5004,	1 },
+		{ "not udp",		IPPROTO_TCP,	0xEF450909,	0x4000,	5004,	0 },
+		{ "other group",	IPPROTO_UDP,	0xEF45090A,	0x4000,	5004,	0 },
+		{ "fragment",		IPPROTO_UDP,	0xEF450909,	0x00B9,	5004,	0 },
+		{ "other port",		IPPROTO_UDP,	0xEF450909,	0x4000,	5006,	0 },
+	};
+	
+	struct in_addr group = (struct in_addr){ .s_addr = htonl(0xEF450909) };
+	int            sk[2], failed = 0;
+	
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sk) || ring_filter(sk[1], &group, 5004))
+		return(mai_error("ring filter: %m\n"));
+		
+	for (size_t lp=0; lp < BENCH_LEN(cases); lp++) {
+		int kept = bench_send(sk, cases[lp].proto, cases[lp].dst, cases[lp].frag, cases[lp].port);
+		
+		printf("%-20s %s\n", cases[lp].name, (kept == cases[lp].keep) ? "ok" : "FAILED");
+		failed |= (kept != cases[lp].keep);
+	}
+	
+	close(sk[0]);
+	close(sk[1]);
+	return(failed);
+}
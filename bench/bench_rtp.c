@@ -0,0 +1,76 @@
+#include "../rtp.c"
+#include "bench.h"
+
+/* ######################################################################## */
+#define BENCH_PACKETS	600				// arrival pattern length (multiple of ROB_LEN)
+
+// arrival order of packet i within the pattern
+static size_t order_inorder(size_t i) { return(i); }
+static size_t order_swap(size_t i)    { return(i ^ 1); }
+static size_t order_reverse(size_t i) { return(((i / ROB_LEN) * ROB_LEN) + (ROB_LEN - 1 - (i % ROB_LEN))); }
+static size_t order_loss(size_t i)    { return(i + (i / 99)); }
+
+static const struct {
+	const char	*name;
+	size_t		(*order)(size_t);
+} bench_pattern[] = {
+	{ "rob_scan in-order",	order_inorder	},
+	{ "rob_scan swap-pairs",	order_swap	},
+	{ "rob_scan reverse-6",	order_reverse	},
+	{ "rob_scan loss-1%",	order_loss	},
+};
+
+/* ######################################################################## */
+static void bench_rtp(uint32_t bits, uint32_t channels, uint32_t ptime) {
+	const size_t frames = bench_samples(ptime);
+	const size_t paylen = frames * channels * (bits / 8);
+	const size_t pktlen = sizeof(struct packet) + paylen;
+	
+	struct packet *packet = calloc(1, pktlen);
+	float         *drain  = malloc(frames * channels * sizeof(float));
+	
+	bench_setup(bits, channels, ptime);
+	
+	rtp_samples = frames;
+	mai_audio_size(frames * (ROB_LEN + 1));
+	mai_audio_init(BENCH_RATE);
+	
+	// one receiving stream, reorder slots as mai_rtp_init() sizes them without fec
+	for (rob_slots = 1; rob_slots < (rob_window + 1); rob_slots <<= 1)
+		;
+		
+	free(rtp_stream[0].rob);
+	rtp_stream[0] = (struct stream){ .sock = -1, .on = 1, .rob = calloc(rob_slots, sizeof(struct mai_rtp_slot) + ROB_PAYLOAD) };
+	
+	packet->vpxcc = 0b10000000;
+	packet->mpt   = 96;
+	
+	for (size_t pt=0; pt < BENCH_LEN(bench_pattern); pt++) {
+		uint16_t base = rtp_stream[0].next + (ROB_LEN * 3);	// resync away from the last pattern
+		size_t   lp   = 0;
+		
+		// every packet: receive in pattern order, then drain audio as jack would
+		double ns = BENCH_RUN({
+			size_t i = lp++;
+			
+			packet->seq = htons(base + (((i / BENCH_PACKETS) * BENCH_PACKETS) + bench_pattern[pt].order(i % BENCH_PACKETS)));
+			rtp_packet((uint8_t *)packet, pktlen, &rtp_stream[0]);
+			mai_audio_read(0, drain, frames);
+		});
+		
+		bench_report(bench_pattern[pt].name, bits, channels, ptime, ns);
+	}
+	
+	free(packet);
+	free(drain);
+}
+
+/* ######################################################################## */
+int main(void) {
+	srand48(1);
+	
+	BENCH_FORMATS(bits, channels, ptime)
+		bench_rtp(bits, channels, ptime);
+		
+	return(0);
+}
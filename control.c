@@ -0,0 +1,232 @@
+#include "mai.h"
+#include <sys/un.h>
+
+/* ######################################################################## */
+#define CONTROL_LINE	512				// longest command line
+#define CONTROL_ARGS	8				// words per command
+#define CONTROL_RAMP_MS	10				// default gain ramp
+
+struct command {
+	const char	*name;				// first word
+	const char	*usage;				// arguments
+	int		 mode;				// 's', 'r' or '*'
+	int		 argc;				// required arguments
+	const char	*(*func)(int sk, int argc, char **argv);
+};
+
+static int		 ctl_sock = -1;			// control listener
+static pthread_t	 ctl_tid;
+
+/* ######################################################################## */
+static int control_stream(const char *arg) {
+	// 1 based stream number, -1 if out of range
+	int s = atoi(arg) - 1;
+	return(((s < 0) || (s >= MAI_STREAM_MAX)) ? -1 : s);
+}
+
+static const char *control_streams(int sk, int argc __attribute__((__unused__)), char **argv __attribute__((__unused__))) {
+	uint32_t on = mai_rtp_streams();
+	
+	for (size_t s=0, target, fill; s < MAI_STREAM_MAX; s++) {
+		if (!(on & (1u << s)))
+			continue;
+			
+		fill = mai_audio_fill(s, &target);
+		dprintf(sk, "%zu %s:%u fill=%zu target=%zu", s + 1, mai.args.stream[s].addr, mai.args.stream[s].port, fill, target);
+		
+		if (mai.args.align)
+			dprintf(sk, " skew=%" PRId32, mai_audio_skew(s));
+			
+		dprintf(sk, "\n");
+	}
+	return(NULL);
+}
+
+static const char *control_add(int sk, int argc __attribute__((__unused__)), char **argv) {
+	char *port = strchr(argv[1], ':');
+	int   num  = port ? atoi(port + 1) : 5004;
+	
+	if (port)
+		*port = 0;
+		
+	if ((num < 1025) || (num > 49152))
+		return("port must be within 1025..49152");
+		
+	int s = mai_rtp_stream_add(argv[1], num);
+	
+	if (s < 0)
+		return("could not add stream (no free slot, bad address or ring mode)");
+		
+	dprintf(sk, "%d\n", s + 1);
+	return(NULL);
+}
+
+static const char *control_del(int sk __attribute__((__unused__)), int argc __attribute__((__unused__)), char **argv) {
+	int s = control_stream(argv[1]);
+	
+	return(((s < 0) || mai_rtp_stream_del(s)) ? "no such stream" : NULL);
+}
+
+static const char *control_target(int sk __attribute__((__unused__)), int argc __attribute__((__unused__)), char **argv) {
+	int    s  = control_stream(argv[1]);
+	double ms = atof(argv[2]);
+	
+	if ((s < 0) || (ms < 0))
+		return("usage: target <stream> <ms>");
+		
+	return(mai_audio_target(s, (ms * mai.args.rate) / 1000) ? "target larger than the audio buffer, or playout aligned" : NULL);
+}
+
+static const char *control_gain(int sk __attribute__((__unused__)), int argc, char **argv) {
+	// <port> <stream>.<channel> <dB|off> [<ms>]
+	unsigned port = atoi(argv[1]), stream, channel;
+	double   ms   = (argc > 4) ? atof(argv[4]) : CONTROL_RAMP_MS;
+	float    gain = strcmp(argv[3], "off") ? pow(10, atof(argv[3]) / 20) : 0.0f;
+	
+	if ((sscanf(argv[2], "%u.%u", &stream, &channel) != 2) || !port || (port > mai.args.channels) || !stream || (stream > MAI_STREAM_MAX) || !channel || (channel > mai.args.channels) || (ms < 0))
+		return("usage: gain <port> <stream>.<channel> <dB|off> [<ms>]");
+		
+	mai_mix_gain(port - 1, stream - 1, channel - 1, gain, (ms * mai.args.rate) / 1000);
+	return(NULL);
+}
+
+static const char *control_connect(int sk __attribute__((__unused__)), int argc __attribute__((__unused__)), char **argv) {
+	int port = atoi(argv[1]);
+	
+	if ((port < 1) || mai_jack_connect(port - 1, argv[2], !strcmp(argv[0], "connect")))
+		return("jack connection failed (jack backend, port 1..channels)");
+		
+	return(NULL);
+}
+
+static const char *control_meter(int sk, int argc __attribute__((__unused__)), char **argv __attribute__((__unused__))) {
+	struct mai_meter m;
+	
+	for (size_t s=0; s < MAI_STREAM_MAX; s++) {
+		if (mai_meter_get(s, &m))
+			continue;
+			
+		dprintf(sk, "%zu", s + 1);
+		
+		for (size_t ch=0; ch < m.channels; ch++)
+			dprintf(sk, " %.1f/%.1f/%" PRIu64, 20 * log10(m.peak[ch] + 1e-10), 20 * log10(m.rms[ch] + 1e-10), m.clips[ch]);
+			
+		dprintf(sk, "\n");
+	}
+	return(NULL);
+}
+
+static const char *control_help(int sk, int argc, char **argv);
+
+static const struct command ctl_command[] = {
+	{ "streams",	"",					'r', 1, control_streams	},
+	{ "add",	"<ip>[:<port=5004>]",			'r', 2, control_add	},
+	{ "del",	"<stream>",				'r', 2, control_del	},
+	{ "target",	"<stream> <ms>",			'r', 3, control_target	},
+	{ "gain",	"<port> <stream>.<channel> <dB|off> [<ms>]",	'r', 4, control_gain	},
+	{ "connect",	"<port> <jack port>",			'*', 3, control_connect	},
+	{ "disconnect",	"<port> <jack port>",			'*', 3, control_connect	},
+	{ "meter",	"",					'*', 1, control_meter	},
+	{ "help",	"",					'*', 1, control_help	},
+	{ NULL }
+};
+
+static const char *control_help(int sk, int argc __attribute__((__unused__)), char **argv __attribute__((__unused__))) {
+	for (const struct command *c = ctl_command; c->name; c++) {
+		if ((c->mode == '*') || (c->mode == mai.args.mode))
+			dprintf(sk, "%s %s\n", c->name, c->usage);
+	}
+	return(NULL);
+}
+
+/* ######################################################################## */
+static void control_line(int sk, char *line) {
+	// one command per line, answered with its output then "ok" or "error: <reason>"
+	char       *argv[CONTROL_ARGS], *save = NULL;
+	int         argc = 0;
+	const char *err  = "unknown command, try help";
+	
+	for (char *word; (argc < CONTROL_ARGS) && ((word = strtok_r(argc ? NULL : line, " \t\r\n", &save)) != NULL); )
+		argv[argc++] = word;
+		
+	if (!argc)
+		return;
+		
+	for (const struct command *c = ctl_command; c->name; c++) {
+		if (strcmp(c->name, argv[0]) || ((c->mode != '*') && (c->mode != mai.args.mode)))
+			continue;
+			
+		err = (argc < c->argc) ? c->usage : c->func(sk, argc, argv);
+		break;
+	}
+	
+	mai_debug("Control: %s: %s\n", argv[0], err ? err : "ok");
+	
+	if (err) dprintf(sk, "error: %s\n", err);
+	else     dprintf(sk, "ok\n");
+}
+
+static void *control_thread(void *arg) {
+	// one client at a time: commands are rare and every change is queued
+	while (1) {
+		int sk = accept(ctl_sock, NULL, NULL);
+		
+		if (sk < 0)
+			continue;
+			
+		FILE *in = fdopen(sk, "r");
+		char  line[CONTROL_LINE];
+		
+		if (!in) {
+			close(sk);
+			continue;
+		}
+		
+		while (fgets(line, sizeof(line), in))
+			control_line(sk, line);
+			
+		fclose(in);
+	}
+	
+	mai_error("Unexpected Thread Exit!");
+	return(arg);
+}
+
+/* ######################################################################## */
+int mai_control_start(void) {
+	if (!mai.args.control)
+		return(0);
+		
+	struct sockaddr_un addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+	
+	if (strlen(mai.args.control) >= sizeof(addr.sun_path))
+		return(mai_error("control socket path too long\n"));
+		
+	strcpy(addr.sun_path, mai.args.control);
+	unlink(addr.sun_path);
+	
+	if ((ctl_sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return(mai_error("socket: %m\n"));
+		
+	if (bind(ctl_sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(ctl_sock, 4))
+		return(mai_error("control socket (%s): %m\n", mai.args.control));
+		
+	mai_debug("Control: %s\n", mai.args.control);
+	
+	return(mai_thread_create(&ctl_tid, "control", control_thread, NULL));
+}
+
+int mai_control_stop(void) {
+	if (ctl_sock < 0)
+		return(0);
+		
+	mai_thread_stop(&ctl_tid);
+	
+	close(ctl_sock);
+	unlink(mai.args.control);
+	
+	ctl_sock = -1;
+	return(0);
+}
+
+/* ######################################################################## */
@@ -0,0 +1,478 @@
+#include "mai.h"
+
+/* ######################################################################## */
+// SMPTE 2022-1 style XOR parity: L columns by D rows of media packets,
+// column repairs on port+2 and row repairs on port+4
+#define FEC_PORT_COL	2				// port offset: column repairs
+#define FEC_PORT_ROW	4				// port offset: row repairs
+#define FEC_QUEUE	64				// repairs held per stream and direction
+#define FEC_PT		96				// media payload type (recovery xor)
+
+// repair packet header, after the rtp header
+struct fec {
+	uint16_t	base;		// SNBase: first protected sequence number
+	uint16_t	len;		// Length Recovery: xor of payload lengths
+	uint8_t		ept;		// E(1), PT Recovery(7)
+	uint8_t		mask[3];	// Mask (unused, 0)
+	uint32_t	time;		// TS Recovery: xor of rtp times
+	uint8_t		xdti;		// X(1), D(1): 0 column 1 row, Type(3), Index(3)
+	uint8_t		offset;		// sequence step between protected packets
+	uint8_t		na;		// protected packets
+	uint8_t		ext;		// SNBase extension (unused, 0)
+} __attribute__((__packed__));
+
+// a repair: sender accumulator, receiver queue entry
+struct repair {
+	uint16_t	base;		// first protected sequence number
+	uint16_t	len;		// xor of payload lengths (receiver: recovered length)
+	uint32_t	time;		// xor of rtp times
+	uint8_t		pt;		// xor of payload types
+	uint8_t		offset;		// sequence step
+	uint8_t		na;		// protected packets
+	uint8_t		dir;		// 0: column, 1: row
+	uint16_t	bytes;		// xor payload length
+	char		payload[];	// xor of payloads, zero padded
+};
+
+// receiver: one queue per repair socket, the socket thread produces and the
+// stream's rtp path consumes, repairs stay until their last packet is due
+struct queue {
+	int		 sock;			// repair socket (-1: closed)
+	size_t		 stream;		// stream number
+	uint32_t	 head, tail;		// consumer, producer
+	uint32_t	 checked;		// consumer: repairs tried at arrival
+	uint8_t		*entry;			// FEC_QUEUE repairs
+};
+
+static uint32_t		 fec_cols = 0;			// L: packets per row (0: fec off)
+static uint32_t		 fec_rows = 0;			// D: packets per column
+static size_t		 fec_bytes;			// media payload bytes
+static size_t		 fec_stride;			// bytes per repair
+
+static struct queue	 fec_queue[MAI_STREAM_MAX][2] = { [0 ... MAI_STREAM_MAX-1] = { { .sock = -1 }, { .sock = -1 } } };	// receiver: column, row queues
+
+static uint8_t		*fec_acc;			// sender: row then column accumulators
+static uint32_t		 fec_index = 0;			// sender: position in the matrix
+static uint16_t		 fec_seq[2];			// sender: column, row sequence numbers
+
+static uint8_t		*fec_out;			// sender: repair packets due
+static size_t		 fec_outs = 0, fec_outmax;
+static struct sockaddr_in fec_dest[1 + MAI_DEST_MAX][2];	// sender: group and unicast, per direction
+static size_t		 fec_dests = 0;
+
+#define FEC_REPAIR(base, n) ((struct repair *)((base) + ((n) * fec_stride)))
+
+/* ######################################################################## */
+int mai_fec_set(const char *spec) {
+	// <L>[x<D>]: rows of L packets, columns of D packets, at most 100 per matrix; NULL: off
+	unsigned cols, rows = 1;
+	int      len = 0;
+	
+	if (!spec) {
+		fec_cols = fec_rows = 0;
+		return(0);
+	}
+	
+	if ((sscanf(spec, "%u%n", &cols, &len) != 1) || (spec[len] && (sscanf(spec + len, "x%u%n", &rows, &len) != 1)))
+		return(-1);
+		
+	if (!cols || (cols > 20) || !rows || (rows > 20) || ((cols * rows) > 100) || ((cols * rows) < 2))
+		return(-1);
+		
+	fec_cols = cols;
+	fec_rows = rows;
+	return(0);
+}
+
+size_t mai_fec_span(void) {
+	// packets a repair reaches back: the receiver keeps them after playout
+	if (!fec_cols)
+		return(0);
+		
+	return((fec_rows > 1) ? ((fec_rows - 1) * fec_cols) : (fec_cols - 1));
+}
+
+/* ######################################################################## */
+static void fec_xor(struct repair *r, uint16_t len, uint32_t time, uint8_t pt, const char *payload) {
+	r->len  ^= len;
+	r->time ^= time;
+	r->pt   ^= pt;
+	
+	for (size_t lp=0; lp < len; lp++)
+		r->payload[lp] ^= payload[lp];
+		
+	if (len > r->bytes)
+		r->bytes = len;
+}
+
+static void fec_start(struct repair *r, uint16_t base, uint8_t offset, uint8_t na, uint8_t dir) {
+	memset(r, 0, fec_stride);
+	
+	r->base   = base;
+	r->offset = offset;
+	r->na     = na;
+	r->dir    = dir;
+}
+
+static void fec_emit(const struct repair *r, uint32_t time) {
+	// rtp header, fec header, xor payload
+	if (fec_outs >= fec_outmax)
+		return;
+		
+	uint8_t    *pkt = fec_out + (fec_outs++ * (12 + sizeof(struct fec) + fec_bytes));
+	struct fec *fec = (struct fec *)(pkt + 12);
+	
+	pkt[0] = 0b10000000;					// Version=2, P=0, X=0, CC=0
+	pkt[1] = FEC_PT;					// M=0, PT=96
+	*(uint16_t *)(pkt + 2) = htons(fec_seq[r->dir]++);
+	*(uint32_t *)(pkt + 4) = htonl(time);
+	*(uint32_t *)(pkt + 8) = 0;				// SSRC 0
+	
+	*fec = (struct fec){
+		.base   = htons(r->base),
+		.len    = htons(r->len),
+		.ept    = 0x80 | (r->pt & 0x7F),
+		.time   = htonl(r->time),
+		.xdti   = r->dir ? 0x40 : 0x00,
+		.offset = r->offset,
+		.na     = r->na
+	};
+	
+	memcpy(pkt + 12 + sizeof(*fec), r->payload, fec_bytes);
+}
+
+void mai_fec_encode(uint16_t seq, uint32_t time, const char *payload, size_t len) {
+	// sender: each packet joins its row and its column, full ones are emitted
+	if (!fec_cols)
+		return;
+		
+	const uint32_t col = fec_index % fec_cols;
+	const uint32_t row = fec_index / fec_cols;
+	
+	if (fec_cols > 1) {
+		struct repair *r = FEC_REPAIR(fec_acc, 0);
+		
+		if (!col)
+			fec_start(r, seq, 1, fec_cols, 1);
+			
+		fec_xor(r, len, time, FEC_PT, payload);
+		
+		if (col == (fec_cols - 1))
+			fec_emit(r, time);
+	}
+	
+	if (fec_rows > 1) {
+		struct repair *r = FEC_REPAIR(fec_acc, 1 + col);
+		
+		if (!row)
+			fec_start(r, seq, fec_cols, fec_rows, 0);
+			
+		fec_xor(r, len, time, FEC_PT, payload);
+		
+		// the last row completes one column per packet, so repairs spread out
+		if (row == (fec_rows - 1))
+			fec_emit(r, time);
+	}
+	
+	fec_index = (fec_index + 1) % (fec_cols * fec_rows);
+}
+
+ssize_t mai_fec_send(int sock) {
+	// sender: repairs due after the media packets they protect, one call
+	const size_t pktlen  = 12 + sizeof(struct fec) + fec_bytes;
+	const size_t total   = fec_outs * fec_dests;
+	size_t       sent    = 0;
+	
+	if (!fec_outs)
+		return(0);
+		
+	struct mmsghdr *msg = alloca(total * sizeof(*msg));
+	struct iovec   *iov = alloca(fec_outs * sizeof(*iov));
+	
+	for (size_t p=0; p < fec_outs; p++) {
+		uint8_t *pkt = fec_out + (p * pktlen);
+		int      dir = !!(pkt[12 + offsetof(struct fec, xdti)] & 0x40);
+		
+		iov[p] = (struct iovec){ .iov_base = pkt, .iov_len = pktlen };
+		
+		for (size_t t=0; t < fec_dests; t++) {
+			msg[(p * fec_dests) + t] = (struct mmsghdr){ .msg_hdr = {
+				.msg_name    = &fec_dest[t][dir],
+				.msg_namelen = sizeof(fec_dest[0][0]),
+				.msg_iov     = &iov[p],
+				.msg_iovlen  = 1
+			}};
+		}
+	}
+	
+	while (sent < total) {
+		int done = sendmmsg(sock, msg + sent, ((total - sent) > IOV_MAX) ? IOV_MAX : (total - sent), 0);
+		
+		MAI_STAT_INC(rtp.calls);
+		
+		if (done <= 0)
+			break;
+			
+		sent += done;
+	}
+	
+	MAI_STAT_ADD(rtp.repair, sent);
+	fec_outs = 0;
+	
+	return((sent == total) ? (ssize_t)sent : -1);
+}
+
+/* ######################################################################## */
+static void fec_packet(uint8_t *buffer, ssize_t len, void *arg) {
+	// repair socket thread: parse into the queue, the rtp path does the work
+	struct queue *q = arg;
+	
+	if ((len < (ssize_t)(12 + sizeof(struct fec))) || ((buffer[0] & 0b11010000) != 0b10000000))
+		return;							// skip: bad version or extension
+		
+	const size_t      hdr = 12 + ((buffer[0] & 0b00001111) * sizeof(uint32_t));
+	const struct fec *fec = (const struct fec *)(buffer + hdr);
+	const ssize_t     pay = len - hdr - sizeof(*fec);
+	
+	// the receiver only keeps mai_fec_span() packets after playout
+	if ((pay <= 0) || ((size_t)pay > fec_bytes) || !fec->offset || !fec->na || ((size_t)(fec->offset * (fec->na - 1)) > mai_fec_span()))
+		return;
+		
+	if ((q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) >= FEC_QUEUE)
+		return;							// skip: queue full
+		
+	struct repair *r = FEC_REPAIR(q->entry, q->tail % FEC_QUEUE);
+	
+	*r = (struct repair){
+		.base   = ntohs(fec->base),
+		.len    = ntohs(fec->len),
+		.time   = ntohl(fec->time),
+		.pt     = fec->ept & 0x7F,
+		.offset = fec->offset,
+		.na     = fec->na,
+		.dir    = !!(fec->xdti & 0x40),
+		.bytes  = pay
+	};
+	memcpy(r->payload, fec + 1, pay);
+	
+	MAI_STAT_INC(rtp.repair);
+	__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+static int fec_repair(const struct repair *r, uint16_t next, mai_fec_slot slot, void *arg) {
+	// one protected packet missing and not yet due: xor it back together
+	struct mai_rtp_slot *lost = NULL;
+	uint16_t             seq  = 0;
+	
+	for (uint32_t k=0; k < r->na; k++) {
+		uint16_t             s = r->base + (k * r->offset);
+		struct mai_rtp_slot *p = slot(arg, s);
+		
+		if (p->len && (p->seq == s))
+			continue;
+			
+		if (lost || ((int16_t)(s - next) < 0))
+			return(0);					// two missing, or too late
+			
+		lost = p;
+		seq  = s;
+	}
+	
+	if (!lost)
+		return(0);
+		
+	uint16_t len  = r->len;
+	uint32_t time = r->time;
+	char    *data = lost->payload;
+	
+	memcpy(data, r->payload, r->bytes);
+	
+	for (uint32_t k=0; k < r->na; k++) {
+		const struct mai_rtp_slot *p = slot(arg, r->base + (k * r->offset));
+		
+		if (p == lost)
+			continue;
+			
+		len  ^= p->len;
+		time ^= p->time;
+		
+		for (size_t lp=0; lp < p->len; lp++)
+			data[lp] ^= p->payload[lp];
+	}
+	
+	if (!len || (len > r->bytes))
+		return(0);						// skip: not from this stream
+		
+	lost->seq  = seq;
+	lost->time = time;
+	lost->len  = len;
+	
+	MAI_STAT_INC(rtp.recovered);
+	return(1);
+}
+
+size_t mai_fec_recover(size_t stream, uint16_t next, int retry, mai_fec_slot slot, void *arg) {
+	// rtp path: new repairs are tried once on arrival, all of them again on a
+	// loss (a row may since have rebuilt the other packet missing in a column)
+	size_t found = 0;
+	
+	if (!fec_cols)
+		return(0);
+		
+	for (int pass=0; pass < 4; pass++) {
+		size_t got = 0;
+		
+		for (int dir=0; dir < 2; dir++) {
+			struct queue *q    = &fec_queue[stream][dir];
+			uint32_t      tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+			uint32_t      head = q->head;
+			
+			// done with: every protected packet played out or skipped
+			for (; head != tail; head++) {
+				const struct repair *r = FEC_REPAIR(q->entry, head % FEC_QUEUE);
+				
+				if ((int16_t)((uint16_t)(r->base + (r->offset * (r->na - 1))) - next) >= 0)
+					break;
+			}
+			
+			__atomic_store_n(&q->head, head, __ATOMIC_RELEASE);
+			
+			for (uint32_t lp = (retry || ((int32_t)(q->checked - head) < 0)) ? head : q->checked; lp != tail; lp++)
+				got += fec_repair(FEC_REPAIR(q->entry, lp % FEC_QUEUE), next, slot, arg);
+				
+			q->checked = tail;
+		}
+		
+		if (!got)
+			break;
+			
+		found += got;
+		retry  = 1;
+	}
+	
+	return(found);
+}
+
+void mai_fec_reset(size_t stream) {
+	// rtp path: sequence resync, the queued repairs belong to the old numbers
+	for (int dir=0; dir < 2; dir++) {
+		struct queue *q = &fec_queue[stream][dir];
+		
+		q->checked = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&q->head, q->checked, __ATOMIC_RELEASE);
+	}
+}
+
+/* ######################################################################## */
+int mai_fec_open(size_t stream, const char *addr, uint16_t port, int with) {
+	// receiver: the stream's repair sockets, before its first packet,
+	// received next to the stream socket <with> (shards: on its worker)
+	if (!fec_cols)
+		return(0);
+		
+	mai_fec_reset(stream);
+	
+	for (int dir=0; dir < 2; dir++) {
+		struct queue *q = &fec_queue[stream][dir];
+		uint16_t      p = port + (dir ? FEC_PORT_ROW : FEC_PORT_COL);
+		
+		if ((q->sock = mai_sock_open('r', addr, p)) <= 0) {
+			q->sock = -1;
+			return(mai_error("could not open fec socket (%s:%u)\n", addr, p));
+		}
+		
+		if (mai_loop_join("fec", q->sock, fec_packet, q, with))
+			return(-1);
+	}
+	
+	return(mai_debug("FEC Stream %zu: %s:%u (columns), %s:%u (rows)\n", stream + 1, addr, port + FEC_PORT_COL, addr, port + FEC_PORT_ROW));
+}
+
+void mai_fec_close(size_t stream) {
+	for (int dir=0; fec_cols && (dir < 2); dir++) {
+		struct queue *q = &fec_queue[stream][dir];
+		
+		if (q->sock < 0)
+			continue;
+			
+		// the event loop closes it, or once stopped no longer knows it
+		if (mai_loop_del(q->sock))
+			close(q->sock);
+			
+		q->sock = -1;
+	}
+}
+
+/* ######################################################################## */
+static int fec_dest_add(const char *addr, uint16_t port) {
+	for (int dir=0; dir < 2; dir++) {
+		struct sockaddr_in *d = &fec_dest[fec_dests][dir];
+		
+		*d = (struct sockaddr_in){ .sin_family = AF_INET, .sin_port = htons(port + (dir ? FEC_PORT_ROW : FEC_PORT_COL)) };
+		
+		if (!inet_aton(addr, &d->sin_addr))
+			return(mai_error("fec address (%s): invalid\n", addr));
+	}
+	
+	fec_dests += 1;
+	return(0);
+}
+
+int mai_fec_init(void) {
+	if (!fec_cols)
+		return(0);
+		
+	const uint32_t repairs = ((fec_cols > 1) ? fec_rows : 0) + ((fec_rows > 1) ? fec_cols : 0);
+	const double   ptime   = mai.args.ptime / 1000.0;
+	
+	fec_bytes  = mai_rtp_samples() * mai.args.channels * (mai.args.bits / 8);
+	fec_stride = (sizeof(struct repair) + fec_bytes + 7) & ~(size_t)7;
+	
+	// buffers of an earlier open, their sizes may differ
+	free(fec_acc);
+	free(fec_out);
+	
+	fec_acc   = fec_out = NULL;
+	fec_index = 0;
+	fec_outs  = 0;
+	fec_dests = 0;
+	
+	if (MAI_SENDER) {
+		// a batch of up to RTP_BATCH packets can complete a row and a column each
+		fec_outmax = 2 * 64;
+		
+		if (((fec_acc = calloc(1 + fec_cols, fec_stride)) == NULL) || ((fec_out = calloc(fec_outmax, 12 + sizeof(struct fec) + fec_bytes)) == NULL))
+			return(mai_error("failed to allocate fec buffers!\n"));
+			
+		fec_seq[0] = lrand48() & 0xFFFF;
+		fec_seq[1] = lrand48() & 0xFFFF;
+		
+		if (fec_dest_add(mai.args.addr, mai.args.port))
+			return(-1);
+			
+		for (size_t d=0; d < mai.args.dests; d++) {
+			if (fec_dest_add(mai.args.dest[d].addr, mai.args.dest[d].port ? mai.args.dest[d].port : mai.args.port))
+				return(-1);
+		}
+		
+		return(mai_debug("FEC: %ux%u matrix, %u repairs per %u packets (+%.0f%% bandwidth)\n", fec_cols, fec_rows, repairs, fec_cols * fec_rows, (100.0 * repairs) / (fec_cols * fec_rows)));
+	}
+	
+	// receiver: a column repair comes (D-1)*L packets after its first packet
+	if (!mai.args.window)
+		mai.args.window = fec_cols * fec_rows;
+		
+	for (size_t s=0; s < MAI_STREAM_MAX; s++) {
+		for (int dir=0; dir < 2; dir++) {
+			free(fec_queue[s][dir].entry);
+			fec_queue[s][dir] = (struct queue){ .sock = -1, .stream = s };
+			
+			if ((fec_queue[s][dir].entry = calloc(FEC_QUEUE, fec_stride)) == NULL)
+				return(mai_error("failed to allocate fec buffers!\n"));
+		}
+	}
+	
+	return(mai_debug("FEC: %ux%u matrix, %u repairs per %u packets (+%.0f%% bandwidth), waits %d packets (%.1fms) for a loss\n", fec_cols, fec_rows, repairs, fec_cols * fec_rows, (100.0 * repairs) / (fec_cols * fec_rows), mai.args.window, mai.args.window * ptime));
+}
+
+/* ######################################################################## */
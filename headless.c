@@ -0,0 +1,142 @@
+#include "mai.h"
+
+/* ######################################################################## */
+#define HEADLESS_PERIOD	256				// default frames per process period
+#define HEADLESS_LEVEL	0.1				// tone: 1kHz sine at -20dBFS
+
+static pthread_t	 hd_tid;			// process thread
+static int		 hd_kind;			// 'n'ull, 't'one or 'f'ile
+static FILE		*hd_file = NULL;		// file source or sink
+static uint64_t		 hd_origin;			// TAI time of frame 0 (ns)
+static float		 hd_buffer[8][MAI_PERIOD_MAX];	// port buffers
+
+/* ######################################################################## */
+static void headless_source(float * const *ports, uint32_t frames, uint64_t frame) {
+	const size_t channels = mai.args.channels;
+	
+	if (hd_kind == 't') {
+		for (uint32_t lp=0; lp < frames; lp++) {
+			float s = sin((2 * M_PI * 1000 * ((frame + lp) % mai.args.rate)) / mai.args.rate) * HEADLESS_LEVEL;
+			
+			for (size_t ch=0; ch < channels; ch++)
+				ports[ch][lp] = s;
+		}
+		return;
+	}
+	
+	if (hd_kind == 'f') {
+		// raw interleaved float, looped
+		float *in = alloca(frames * channels * sizeof(float));
+		size_t got = fread(in, channels * sizeof(float), frames, hd_file);
+		
+		if (got < frames) {
+			rewind(hd_file);
+			got += fread(in + (got * channels), channels * sizeof(float), frames - got, hd_file);
+		}
+		
+		memset(in + (got * channels), 0, (frames - got) * channels * sizeof(float));
+		
+		for (uint32_t lp=0; lp < frames; lp++) {
+			for (size_t ch=0; ch < channels; ch++)
+				ports[ch][lp] = *in++;
+		}
+		return;
+	}
+	
+	for (size_t ch=0; ch < channels; ch++)
+		memset(ports[ch], 0, frames * sizeof(float));
+}
+
+static void headless_sink(float * const *ports, uint32_t frames) {
+	const size_t channels = mai.args.channels;
+	
+	if (hd_kind != 'f')
+		return;
+		
+	float *out = alloca(frames * channels * sizeof(float)), *ptr = out;
+	
+	for (uint32_t lp=0; lp < frames; lp++) {
+		for (size_t ch=0; ch < channels; ch++)
+			*ptr++ = ports[ch][lp];
+	}
+	
+	if (fwrite(out, channels * sizeof(float), frames, hd_file) != frames)
+		mai_error("headless write: %m\n");
+}
+
+/* ######################################################################## */
+static uint64_t headless_ns(uint64_t frames) {
+	// split so frame counts of a long run do not overflow when scaled to ns
+	return(((frames / mai.args.rate) * 1000000000ULL) + (((frames % mai.args.rate) * 1000000000ULL) / mai.args.rate));
+}
+
+static void *headless_thread(void *arg) {
+	const uint32_t  period = mai.args.period;
+	float          *ports[8];
+	
+	for (uint32_t ch=0; ch < 8; ch++)
+		ports[ch] = hd_buffer[ch];
+		
+	// periods run on the TAI media clock itself, so the servo sees no drift
+	for (uint64_t frame = 0; 1; frame += period) {
+		uint64_t        due = hd_origin + headless_ns(frame);
+		struct timespec ts  = (struct timespec){ .tv_sec = due / 1000000000ULL, .tv_nsec = due % 1000000000ULL };
+		
+		while (clock_nanosleep(CLOCK_TAI, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+			
+		if (MAI_SENDER) {
+			headless_source(ports, period, frame);
+			mai_backend_send(ports, period, due);
+		} else {
+			mai_backend_recv(ports, period, due + headless_ns(period));
+			headless_sink(ports, period);
+		}
+	}
+	
+	mai_error("Unexpected Thread Exit!");
+	return(arg);
+}
+
+/* ######################################################################## */
+uint32_t mai_headless_frames(void) {
+	uint64_t ns = mai_clock_ns(CLOCK_TAI) - hd_origin;
+	
+	return(((ns / 1000000000ULL) * mai.args.rate) + (((ns % 1000000000ULL) * mai.args.rate) / 1000000000ULL));
+}
+
+int mai_headless_init(void) {
+	// null, tone or file:<path> (raw interleaved 32 bit float)
+	hd_kind = mai.args.backend[0];
+	
+	if ((hd_kind == 'f') && ((hd_file = fopen(mai.args.backend + 5, MAI_SENDER ? "r" : "w")) == NULL))
+		return(mai_error("headless file (%s): %m\n", mai.args.backend + 5));
+		
+	if (!mai.args.period)
+		mai.args.period = HEADLESS_PERIOD;
+		
+	// no device: the stream rate is the process rate
+	if (mai_audio_init(mai_ptp_rate(mai.args.rate)))
+		return(-1);
+		
+	mai_audio_size(mai.args.period);
+	
+	hd_origin = mai_clock_ns(CLOCK_TAI);
+	
+	if (mai_thread_create(&hd_tid, "audio", headless_thread, NULL))
+		return(-1);
+		
+	return(mai_debug("Started: headless %s (%d channels, %u frames)\n", mai.args.backend, mai.args.channels, mai.args.period));
+}
+
+int mai_headless_stop(void) {
+	mai_thread_stop(&hd_tid);
+	
+	if (hd_file)
+		fclose(hd_file);
+		
+	hd_file = NULL;
+	return(0);
+}
+
+/* ######################################################################## */
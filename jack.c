@@ -1,163 +1,87 @@
 #include "mai.h"
-#include <samplerate.h>
 
 /* ######################################################################## */
 static jack_client_t	 *jack_client;		// jack client handle
 static jack_port_t	 *jack_port[8];		// jack port handles
 static char              *jack_name[8];		// jack port names (in client:name format)
 
-static int64_t		  jack_error = 0;	// clock error: -=jack too fast, +=jack too slow
-
 /* ######################################################################## */
-static int jack_bias(uint32_t frames) {
-	static       uint32_t counter = 0;
-	static const uint32_t trigger = 10000;
+static uint64_t jack_time(jack_port_t *port, jack_latency_callback_mode_t mode) {
+	// TAI time this period's first frame met the outside world (capture: before, playback: after)
+	jack_latency_range_t range;
+	jack_time_t          now   = jack_get_time();
+	jack_time_t          cycle = jack_frames_to_time(jack_client, jack_last_frame_time(jack_client));
 	
-	int bias = 0;
+	jack_port_get_latency_range(port, mode, &range);
 	
-	if ((counter += frames) >= trigger) {
-		counter -= trigger;
-		
-		     if (jack_error < 0) bias = -1;
-		else if (jack_error > 0) bias =  1;
-		
-		MAI_STAT_ADD(audio.drift, bias);
-		__sync_fetch_and_sub(&jack_error, bias);
-	}
+	int64_t ns = mai_clock_ns(CLOCK_TAI) - ((now > cycle) ? ((now - cycle) * 1000) : 0);
+	int64_t io = (range.max * 1000000000LL) / mai.args.rate;
 	
-	return(bias);
+	return((mode == JackCaptureLatency) ? (ns - io) : (ns + io));
 }
 
 /* ######################################################################## */
 static int jack_send(jack_nframes_t frames, void *arg __attribute__((__unused__))) {
-	const size_t channels = mai.args.channels;			// channels
-	const size_t buflen   = (frames+1) * channels * sizeof(float);	// length of interleaved samples
-	
-	float *input, *output, *buffer = alloca(buflen);		// interleaved samples
-	
-	// match network clock rate
-	int bias = jack_bias(frames);
+	float *ports[8];						// port buffers
 	
-	for (uint32_t ch=channels; ch--; ) {				// for all ports/channels:
-		if ((input = jack_port_get_buffer(jack_port[ch], frames)) == NULL)
-			continue;
-			
-		const float * const end = input + frames;
+	for (uint32_t ch=mai.args.channels; ch--; )
+		ports[ch] = jack_port_get_buffer(jack_port[ch], frames);
 		
-		output = &buffer[ch];					// offset interleave output pointer
-			
-		if (bias == 1) {					// too slow: add a sample to frame
-			*output  = input[0];				// output[0] = input[0]
-			 output += channels;
-			*output  = (input[0]+input[1])/2;		// output[1] = avg(input[0..1])
-			 output += channels;
-			 
-			 input  += 1;					// output[2] = input[1], ...
-			 
-		} else if (bias == -1) {				// too fast: drop a sample from frame
-			*output  = (input[0]+input[1])/2;		// output[0] = avg(input[0..1])
-			 output += channels;
-			 
-			 input  += 2;					// output[1] = input[2], ...
-		}
-		
-		for (; input < end; output += channels)			// for all samples in interleave
-			*output = *input++;				// copy sample
-	}
-	
-	mai_audio_write(buffer, frames+bias);				// send audio to RTP
+	mai_backend_send(ports, frames, mai.args.measure ? jack_time(jack_port[0], JackCaptureLatency) : 0);
 	return(0);
 }
 
-/* ######################################################################## */
 static int jack_recv(jack_nframes_t frames, void *arg __attribute__((__unused__))) {
-	const size_t channels = mai.args.channels;			// channels
-	const size_t buflen   = (frames+1) * channels * sizeof(float);	// length of interleaved samplesn
-	
-	float *input, *output, *buffer = alloca(buflen);		// interleaved samples
+	float *ports[8];						// port buffers
 	
-	// match network clock rate
-	int bias = jack_bias(frames);
-	
-	mai_audio_read(buffer, frames+bias);				// try to get samples from buffer
-		
-	for (uint32_t ch=channels; ch--; ) {				// for all ports/channels:
-		input = &buffer[ch];					// offset interleave input pointer
+	for (uint32_t ch=mai.args.channels; ch--; )
+		ports[ch] = jack_port_get_buffer(jack_port[ch], frames);
 		
-		if ((output = jack_port_get_buffer(jack_port[ch], frames)) == NULL)
-			continue;
-			
-		const float * const end = output + frames;
-			
-		if (bias == 1) {					// too slow: drop a sample from frame
-			*output  = (input[0] + input[channels])/2;	// output[0] = avg(deinterleave(input[0..1]))
-			 output += 1;
-			
-			input += (channels * 2);			// make output[1] = input[2], ...
-			
-		} else if (bias == -1) {				// too fast: add a sample to frame
-			*output  = input[0];				// make output[0] = input[1], ...
-			 output += 1;
-			 
-			*output  = (input[0] + input[channels])/2;	// output[1] = avg(deinterleave(input[0..1]))
-			 output += 1;
-			 
-			input += channels;				// make output[2] = input[1], ...
-		}
-		
-		for (; output < end; input += channels)			// for all samples in interleave
-			*output++ = *input;				// copy sample
-	}
+	mai_backend_recv(ports, frames, (mai.args.measure || mai.args.align) ? jack_time(jack_port[0], JackPlaybackLatency) : 0);
 	return(0);
 }
 
 /* ######################################################################## */
-void mai_jack_clock(int64_t ptp_now) {
-	static int64_t jack_last = 0;
-	static int64_t ptp_last  = 0;
-	
-	int64_t jack_now  = jack_frame_time(jack_client);
-	
-	int64_t jack_diff = jack_now - jack_last;
-	int64_t ptp_diff  = ptp_now  - ptp_last;
-	
-	jack_last = jack_now;
-	ptp_last  = ptp_now;
-	
-	// ptp=100, jack=101, diff=-1 -- jack too fast
-	// ptp=101, jack=100, diff=+1 -- jack too slow
-	int64_t error = ptp_diff - jack_diff;
+uint32_t mai_jack_frames(void) {
+	return(jack_frame_time(jack_client));
+}
+
+int mai_jack_stop(void) {
+	// deactivates first: no process callback runs after this
+	if (jack_client)
+		jack_client_close(jack_client);
+		
+	for (uint32_t ch=0; ch < 8; ch++) {
+		free(jack_name[ch]);
+		jack_name[ch] = NULL;
+		jack_port[ch] = NULL;
+	}
 	
-	// during XRUNs and other NTP/PTP events the jack or PTP sample
-	// clock can have large non-linear jumps;  since we're only
-	// interested in preventing small sample rate drift and because RTP
-	// has it's own correction mechanism,  we filter large errors out
-	if ((error < -16) || (error > 16))
-		return;
+	jack_client = NULL;
+	return(0);
+}
+
+int mai_jack_connect(size_t port, const char *name, int connect) {
+	// control: jack serializes graph changes against the process callback
+	if (!jack_client || (port >= mai.args.channels))
+		return(-1);
 		
-	// jack_error is shared with the process callback threads
-	__sync_fetch_and_add(&jack_error, error);
+	const char *src = MAI_SENDER ? name : jack_name[port];
+	const char *dst = MAI_SENDER ? jack_name[port] : name;
+	
+	return(connect ? jack_connect(jack_client, src, dst) : jack_disconnect(jack_client, src, dst));
 }
 
 /* ######################################################################## */
 int mai_jack_init(void) {
-	// set realtime scheduling with highest priority
-	struct sched_param p = (struct sched_param){ .sched_priority = 99 };
-	
-	if (sched_setscheduler(0, SCHED_RR, &p))
-		return(mai_error("could not set realtime scheduler: %m\n"));
-		
-	// change process privileges
-	if (mai.args.gid && (setgid(mai.args.gid) || setegid(mai.args.gid)))
-		return(mai_error("could not change to group(%d): %m\n", mai.args.gid));
-	
-	if (mai.args.uid && (setuid(mai.args.uid) || seteuid(mai.args.uid)))
-		return(mai_error("could not change to user(%d): %m\n", mai.args.uid));
-		
 	// setup jack and jack process buffer
         if ((jack_client = jack_client_open(mai.args.client, JackNoStartServer, NULL)) == NULL)
         	return(mai_error("could not connect to jack server.\n"));
         	
+	// the time code does not survive sample rate conversion
+	if (mai.args.measure && (jack_get_sample_rate(jack_client) != mai.args.rate))
+		return(mai_error("measure needs the jack and stream sample rates to match\n"));
+		
 	// initialize the audio and clock system with jack sample rate all at once
 	if (mai_audio_init(mai_ptp_rate(jack_get_sample_rate(jack_client))))
 		return(-1);
@@ -0,0 +1,151 @@
+#include "mai.h"
+#include "libmai.h"
+
+/* ######################################################################## */
+struct mai_func {
+	int		(*func)(void);
+	int		mode;
+};
+
+static struct mai_func mai_init[] = {
+	{ mai_state_init,	'*' },
+	{ mai_stat_init,	'*' },
+	{ mai_meter_init,	'*' },
+	{ mai_loop_init,	'*' },
+	{ mai_sap_listen,	'r' },
+	{ mai_ptp_init,		'*' },
+	{ mai_fec_init,		'*' },
+	{ mai_rtp_init,		'*' },
+	{ mai_measure_init,	'*' },
+	{ mai_record_init,	'r' },
+	{ mai_sap_init,		's' },
+	{ mai_backend_init,	'*' },
+
+	{ mai_loop_start,	'*' },
+	{ mai_ptp_start,	'*' },
+	{ mai_rtp_start,	'*' },
+	{ mai_local_start,	'*' },
+	{ mai_sap_start,	's' },
+	{ mai_replay_start,	'r' },
+	{ mai_control_start,	'*' },
+	{ NULL,			0   }
+};
+
+static struct mai_func mai_fini[] = {
+	{ mai_control_stop,	'*' },
+	{ mai_replay_stop,	'r' },
+	{ mai_local_quit,	'r' },
+	{ mai_loop_stop,	'*' },
+	{ mai_rtp_stop,		'*' },
+	{ mai_record_stop,	'r' },
+	{ mai_backend_stop,	'*' },
+	{ mai_local_stop,	'*' },
+	{ mai_ptp_stop,		'*' },
+	{ mai_sap_stop,		'*' },
+	{ mai_state_fini,	'*' },
+	{ mai_stat_stop,	'*' },
+	{ NULL,			0   }
+};
+
+static int run(const struct mai_func *ptr, int all) {
+	// init stops at the first failure, fini runs every step
+	int rc = 0;
+	
+	for (; ptr && ptr->func && (all || !rc); ptr++) {
+		if (((ptr->mode == mai.args.mode) || (ptr->mode == '*')) && (ptr->func)())
+			rc = -1;
+	}
+	return(rc);
+}
+
+/* ######################################################################## */
+static int		 lib_live = 0;			// started, not closed
+static struct mai_engine lib_engine;			// embedding engine (frames == NULL: none)
+
+/* ######################################################################## */
+uint32_t mai_lib_frames(void) {
+	return(lib_engine.frames(lib_engine.user));
+}
+
+int mai_lib_init(void) {
+	// embed backend: the engine runs the process periods through mai_push()/mai_pull()
+	if (!lib_engine.frames)
+		return(mai_error("embed backend needs an engine (libmai)\n"));
+		
+	// the time code does not survive sample rate conversion
+	if (mai.args.measure && (lib_engine.rate != mai.args.rate))
+		return(mai_error("measure needs the engine and stream sample rates to match\n"));
+		
+	if (mai_audio_init(mai_ptp_rate(lib_engine.rate)))
+		return(-1);
+		
+	mai_audio_size(lib_engine.period);
+	
+	return(mai_debug("Started: embedded (%d channels, %uHz, up to %u frames)\n", mai.args.channels, lib_engine.rate, lib_engine.period));
+}
+
+/* ######################################################################## */
+int mai_open(int argc, char *argv[], const struct mai_engine *engine) {
+	if (lib_live) {
+		errno = EBUSY;
+		return(-1);
+	}
+	
+	if (engine && (!engine->frames || !engine->rate || !engine->period || (engine->period > MAI_PERIOD_MAX))) {
+		errno = EINVAL;
+		return(-1);
+	}
+	
+	// help and version stop here too, without an error
+	int stop = mai_args_init(argc, argv);
+	
+	if (stop) {
+		errno = (stop > 0) ? 0 : EINVAL;
+		return((stop > 0) ? 1 : -1);
+	}
+	
+	lib_engine = engine ? *engine : (struct mai_engine){ 0 };
+	
+	if (engine) {
+		mai.args.backend = "embed";
+		mai_backend_set(mai.args.backend);
+	}
+	
+	mai.start = mai_clock_ns(CLOCK_MONOTONIC);
+	
+	// a partial start unwinds, every stop copes with a module that never started
+	if (run(mai_init, 0)) {
+		run(mai_fini, 1);
+		errno = EIO;
+		return(-1);
+	}
+	
+	lib_live = 1;
+	return(0);
+}
+
+void mai_close(void) {
+	if (!lib_live)
+		return;
+		
+	lib_live = 0;
+	run(mai_fini, 1);
+}
+
+/* ######################################################################## */
+void mai_push(const float * const *ports, uint32_t frames, uint64_t tai) {
+	if (lib_live && MAI_SENDER && (frames <= lib_engine.period))
+		mai_backend_send((float * const *)ports, frames, tai);
+}
+
+void mai_pull(float * const *ports, uint32_t frames, uint64_t tai) {
+	if (lib_live && !MAI_SENDER && (frames <= lib_engine.period))
+		mai_backend_recv(ports, frames, tai);
+}
+
+uint64_t mai_time(void) {
+	// the local clock on the ptp master's media clock, as audio is aligned and stamped
+	return(mai_ptp_media(mai_clock_ns(CLOCK_TAI)));
+}
+
+/* ######################################################################## */
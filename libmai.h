@@ -0,0 +1,37 @@
+#ifndef __LIBMAI_H
+#define __LIBMAI_H
+
+#include <stdint.h>
+
+/* ######################################################################## */
+// libmai: AES67 send or receive inside an audio engine, without JACK between.
+// Link libmai.a with -pthread -lm -ljack -lsamplerate.
+//
+// One instance is live per process: the modules keep their state in file
+// statics, so the calls take no handle.  mai_open() fails with EBUSY while one
+// is open; after mai_close(), or a failed start, the next mai_open() starts over.
+
+struct mai_engine {
+	void		*user;				// passed back to the callbacks
+	uint32_t	 rate;				// engine frames per second
+	uint32_t	 period;			// most frames in one mai_push() or mai_pull()
+	uint32_t	(*frames)(void *user);		// engine frame clock: its drift against ptp is corrected
+};
+
+// options as for the mai binary; with an engine it replaces the -E backend, and
+// any thread calling mai_push() or mai_pull() keeps its own scheduling;
+// returns 0 once started, 1 after help or version, -1 with errno on failure;
+// close once the engine no longer calls them
+extern int		 mai_open(int argc, char *argv[], const struct mai_engine *engine);
+extern void		 mai_close(void);
+
+// engine process thread, one period per call with a buffer per channel;
+// tai is the time the first frame met the outside world (ns), or 0 when no option needs it
+extern void		 mai_push(const float * const *ports, uint32_t frames, uint64_t tai);
+extern void		 mai_pull(      float * const *ports, uint32_t frames, uint64_t tai);
+
+// the media clock the tai arguments are on (TAI, ns)
+extern uint64_t		 mai_time(void);
+
+/* ######################################################################## */
+#endif
@@ -0,0 +1,284 @@
+#include "mai.h"
+#include <fcntl.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+/* ######################################################################## */
+#define LOCAL_MAGIC	0x4D41494C			// "MAIL"
+#define LOCAL_FRAMES	65536				// ring frames (a power of 2, 340ms at 192kHz)
+#define LOCAL_BLOCKS	1024				// period descriptors (a power of 2)
+
+// one process period of the sender, as it also goes to rtp
+struct block {
+	uint64_t	pos;				// first frame: frames published before it
+	uint32_t	seq;				// period sequence number
+	uint32_t	time;				// rtp time of the first frame
+	uint32_t	frames;				// frames in this period
+	uint32_t	reserved;
+};
+
+// shared memory: one sender writes, any number of receivers read without locks
+struct ring {
+	uint32_t	magic;				// LOCAL_MAGIC once the header is valid
+	uint32_t	size;				// sizeof(struct ring)
+	uint32_t	rate;				// backend frames per second
+	uint32_t	channels;			// floats per frame
+	uint32_t	pid;				// publishing process
+	uint32_t	period;				// largest block published (frames)
+	uint64_t	blocks;				// blocks published
+	uint64_t	written;			// frames published
+	struct block	block[LOCAL_BLOCKS];
+	float		data[LOCAL_FRAMES * MAI_MIX_WIDTH];
+};
+
+static struct ring	*local = NULL;			// mapped ring
+static uint64_t		 local_next = 0;		// receiver: next block to read
+static int		 local_state = 0;		// receiver: 0 waiting, 1 reading, -1 from the network
+static size_t		 local_idle  = 0;		// receiver: frames since the last block
+
+static pthread_t	 local_tid;			// receiver: switches to the network
+static sem_t		 local_wake;			// posted by the process thread
+static int		 local_waker = 0;		// local_wake initialised
+static const char	*local_why = NULL;		// why it gave up the ring
+
+/* ######################################################################## */
+void mai_local_write(const float *data, size_t frames) {
+	// sender process thread: frames first, then the block, then the counts
+	if (!__atomic_load_n(&local, __ATOMIC_ACQUIRE))
+		return;
+		
+	const size_t   channels = mai.args.channels;
+	const uint64_t pos      = local->written;
+	const uint64_t n        = local->blocks;
+	const size_t   at       = pos % LOCAL_FRAMES;
+	const size_t   first    = ((at + frames) > LOCAL_FRAMES) ? (LOCAL_FRAMES - at) : frames;
+	
+	// a longer period: receivers allow for it before its frames overwrite theirs
+	if (frames > local->period) {
+		__atomic_store_n(&local->period, frames, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+	
+	memcpy(&local->data[at * channels], data, first * channels * sizeof(float));
+	memcpy(local->data, data + (first * channels), (frames - first) * channels * sizeof(float));
+	
+	// the rtp time these frames go out with: after the ones still queued for rtp
+	local->block[n % LOCAL_BLOCKS] = (struct block){
+		.pos    = pos,
+		.seq    = n,
+		.time   = mai_rtp_clock() + mai_audio_fill(0, NULL),
+		.frames = frames
+	};
+	
+	__atomic_store_n(&local->written, pos + frames, __ATOMIC_RELEASE);
+	__atomic_store_n(&local->blocks, n + 1, __ATOMIC_RELEASE);
+	
+	MAI_STAT_INC(local.blocks);
+}
+
+/* ######################################################################## */
+static int local_fallback(const char *why) {
+	// the first stream from its socket after all, the ring stays mapped until stop
+	local_state    = -1;
+	mai.args.local = NULL;
+	
+	mai_info("Local: %s, stream 1 from the network\n", why);
+	return(mai_rtp_network());
+}
+
+static void local_defer(const char *why) {
+	// process thread: stop reading, sockets and the event loop are the worker's
+	local_why   = why;
+	local_state = -1;
+	sem_post(&local_wake);
+}
+
+static void *local_worker(void *arg) {
+	// inherited realtime scheduling is not needed to open sockets
+	struct sched_param p = (struct sched_param){ .sched_priority = 0 };
+	
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &p);
+	
+	while (sem_wait(&local_wake) && (errno == EINTR))
+		;
+		
+	// once switching, stop waits for the event loop to have the socket
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	local_fallback(local_why);
+	
+	return(arg);
+}
+
+static int local_check(size_t period) {
+	// receiver, once the sender has published a header: frames copy as they are
+	if (__atomic_load_n(&local->magic, __ATOMIC_ACQUIRE) != LOCAL_MAGIC)
+		return(0);
+		
+	// a restarted sender with another format, once from the process thread
+	if ((local->rate != mai_audio_rate()) || (local->channels != mai.args.channels)) {
+		local_defer("format mismatch");
+		return(-1);
+	}
+	
+	// hold a period: the two process callbacks may run in either order
+	if (!mai.args.align)
+		mai_audio_target(0, period);
+		
+	local_next  = __atomic_load_n(&local->blocks, __ATOMIC_ACQUIRE);
+	local_state = 1;
+	return(0);
+}
+
+void mai_local_read(size_t period) {
+	// receiver process thread: every published period into the first stream
+	if (!__atomic_load_n(&local, __ATOMIC_ACQUIRE) || (local_state < 0) || (!local_state && (local_check(period) || !local_state)))
+		return;
+		
+	const size_t channels = mai.args.channels;
+	uint64_t     blocks   = __atomic_load_n(&local->blocks, __ATOMIC_ACQUIRE);
+	
+	// nothing published for a second: the network, if the publisher is gone
+	local_idle = (blocks != local_next) ? 0 : (local_idle + period);
+	
+	if (local_idle >= mai_audio_rate()) {
+		local_idle = 0;
+		
+		if (kill(local->pid, 0) && (errno == ESRCH)) {
+			local_defer("publisher gone");
+			return;
+		}
+	}
+	
+	// the sender restarted, or got more than half the descriptors ahead
+	if ((blocks < local_next) || ((blocks - local_next) > (LOCAL_BLOCKS / 2))) {
+		MAI_STAT_ADD(local.lost, (blocks > local_next) ? (blocks - local_next) : 0);
+		local_next = blocks;
+		
+		if (__atomic_load_n(&local->magic, __ATOMIC_ACQUIRE) != LOCAL_MAGIC)
+			local_state = 0;
+	}
+	
+	for (; local_next < blocks; local_next++) {
+		struct block b = local->block[local_next % LOCAL_BLOCKS];
+		
+		if (b.frames > (period * 4))
+			continue;						// skip: not a period
+			
+		float        *out   = alloca(b.frames * channels * sizeof(float));
+		const size_t  at    = b.pos % LOCAL_FRAMES;
+		const size_t  first = ((at + b.frames) > LOCAL_FRAMES) ? (LOCAL_FRAMES - at) : b.frames;
+		
+		memcpy(out, &local->data[at * channels], first * channels * sizeof(float));
+		memcpy(out + (first * channels), local->data, (b.frames - first) * channels * sizeof(float));
+		
+		// the writer may have lapped the copy: frames or the descriptor reused,
+		// its frames go in a period ahead of the published count
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		
+		uint64_t ahead = __atomic_load_n(&local->written, __ATOMIC_RELAXED) + __atomic_load_n(&local->period, __ATOMIC_RELAXED);
+		
+		if (((ahead - b.pos) > LOCAL_FRAMES) || ((__atomic_load_n(&local->blocks, __ATOMIC_RELAXED) - local_next) >= LOCAL_BLOCKS)) {
+			MAI_STAT_INC(local.lost);
+			continue;
+		}
+		
+		mai_audio_write_local(0, out, b.frames, b.time);
+		MAI_STAT_INC(local.blocks);
+	}
+}
+
+/* ######################################################################## */
+static const char *local_refuse(const struct ring *r) {
+	// receiver: why the first stream cannot come from this ring (NULL: it can)
+	if ((__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != LOCAL_MAGIC) || (kill(r->pid, 0) && (errno == ESRCH)))
+		return("no publisher");
+		
+	if ((r->rate != mai_audio_rate()) || (r->channels != mai.args.channels))
+		return("format mismatch");
+		
+	// the recording keeps the stream rate, the ring has the backend's
+	if (mai.args.record && (r->rate != mai.args.rate))
+		return("recording at the stream rate");
+		
+	return(NULL);
+}
+
+int mai_local_start(void) {
+	// after rtp: a receiver without a ring to read goes back to the network
+	if (!mai.args.local)
+		return(0);
+		
+	// both ends create it, so either may start first; the size never changes
+	int          fd = shm_open(mai.args.local, O_CREAT|O_RDWR, 0644);
+	struct ring *r;
+	
+	if ((fd < 0) || ftruncate(fd, sizeof(*r)))
+		return(mai_error("local ring (%s): %m\n", mai.args.local));
+		
+	r = mmap(NULL, sizeof(*r), MAI_SENDER ? (PROT_READ|PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	
+	if (r == MAP_FAILED)
+		return(mai_error("local ring mmap: %m\n"));
+		
+	// sender: receivers see the counts restart, then a valid header
+	if (MAI_SENDER) {
+		__atomic_store_n(&r->magic, 0, __ATOMIC_RELEASE);
+		
+		r->size     = sizeof(*r);
+		r->rate     = mai_audio_rate();
+		r->channels = mai.args.channels;
+		r->pid      = getpid();
+		r->period   = 0;
+		
+		__atomic_store_n(&r->written, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&r->blocks,  0, __ATOMIC_RELEASE);
+		__atomic_store_n(&r->magic, LOCAL_MAGIC, __ATOMIC_RELEASE);
+	}
+	
+	const char *why = MAI_SENDER ? NULL : local_refuse(r);
+	int         rc  = why ? local_fallback(why) : 0;
+	
+	// the process callback is already running, it starts with the next period
+	__atomic_store_n(&local, r, __ATOMIC_RELEASE);
+	
+	if (why)
+		return(rc);
+		
+	if (!MAI_SENDER) {
+		local_waker = !sem_init(&local_wake, 0, 0);
+		
+		if (mai_thread_create(&local_tid, "local", local_worker, NULL))
+			return(-1);
+			
+		return(mai_debug("Local: stream 1 from shared memory %s\n", mai.args.local));
+	}
+		
+	return(mai_debug("Local: publishing %u channels at %zuHz in shared memory %s\n", mai.args.channels, mai_audio_rate(), mai.args.local));
+}
+
+int mai_local_quit(void) {
+	// before the event loop stops: a switch to the network is finished or never starts
+	return(mai_thread_stop(&local_tid));
+}
+
+int mai_local_stop(void) {
+	// after the backend: no process callback uses the ring any more
+	if (local)
+		munmap(local, sizeof(*local));
+		
+	if (local_waker)
+		sem_destroy(&local_wake);
+		
+	local       = NULL;
+	local_next  = 0;
+	local_state = 0;
+	local_idle  = 0;
+	local_waker = 0;
+	local_why   = NULL;
+	return(0);
+}
+
+/* ######################################################################## */
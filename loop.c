@@ -0,0 +1,527 @@
+#include "mai.h"
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* ######################################################################## */
+#define LOOP_MAX	(3 + 3 * MAI_STREAM_MAX)	// sockets in loop (ptp, sap, every stream and its repairs)
+#define LOOP_DEPTH	32				// submission queue entries
+#define LOOP_BUFS	128				// provided receive buffers (power of 2)
+#define LOOP_BUF_SIZE	9216				// bytes per receive buffer (jumbo frame)
+#define LOOP_GROUP	0				// provided buffer group id
+#define LOOP_BATCH	16				// datagrams per recvmmsg (shard workers)
+
+struct handler {
+	const char	 *name;				// thread name
+	int		  sk;				// socket (-1: free, -2: closing)
+	struct sockaddr_in addr;			// bound address (for replay)
+	mai_loop_func	  func;				// packet handler
+	void		 *arg;				// handler argument
+	pthread_t	  tid;				// blocking receive thread (no io_uring)
+	int		  own;				// io_uring: fell back to its own blocking thread
+	struct shard	 *shard;			// receiving worker (NULL: own thread)
+};
+
+struct shard {
+	int		  ep;				// epoll instance
+	size_t		  used;				// sockets on this worker
+	uint8_t		 *data;				// LOOP_BATCH receive buffers
+	pthread_t	  tid;
+};
+
+static struct handler	 loop[LOOP_MAX];		// registered sockets
+static size_t		 loop_used = 0;			// registered socket count
+
+static struct shard	 loop_shard[MAI_STREAM_MAX] = { [0 ... MAI_STREAM_MAX-1] = { .ep = -1 } };	// stream receive workers
+
+static pthread_t	 loop_tid;			// io_uring thread
+static pthread_mutex_t	 loop_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int		 ring_fd = -1;			// io_uring instance
+static uint8_t		*ring_map;			// submission and completion rings
+static size_t		 ring_len;
+static uint8_t		*buf_data;			// receive buffer memory
+static struct io_uring_buf_ring *buf_ring;		// provided buffer ring
+
+static struct {
+	uint32_t	*head, *tail, *mask, *array;
+	struct io_uring_sqe *sqes;
+	size_t		 len;				// sqes mapping
+} sq;
+
+static struct {
+	uint32_t	*head, *tail, *mask;
+	struct io_uring_cqe *cqes;
+} cq;
+
+/* ######################################################################## */
+static void *loop_recv(void *arg) {
+	struct handler *h = arg;
+	uint8_t		buffer[LOOP_BUF_SIZE];
+	
+	// fallback: one blocking thread per socket
+	for (ssize_t len; 1; ) {
+		if ((len = recv(h->sk, buffer, sizeof(buffer) - 1, 0)) <= 0) {
+			mai_error("packet recv: %m\n");
+			continue;
+		}
+		
+		buffer[len] = 0;			// terminate text payloads
+		h->func(buffer, len, h->arg);
+	}
+	
+	mai_error("Unexpected Thread Exit!");
+	return(arg);
+}
+
+/* ######################################################################## */
+static void *loop_worker(void *arg) {
+	struct shard       *w = arg;
+	struct epoll_event  ev[LOOP_MAX];
+	struct mmsghdr      msg[LOOP_BATCH];
+	struct iovec        iov[LOOP_BATCH];
+	
+	for (size_t b=0; b < LOOP_BATCH; b++) {
+		iov[b] = (struct iovec){ .iov_base = w->data + (b * LOOP_BUF_SIZE), .iov_len = LOOP_BUF_SIZE - 1 };
+		msg[b] = (struct mmsghdr){ .msg_hdr = { .msg_iov = &iov[b], .msg_iovlen = 1 } };
+	}
+	
+	// shards: only this worker receives its sockets, so a stream and its
+	// reorder buffer stay on one core and no state is shared between them
+	while (1) {
+		int ready = epoll_wait(w->ep, ev, LOOP_MAX, -1);
+		
+		if ((ready < 0) && (errno != EINTR))
+			mai_error("epoll wait: %m\n");
+			
+		for (int e=0; e < ready; e++) {
+			struct handler *h  = &loop[ev[e].data.u64 & 0xFFFFFFFF];
+			int             sk = ev[e].data.u64 >> 32;
+			
+			// removed: the shutdown woke us, the entry is ours to free
+			if (__atomic_load_n(&h->sk, __ATOMIC_ACQUIRE) == -2) {
+				epoll_ctl(w->ep, EPOLL_CTL_DEL, sk, NULL);
+				close(sk);
+				
+				__atomic_sub_fetch(&w->used, 1, __ATOMIC_RELAXED);
+				__atomic_store_n(&h->sk, -1, __ATOMIC_RELEASE);
+				continue;
+			}
+			
+			int got = recvmmsg(sk, msg, LOOP_BATCH, MSG_DONTWAIT, NULL);
+			
+			if ((got < 0) && (errno != EAGAIN))
+				mai_error("packet recv: %m\n");
+				
+			for (int m=0; m < got; m++) {
+				uint8_t *data = iov[m].iov_base;
+				
+				data[msg[m].msg_len] = 0;	// terminate text payloads
+				h->func(data, msg[m].msg_len, h->arg);
+			}
+		}
+	}
+	
+	mai_error("Unexpected Thread Exit!");
+	return(arg);
+}
+
+static int loop_shard_add(size_t idx, int with) {
+	// the worker receiving <with> or the least loaded one takes the socket for its lifetime
+	struct shard *w = &loop_shard[0];
+	
+	for (int s=1; s < mai.args.shards; s++) {
+		if (__atomic_load_n(&loop_shard[s].used, __ATOMIC_RELAXED) < __atomic_load_n(&w->used, __ATOMIC_RELAXED))
+			w = &loop_shard[s];
+	}
+	
+	for (size_t lp=0; (with >= 0) && (lp < loop_used); lp++) {
+		if ((loop[lp].sk == with) && loop[lp].shard)
+			w = loop[lp].shard;
+	}
+	
+	struct epoll_event ev = (struct epoll_event){ .events = EPOLLIN, .data.u64 = idx | ((uint64_t)loop[idx].sk << 32) };
+	
+	loop[idx].shard = w;
+	__atomic_add_fetch(&w->used, 1, __ATOMIC_RELAXED);
+	
+	if (epoll_ctl(w->ep, EPOLL_CTL_ADD, loop[idx].sk, &ev))
+		return(mai_error("epoll add: %m\n"));
+		
+	return(mai_debug("Loop: %s socket on shard %zu\n", loop[idx].name, (size_t)(w - loop_shard)));
+}
+
+static int loop_shard_init(void) {
+	for (int s=0; s < mai.args.shards; s++) {
+		struct shard *w = &loop_shard[s];
+		
+		if ((w->ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			return(mai_error("epoll create: %m\n"));
+			
+		if ((w->data = malloc(LOOP_BATCH * LOOP_BUF_SIZE)) == NULL)
+			return(mai_error("failed to allocate shard buffers!\n"));
+	}
+	
+	return(mai_debug("Loop: %d shards x %d datagrams per receive\n", mai.args.shards, LOOP_BATCH));
+}
+
+static int loop_shard_start(void) {
+	// sockets added before this wait in their epoll set
+	for (int s=0; s < mai.args.shards; s++) {
+		if (loop_shard[s].tid) {
+			if (mai_thread_inherit(loop_shard[s].tid, "shard"))
+				return(-1);
+				
+			continue;
+		}
+		
+		if (mai_thread_create(&loop_shard[s].tid, "shard", loop_worker, &loop_shard[s]) || mai_thread_pin(loop_shard[s].tid, "shard", s))
+			return(-1);
+	}
+	return(0);
+}
+
+/* ######################################################################## */
+static int loop_enter(unsigned submit, unsigned wait) {
+	return(syscall(__NR_io_uring_enter, ring_fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0));
+}
+
+static int loop_arm(size_t idx) {
+	// queue a multishot receive into the provided buffers for this socket,
+	// or with idx LOOP_MAX a no-op that ends the loop thread
+	pthread_mutex_lock(&loop_lock);
+	
+	uint32_t tail = *sq.tail;
+	uint32_t slot = tail & *sq.mask;
+	
+	struct io_uring_sqe *sqe = &sq.sqes[slot];
+	
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = idx;
+	
+	if (idx < LOOP_MAX) {
+		sqe->opcode    = IORING_OP_RECV;
+		sqe->fd        = loop[idx].sk;
+		sqe->ioprio    = IORING_RECV_MULTISHOT;
+		sqe->flags     = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = LOOP_GROUP;
+	} else {
+		sqe->opcode    = IORING_OP_NOP;
+	}
+	
+	sq.array[slot] = slot;
+	__atomic_store_n(sq.tail, tail + 1, __ATOMIC_RELEASE);
+	
+	int r = loop_enter(1, 0);
+	
+	pthread_mutex_unlock(&loop_lock);
+	return((r == 1) ? 0 : mai_error("io_uring submit: %m\n"));
+}
+
+static void loop_buf_put(uint16_t bid) {
+	// hand a receive buffer back to the kernel
+	uint16_t tail = buf_ring->tail;
+	
+	buf_ring->bufs[tail & (LOOP_BUFS - 1)] = (struct io_uring_buf){
+		.addr = (uintptr_t)(buf_data + (bid * LOOP_BUF_SIZE)), .len = LOOP_BUF_SIZE - 1, .bid = bid
+	};
+	
+	__atomic_store_n(&buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* ######################################################################## */
+static void *loop_uring(void *arg) {
+	// one thread services every socket: wait, drain completions, recycle buffers
+	while (1) {
+		if ((loop_enter(0, 1) < 0) && (errno != EINTR))
+			mai_error("io_uring wait: %m\n");
+			
+		uint32_t head = *cq.head;
+		uint32_t tail = __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE);
+		
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &cq.cqes[head & *cq.mask];
+			size_t               idx = cqe->user_data;
+			
+			if (idx >= LOOP_MAX)
+				return(arg);		// mai_loop_stop()
+				
+			if (cqe->flags & IORING_CQE_F_BUFFER) {
+				uint16_t bid  = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				uint8_t *data = buf_data + (bid * LOOP_BUF_SIZE);
+				
+				if ((cqe->res > 0) && (loop[idx].sk >= 0)) {
+					data[cqe->res] = 0;	// terminate text payloads
+					loop[idx].func(data, cqe->res, loop[idx].arg);
+				}
+				loop_buf_put(bid);
+			}
+			
+			if (cqe->flags & IORING_CQE_F_MORE)
+				continue;
+				
+			// multishot ended: free when removed, rearm when out of buffers, and on any
+			// other error (a kernel without multishot recv) receive in a blocking thread
+			if (loop[idx].sk == -2)
+				__atomic_store_n(&loop[idx].sk, -1, __ATOMIC_RELEASE);
+			else if ((cqe->res >= 0) || (cqe->res == -ENOBUFS))
+				loop_arm(idx);
+			else if (!mai_thread_create(&loop[idx].tid, loop[idx].name, loop_recv, &loop[idx]))
+				__atomic_store_n(&loop[idx].own, 1, __ATOMIC_RELEASE);
+				
+			if ((cqe->res < 0) && (cqe->res != -ENOBUFS))
+				mai_error("io_uring recv on %s socket: %s, blocking receive instead\n", loop[idx].name, strerror(-cqe->res));
+		}
+		
+		__atomic_store_n(cq.head, head, __ATOMIC_RELEASE);
+	}
+	
+	mai_error("Unexpected Thread Exit!");
+	return(arg);
+}
+
+/* ######################################################################## */
+static int loop_uring_init(void) {
+	struct io_uring_params p = (struct io_uring_params){ 0 };
+	
+	if ((ring_fd = syscall(__NR_io_uring_setup, LOOP_DEPTH, &p)) < 0)
+		return(mai_error("io_uring setup: %m\n"));
+		
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+		return(mai_error("io_uring: kernel too old\n"));
+		
+	// submission and completion rings share one mapping
+	size_t   sq_len = p.sq_off.array + (p.sq_entries * sizeof(uint32_t));
+	size_t   cq_len = p.cq_off.cqes  + (p.cq_entries * sizeof(struct io_uring_cqe));
+	
+	ring_len = (sq_len > cq_len) ? sq_len : cq_len;
+	sq.len   = p.sq_entries * sizeof(struct io_uring_sqe);
+	
+	if ((ring_map = mmap(NULL, ring_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+		ring_map = NULL;
+		return(mai_error("io_uring mmap: %m\n"));
+	}
+	
+	if ((sq.sqes = mmap(NULL, sq.len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES)) == MAP_FAILED) {
+		sq.sqes = NULL;
+		return(mai_error("io_uring mmap: %m\n"));
+	}
+	
+	sq.head  = (uint32_t *)(ring_map + p.sq_off.head);
+	sq.tail  = (uint32_t *)(ring_map + p.sq_off.tail);
+	sq.mask  = (uint32_t *)(ring_map + p.sq_off.ring_mask);
+	sq.array = (uint32_t *)(ring_map + p.sq_off.array);
+	
+	cq.head  = (uint32_t *)(ring_map + p.cq_off.head);
+	cq.tail  = (uint32_t *)(ring_map + p.cq_off.tail);
+	cq.mask  = (uint32_t *)(ring_map + p.cq_off.ring_mask);
+	cq.cqes  = (struct io_uring_cqe *)(ring_map + p.cq_off.cqes);
+	
+	// register receive buffers with the kernel as a provided buffer ring
+	if ((buf_ring = mmap(NULL, LOOP_BUFS * sizeof(struct io_uring_buf), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0)) == MAP_FAILED) {
+		buf_ring = NULL;
+		return(mai_error("buffer ring mmap: %m\n"));
+	}
+	
+	if ((buf_data = mmap(NULL, LOOP_BUFS * LOOP_BUF_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0)) == MAP_FAILED) {
+		buf_data = NULL;
+		return(mai_error("buffer mmap: %m\n"));
+	}
+	
+	struct io_uring_buf_reg reg = (struct io_uring_buf_reg){ .ring_addr = (uintptr_t)buf_ring, .ring_entries = LOOP_BUFS, .bgid = LOOP_GROUP };
+	
+	if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+		return(mai_error("io_uring buffer ring: %m\n"));
+		
+	for (uint16_t bid=0; bid < LOOP_BUFS; bid++)
+		loop_buf_put(bid);
+		
+	return(mai_debug("io_uring: %d buffers x %d bytes\n", LOOP_BUFS, LOOP_BUF_SIZE));
+}
+
+/* ######################################################################## */
+int mai_loop_init(void) {
+	if (mai.args.replay)
+		return(0);
+		
+	if (mai.args.shards)
+		return(loop_shard_init());
+		
+	return(mai.args.uring ? loop_uring_init() : 0);
+}
+
+int mai_loop_start(void) {
+	// after the backend set realtime scheduling, for the threads to inherit it;
+	// threads started earlier (discover waits for sap) take it over now
+	if (mai.args.replay)
+		return(0);
+		
+	if (mai.args.shards)
+		return(loop_shard_start());
+		
+	if (mai.args.uring && loop_tid)
+		return(mai_thread_inherit(loop_tid, "loop"));
+		
+	return(mai.args.uring ? mai_thread_create(&loop_tid, "loop", loop_uring, NULL) : 0);
+}
+
+int mai_loop_join(const char *name, int sk, mai_loop_func func, void *arg, int with) {
+	size_t idx = 0;
+	
+	// reuse a removed entry, io_uring ones once their receive has ended;
+	// sockets come and go from the control and local threads as well
+	pthread_mutex_lock(&loop_lock);
+	
+	while ((idx < loop_used) && (__atomic_load_n(&loop[idx].sk, __ATOMIC_ACQUIRE) != -1))
+		idx++;
+		
+	if (idx >= LOOP_MAX) {
+		pthread_mutex_unlock(&loop_lock);
+		return(mai_error("too many sockets\n"));
+	}
+	
+	socklen_t len = sizeof(loop[idx].addr);
+	
+	loop[idx].name  = name;
+	loop[idx].sk    = sk;
+	loop[idx].func  = func;
+	loop[idx].arg   = arg;
+	loop[idx].shard = NULL;
+	loop[idx].own   = 0;
+	
+	if (getsockname(sk, (struct sockaddr *)&loop[idx].addr, &len) || (loop[idx].addr.sin_family != AF_INET))
+		memset(&loop[idx].addr, 0, sizeof(loop[idx].addr));
+		
+	if (idx == loop_used)
+		__atomic_store_n(&loop_used, idx + 1, __ATOMIC_RELEASE);
+		
+	pthread_mutex_unlock(&loop_lock);
+	
+	// replay: packets come from the replay thread, not the socket
+	if (mai.args.replay)
+		return(0);
+		
+	if (mai.args.uring)
+		return(loop_arm(idx));
+		
+	// shards take the streams and their repairs, ptp and sap keep their own threads
+	if (mai.args.shards && (!strcmp(name, "rtp") || !strcmp(name, "fec")))
+		return(loop_shard_add(idx, with));
+		
+	return(mai_thread_create(&loop[idx].tid, name, loop_recv, &loop[idx]));
+}
+
+int mai_loop_add(const char *name, int sk, mai_loop_func func, void *arg) {
+	return(mai_loop_join(name, sk, func, arg, -1));
+}
+
+int mai_loop_del(int sk) {
+	// the entry is not reused before it is marked free below
+	pthread_mutex_lock(&loop_lock);
+	
+	size_t used = loop_used, idx = 0;
+	
+	while ((idx < used) && (loop[idx].sk != sk))
+		idx++;
+		
+	if ((sk < 0) || (idx >= used)) {
+		pthread_mutex_unlock(&loop_lock);
+		return(-1);
+	}
+	
+	// replay: nothing to stop, the entry no longer matches
+	if (mai.args.replay) {
+		memset(&loop[idx].addr, 0, sizeof(loop[idx].addr));
+		__atomic_store_n(&loop[idx].sk, -1, __ATOMIC_RELEASE);
+		
+	// io_uring: shutdown ends the multishot receive, the loop then frees the entry
+	} else if (mai.args.uring && !__atomic_load_n(&loop[idx].own, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&loop[idx].sk, -2, __ATOMIC_RELEASE);
+		shutdown(sk, SHUT_RD);
+		
+	// shards: as above, and the worker also closes the socket it may be reading
+	} else if (loop[idx].shard) {
+		__atomic_store_n(&loop[idx].sk, -2, __ATOMIC_RELEASE);
+		shutdown(sk, SHUT_RD);
+		
+		pthread_mutex_unlock(&loop_lock);
+		return(0);
+		
+	} else {
+		mai_thread_stop(&loop[idx].tid);
+		__atomic_store_n(&loop[idx].sk, -1, __ATOMIC_RELEASE);
+	}
+	
+	pthread_mutex_unlock(&loop_lock);
+	
+	close(sk);
+	return(0);
+}
+
+static void loop_uring_stop(void) {
+	// the loop thread waits in io_uring_enter(), no cancellation point: wake it to return
+	if (loop_tid && !loop_arm(LOOP_MAX))
+		pthread_join(loop_tid, NULL);
+	else if (loop_tid)
+		pthread_cancel(loop_tid);
+		
+	loop_tid = 0;
+	
+	if (ring_map)  munmap(ring_map, ring_len);
+	if (sq.sqes)   munmap(sq.sqes, sq.len);
+	if (buf_ring)  munmap(buf_ring, LOOP_BUFS * sizeof(struct io_uring_buf));
+	if (buf_data)  munmap(buf_data, LOOP_BUFS * LOOP_BUF_SIZE);
+	
+	close(ring_fd);
+	
+	ring_fd  = -1;
+	ring_map = NULL;
+	sq.sqes  = NULL;
+	buf_ring = NULL;
+	buf_data = NULL;
+}
+
+int mai_loop_stop(void) {
+	// no receive after this, the sockets stay with the modules that opened them
+	if (ring_fd >= 0)
+		loop_uring_stop();
+		
+	for (size_t idx=0; !mai.args.replay && (idx < loop_used); idx++) {
+		if ((loop[idx].sk >= 0) && !loop[idx].shard && (!mai.args.uring || loop[idx].own))
+			mai_thread_stop(&loop[idx].tid);
+	}
+	
+	for (int s=0; s < MAI_STREAM_MAX; s++) {
+		struct shard *w = &loop_shard[s];
+		
+		mai_thread_stop(&w->tid);
+		
+		if (w->ep >= 0)
+			close(w->ep);
+			
+		free(w->data);
+		*w = (struct shard){ .ep = -1 };
+	}
+	
+	memset(loop, 0, sizeof(loop));
+	__atomic_store_n(&loop_used, 0, __ATOMIC_RELEASE);
+	return(0);
+}
+
+int mai_loop_dispatch(struct in_addr dst, uint16_t port, uint8_t *data, ssize_t len) {
+	// hand a packet to the socket that would have received it
+	size_t used = __atomic_load_n(&loop_used, __ATOMIC_ACQUIRE);
+	
+	for (size_t idx=0; idx < used; idx++) {
+		if ((loop[idx].addr.sin_port != htons(port)) || (loop[idx].addr.sin_addr.s_addr != dst.s_addr))
+			continue;
+			
+		data[len] = 0;				// terminate text payloads
+		loop[idx].func(data, len, loop[idx].arg);
+		return(0);
+	}
+	return(-1);
+}
+
+/* ######################################################################## */
@@ -1,36 +1,5 @@
 #include "mai.h"
-
-/* ######################################################################## */
-struct mai_func {
-	int		(*func)(void);
-	int		mode;
-};
-
-static struct mai_func mai_init[] = {
-	{ mai_ptp_init,		'*' },
-	{ mai_rtp_init,		'*' },
-	{ mai_sap_init,		's' },
-	{ mai_jack_init,	'*' },
-
-	{ mai_ptp_start,	'*' },
-	{ mai_rtp_start,	'*' },
-	{ mai_sap_start,	's' },
-	{ NULL,			0   }
-};
-
-static struct mai_func mai_fini[] = {
-	{ mai_rtp_stop,		'*' },
-	{ mai_ptp_stop,		'*' },
-	{ mai_sap_stop,		's' },
-	{ NULL,			0   }
-};
-
-static void run(const struct mai_func *ptr) {
-	for (; ptr && ptr->func; ptr++) {
-		if (((ptr->mode == mai.args.mode) || (ptr->mode == '*')) && (ptr->func)())
-			exit(-1);
-	}
-}
+#include "libmai.h"
 
 /* ######################################################################## */
 static void stats(void) {
@@ -38,17 +7,62 @@ static void stats(void) {
 	
 	fprintf(stderr, "Audio Clock Drift:     %zd\n",   MAI_STAT_GET(audio.drift));
 	fprintf(stderr, "Audio Buffer Underrun: %zu\n",   MAI_STAT_GET(audio.underrun));
-	fprintf(stderr, "Audio Buffer Overrun:  %zu\n\n", MAI_STAT_GET(audio.overrun));
+	fprintf(stderr, "Audio Buffer Overrun:  %zu\n",   MAI_STAT_GET(audio.overrun));
+	fprintf(stderr, "Audio Buffer Trimmed:  %zu\n",   MAI_STAT_GET(audio.trimmed));
+	fprintf(stderr, "Audio Frames Aligned:  %zu\n\n", MAI_STAT_GET(audio.aligned));
 	
 	fprintf(stderr, "RTP Clock Resynced:    %zu\n",   MAI_STAT_GET(rtp.resynced));
 	fprintf(stderr, "RTP Total Packets:     %zu\n",   MAI_STAT_GET(rtp.packets));
 	fprintf(stderr, "RTP Reordered Packets: %zu\n",   MAI_STAT_GET(rtp.reordered));
-	fprintf(stderr, "RTP Dropped Packets:   %zu\n\n", MAI_STAT_GET(rtp.skipped));
+	fprintf(stderr, "RTP Dropped Packets:   %zu\n",   MAI_STAT_GET(rtp.skipped));
+	fprintf(stderr, "RTP Clock Slewed:      %zu\n",   MAI_STAT_GET(rtp.slewed));
+	fprintf(stderr, "RTP First Audio (us):  %zu\n\n", MAI_STAT_GET(rtp.first));
+	
+	if (MAI_STAT_GET(rtp.calls))
+		fprintf(stderr, "RTP Send Calls:        %zu (%.2f packets each)\n\n", MAI_STAT_GET(rtp.calls), (double)(MAI_STAT_GET(rtp.packets) + MAI_STAT_GET(rtp.repair)) / MAI_STAT_GET(rtp.calls));
+		
+	// fec: what the repairs cost in bandwidth and waiting, next to what they saved
+	if (mai.args.fec) {
+		fprintf(stderr, "FEC Repair Packets:    %zu (+%.1f%% bandwidth)\n", MAI_STAT_GET(rtp.repair), (100.0 * MAI_STAT_GET(rtp.repair)) / (MAI_STAT_GET(rtp.packets) + !MAI_STAT_GET(rtp.packets)));
+		fprintf(stderr, "FEC Recovered Packets: %zu\n", MAI_STAT_GET(rtp.recovered));
+		
+		if (!MAI_SENDER)
+			fprintf(stderr, "FEC Window (us):       %zu\n", (size_t)mai.args.window * mai.args.ptime);
+			
+		fprintf(stderr, "\n");
+	}
 	
 	fprintf(stderr, "PTP Master Changes:    %zu\n",   MAI_STAT_GET(ptp.masters));
+	fprintf(stderr, "PTP First Lock (us):   %zu\n",   MAI_STAT_GET(ptp.locked));
 	fprintf(stderr, "PTP Delay Updates:     %zu\n",   MAI_STAT_GET(ptp.requests));
 	fprintf(stderr, "PTP General Messages:  %zu\n",   MAI_STAT_GET(ptp.general));
-	fprintf(stderr, "PTP Event Messages:    %zu\n\n", MAI_STAT_GET(ptp.event));
+	fprintf(stderr, "PTP Event Messages:    %zu\n",   MAI_STAT_GET(ptp.event));
+	fprintf(stderr, "PTP Grandmaster Syncs: %zu\n\n", MAI_STAT_GET(ptp.syncs));
+	
+	fprintf(stderr, "SAP Packets Received:  %zu\n",   MAI_STAT_GET(sap.received));
+	fprintf(stderr, "SAP Sessions Parsed:   %zu\n\n", MAI_STAT_GET(sap.parsed));
+	
+	if (mai.args.record) {
+		fprintf(stderr, "Record Files:          %zu\n",   MAI_STAT_GET(record.files));
+		fprintf(stderr, "Record Frames:         %zu\n",   MAI_STAT_GET(record.frames));
+		fprintf(stderr, "Record Dropped:        %zu\n",   MAI_STAT_GET(record.dropped));
+		fprintf(stderr, "Record Padded:         %zu\n\n", MAI_STAT_GET(record.padded));
+	}
+	
+	if (mai.args.local) {
+		fprintf(stderr, "Local Blocks:          %zu\n",   MAI_STAT_GET(local.blocks));
+		fprintf(stderr, "Local Lost Blocks:     %zu\n\n", MAI_STAT_GET(local.lost));
+	}
+	
+	mai_meter_report();
+	
+	if (mai.args.measure && !MAI_SENDER)
+		mai_measure_report();
+}
+
+static void replay_done(void) {
+	// replay finished: stop like a live run would on a signal
+	kill(getpid(), SIGINT);
 }
 
 /* ######################################################################## */
@@ -56,9 +70,6 @@ int main(int argc, char *argv[]) {
 	// intialize drng
 	srand48(time(NULL) * getpid());
 
-	// parse command line options
-	mai_args_init(argc, argv);
-	
 	// block signals for all threads
 	sigset_t sigset;
 	
@@ -71,9 +82,14 @@ int main(int argc, char *argv[]) {
 	if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
 		return(mai_error("could not mask signals: %m\n"));
 	
-	// initialize modules
-	run(mai_init);
-        	
+	// parse command line options and initialize modules, the backend runs the audio
+	mai_replay_done = replay_done;
+	
+	int rc = mai_open(argc, argv, NULL);
+	
+	if (rc)
+		exit((rc < 0) ? -1 : 0);
+		
 	// wait for signal
 	int signum = 0;
 	
@@ -88,10 +104,10 @@ int main(int argc, char *argv[]) {
 	mai_info("Signal %d. Exiting.\n", signum);
 	
 	// stop modules
-	run(mai_fini);
+	mai_close();
 	
 	// print final statistics
-	if (mai.args.verbose)
+	if (mai.args.verbose || mai.args.measure)
 		stats();
 	
 	return(0);
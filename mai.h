@@ -7,9 +7,11 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -28,20 +30,147 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <net/if.h>
+#include <netinet/if_ether.h>
 
 #include <jack/jack.h>
 #include <jack/ringbuffer.h>
 
+struct mai_sdp {
+	char			 name[64];		// session name
+	char			 addr[INET_ADDRSTRLEN];	// multicast address
+	uint16_t		 port;			// multicast port
+	
+	uint32_t		 bits;			// net audio: bits/sample
+	uint32_t		 channels;		// net audio: channels/stream
+	uint32_t		 rate;			// net audio: samples/second
+	uint32_t		 ptime;			// net audio: microseconds/packet
+	
+	uint32_t		 source;		// sap originating source (network order)
+	uint16_t		 hash;			// sap message id hash
+};
+
+#define MAI_PERIOD_MAX	4096			// headless backend: largest process period
+#define MAI_STREAM_MAX	8			// receiver: streams mixed into the output ports
+#define MAI_DEST_MAX	16			// sender: unicast destinations besides the group
+#define MAI_MIX_WIDTH	8			// mix: output ports per frame (one vector)
+#define MAI_METER_CHANNELS 8			// meter: channels per stream
+#define MAI_STAT_SLOTS	64			// threads with their own counters
+#define MAI_HIST_LEN	32			// log2 histogram buckets
+
+struct mai_hist {
+	size_t			 bucket[MAI_HIST_LEN];	// [0]: 0, [n]: 2^(n-1) .. 2^n-1, [31]: >= 2^30
+	size_t			 sum;			// sum of all samples
+};
+
+struct mai_stat {
+	struct {
+		ssize_t			drift;			// total sample clock drift
+		size_t			overrun;		// buffer overrun
+		size_t			underrun;		// buffer underrun
+		size_t			trimmed;		// frames dropped to hold a buffer target
+		size_t			aligned;		// frames of silence or audio moved to align playout
+	} audio;
+	
+	struct {
+		size_t			resynced;		// total rtp clock resyncs
+		size_t			packets;		// total packets sent/recv
+		size_t			reordered;		// packets received out of order
+		size_t			skipped;		// packets we stopped waiting for
+		size_t			slewed;			// total rtp clock slew samples
+		size_t			first;			// time to first audio (us)
+		size_t			calls;			// send system calls (sender)
+		size_t			repair;			// fec repair packets sent/recv
+		size_t			recovered;		// packets rebuilt from fec repairs
+	} rtp;
+	
+	struct {
+		size_t			masters;		// total ptp master clock changes
+		size_t			requests;		// total ptp delay requests
+		size_t			general;		// total ptp general messages
+		size_t			event;			// total ptp event messages
+		size_t			syncs;			// total ptp syncs sent as grandmaster
+		size_t			locked;			// time to first master (us)
+	} ptp;
+	
+	struct {
+		size_t			received;		// total sap packets received
+		size_t			parsed;			// total sdp sessions parsed
+	} sap;
+	
+	struct {
+		size_t			files;			// recording files opened
+		size_t			frames;			// frames written to disk
+		size_t			dropped;		// frames lost to a full record ring
+		size_t			padded;			// frames of silence for lost packets
+	} record;
+	
+	struct {
+		size_t			blocks;			// periods published/taken through shared memory
+		size_t			lost;			// periods the receiver was lapped on
+	} local;
+	
+	struct {
+		size_t			codes;			// time codes decoded
+		size_t			corrupt;		// time codes broken or failing the check
+		size_t			lost;			// time codes missing from the sequence
+		size_t			slips;			// discontinuities between time codes
+		ssize_t			slipped;		// total samples gained (+) or lost (-)
+	} measure;
+	
+	struct {
+		struct mai_hist		fill;			// audio buffer fill at read (frames)
+		struct mai_hist		offset;			// ptp offset from master (ns)
+		struct mai_hist		gap;			// rtp packet inter-arrival (us)
+		struct mai_hist		latency;		// measured end to end latency (us)
+		struct mai_hist		skew;			// aligned stream skew before correction (us)
+	} hist;
+} __attribute__((aligned(64)));				// one cache line aligned slot per thread
+
+struct mai_meter {
+	uint32_t		 seq;			// seqlock: odd while writing
+	uint32_t		 channels;		// channels in use
+	uint64_t		 frames;		// frames metered
+	float			 peak[MAI_METER_CHANNELS];	// last window: largest magnitude (0..1)
+	float			 rms[MAI_METER_CHANNELS];	// last window: rms (0..1)
+	uint64_t		 clips[MAI_METER_CHANNELS];	// full scale samples
+};
+
+struct mai_stat_shm {
+	uint32_t		 magic;			// MAI_STAT_MAGIC
+	uint32_t		 size;			// sizeof(struct mai_stat_shm)
+	uint32_t		 seq;			// seqlock: odd while writing
+	uint32_t		 pid;			// publishing process
+	uint64_t		 time;			// publish time (realtime ns)
+	struct mai_stat		 stat;			// totals over all threads
+	struct mai_meter	 meter[MAI_STREAM_MAX];	// per stream levels (frames 0: unused)
+};
+
+#define MAI_STAT_MAGIC	0x4D414953		// "MAIS"
+
 extern struct mai {
 	struct {
+		const char		*backend;	// audio backend: jack, null, tone or file:<path>
+		uint32_t		 period;	// headless backend: frames per process period
 		const char		*client;	// jack client name
 		const char		*ports;		// jack port connections
 		
 		const char		*session;	// sdp session name
 		const char		*title;		// sdp session title
 		
-		const char		*addr;		// multicast address
-		uint16_t		 port;		// multicast port
+		const char		*addr;		// multicast address (first stream)
+		uint16_t		 port;		// multicast port (first stream)
+		
+		struct {
+			const char	*addr;		// multicast address
+			uint16_t	 port;		// multicast port
+		} stream[MAI_STREAM_MAX];		// receiver: every -a address
+		size_t			 streams;	// receiver: stream count
+		
+		struct {
+			const char	*addr;		// unicast address
+			uint16_t	 port;		// unicast port (0: stream port)
+		} dest[MAI_DEST_MAX];			// sender: every -O address
+		size_t			 dests;		// sender: unicast destination count
 		
 		int			 mode;		// 's' or 'r' for send|recv mode
 		uint32_t		 bits;		// net audio: bits/sample
@@ -53,40 +182,80 @@ extern struct mai {
 		int			 gid;		// groupid to switch to
 		
 		int			 verbose;	// verbose output
+		int			 grandmaster;	// ptp grandmaster priority1 (0=disabled)
+		int			 fast;		// start before ptp locks
+		const char		*state;		// clock calibration state file
+		int			 ptp_l2;	// ptp over ieee 802.3 (layer 2)
+		int			 discover;	// receiver: subscribe to session by name
+		int			 ring;		// receiver: memory mapped packet ring
+		int			 uring;		// io_uring event loop for all receive sockets
+		int			 shards;	// receiver: stream sockets spread over pinned workers
+		int			 busy_poll;	// socket busy poll time (us)
+		int			 rcvbuf;	// socket receive buffer (bytes)
+		const char		*shm;		// statistics shared memory name
+		const char		*metrics;	// statistics unix socket path
+		const char		*replay;	// receiver: replay pcap file or "gen[:<seconds>]"
+		int			 asap;		// replay as fast as possible
+		int			 measure;	// latency measurement time code on the last channel
+		const char		*record;	// receiver: record to <dir>[,float][,rotate=<s>]
+		const char		*control;	// control unix socket path
+		const char		*batch;		// sender: <us>[,gso] send window
+		double			 align;		// receiver: playout at rtp time plus this link offset (ms)
+		const char		*fec;		// <L>[x<D>] fec matrix: packets per row and column
+		int			 window;	// receiver: packets to wait for a missing one
+		const char		*local;		// same host shared memory ring name
 	} args;
 	
-	struct {
-		struct {
-			ssize_t			drift;			// total sample clock drift
-			size_t			overrun;		// buffer overrun
-			size_t			underrun;		// buffer underrun
-		} audio;
-		
-		struct {
-			size_t			resynced;		// total rtp clock resyncs
-			size_t			packets;		// total packets sent/recv
-			size_t			reordered;		// packets received out of order
-			size_t			skipped;		// packets we stopped waiting for
-		} rtp;
-		
-		struct {
-			size_t			masters;		// total ptp master clock changes
-			size_t			requests;		// total ptp delay requests
-			size_t			general;		// total ptp general messages
-			size_t			event;			// total ptp event messages
-		} ptp;
-	} stat;
+	uint64_t		 start;			// process start time (monotonic ns)
 } mai;
 
+extern struct mai_stat		 mai_stat[MAI_STAT_SLOTS];	// per thread counters
+extern size_t			 mai_stat_used;			// slots handed out
+extern __thread struct mai_stat	*mai_stat_self;			// this thread's slot
+
 /* ######################################################################## */
 #define MAI_SENDER (mai.args.mode == 's')
 
-#define MAI_STAT_GET(t)   (mai.stat.t)
-#define MAI_STAT_ADD(t,v) (mai.stat.t += v)
+// counters are only written by their own thread, so no locked instructions are needed,
+// except in the last slot which threads share once all others are taken
+#define MAI_STAT_SELF() (mai_stat_self ? mai_stat_self : mai_stat_slot())
+
+#define MAI_STAT_GET(t) ({ 								\
+	__typeof__(mai_stat[0].t) _sum = 0;						\
+	size_t _used = __atomic_load_n(&mai_stat_used, __ATOMIC_ACQUIRE);		\
+	for (size_t _lp=0; (_lp < _used) && (_lp < MAI_STAT_SLOTS); _lp++)		\
+		_sum += __atomic_load_n(&mai_stat[_lp].t, __ATOMIC_RELAXED);		\
+	_sum;										\
+})
+
+#define MAI_STAT_ADD(t,v) ({								\
+	struct mai_stat *_self = MAI_STAT_SELF();					\
+	if (_self == &mai_stat[MAI_STAT_SLOTS - 1])					\
+		__atomic_fetch_add(&_self->t, (v), __ATOMIC_RELAXED);			\
+	else										\
+		__atomic_store_n(&_self->t, _self->t + (v), __ATOMIC_RELAXED);		\
+})
+
+#define MAI_HIST_ADD(h,v) ({								\
+	uint64_t _val = (v);								\
+	size_t   _idx = _val ? (64 - __builtin_clzll(_val)) : 0;			\
+	MAI_STAT_ADD(h.bucket[(_idx < MAI_HIST_LEN) ? _idx : (MAI_HIST_LEN - 1)], 1);	\
+	MAI_STAT_ADD(h.sum, _val);							\
+})
 
 #define MAI_STAT_INC(t) MAI_STAT_ADD(t,  1)
 #define MAI_STAT_DEC(t) MAI_STAT_ADD(t, -1)
 
+/* ######################################################################## */
+static inline uint64_t mai_clock_ns(clockid_t id) {
+	struct timespec ts;
+	
+	clock_gettime(id, &ts);
+	return((ts.tv_sec * 1000000000ULL) + ts.tv_nsec);
+}
+
+#define MAI_ELAPSED_US() ((mai_clock_ns(CLOCK_MONOTONIC) - mai.start) / 1000)
+
 /* ######################################################################## */
 #define mai_log(l,f, ...) fprintf(stderr, "[%-5s] %-20s " f, l, __func__ , ##__VA_ARGS__)
 
@@ -97,20 +266,88 @@ extern struct mai {
 
 /* ######################################################################## */
 // args.c
-extern void 		 mai_args_init(int argc, char *argv[]);
+extern int 		 mai_args_init(int argc, char *argv[]);
+extern int		 mai_args_rate(uint32_t rate);
 
 // audio.c
 extern int		 mai_audio_init(size_t rate);
+extern void		 mai_audio_fini(void);
 extern size_t		 mai_audio_size(size_t size);
 
-extern size_t		 mai_audio_write(    const void *data, size_t frames);
-extern size_t		 mai_audio_write_int(const char *data, size_t bytes);
-extern size_t		 mai_audio_read(           void *data, size_t frames);
-extern size_t		 mai_audio_read_int(       char *data, size_t bytes);
+extern size_t		 mai_audio_write(    size_t stream, const void *data, size_t frames);
+extern size_t		 mai_audio_write_int(size_t stream, const char *data, size_t bytes, uint32_t time);
+extern size_t		 mai_audio_write_local(size_t stream, const float *data, size_t frames, uint32_t time);
+extern size_t		 mai_audio_read(     size_t stream,       void *data, size_t frames);
+extern size_t		 mai_audio_read_int(                      char *data, size_t bytes);
+extern int		 mai_audio_ready(size_t bytes);
+
+extern void		 mai_audio_stream(size_t stream, int on);
+extern uint32_t		 mai_audio_streams(void);
+extern int		 mai_audio_target(size_t stream, size_t frames);
+extern size_t		 mai_audio_fill(size_t stream, size_t *target);
+extern void		 mai_audio_align(uint32_t streams, uint64_t tai, size_t frames);
+extern int32_t		 mai_audio_skew(size_t stream);
+extern size_t		 mai_audio_rate(void);
+
+// backend.c
+extern int		 mai_backend_set(const char *name);
+extern int		 mai_backend_init(void);
+extern int		 mai_backend_stop(void);
+extern void		 mai_backend_send(float * const *ports, uint32_t frames, uint64_t tai);
+extern void		 mai_backend_recv(float * const *ports, uint32_t frames, uint64_t tai);
+extern void		 mai_backend_clock(int64_t ptp);
+extern double		 mai_backend_ratio(void);
+extern void		 mai_backend_ratio_set(double ratio);
+
+// control.c
+extern int		 mai_control_start(void);
+extern int		 mai_control_stop(void);
+
+// fec.c
+struct mai_rtp_slot {
+	uint16_t		 len;			// payload bytes (0: empty)
+	uint16_t		 seq;			// sequence number
+	uint32_t		 time;			// rtp time
+	char			 payload[];
+};
+
+typedef struct mai_rtp_slot *(*mai_fec_slot)(void *arg, uint16_t seq);
+
+extern int		 mai_fec_set(const char *spec);
+extern int		 mai_fec_init(void);
+extern size_t		 mai_fec_span(void);
+extern int		 mai_fec_open(size_t stream, const char *addr, uint16_t port, int with);
+extern void		 mai_fec_close(size_t stream);
+extern void		 mai_fec_encode(uint16_t seq, uint32_t time, const char *payload, size_t len);
+extern ssize_t		 mai_fec_send(int sock);
+extern size_t		 mai_fec_recover(size_t stream, uint16_t next, int retry, mai_fec_slot slot, void *arg);
+extern void		 mai_fec_reset(size_t stream);
+
+// headless.c
+extern int		 mai_headless_init(void);
+extern int		 mai_headless_stop(void);
+extern uint32_t		 mai_headless_frames(void);
 
 // jack.c
 extern int		 mai_jack_init(void);
-extern void		 mai_jack_clock(int64_t ptp);
+extern int		 mai_jack_stop(void);
+extern uint32_t		 mai_jack_frames(void);
+extern int		 mai_jack_connect(size_t port, const char *name, int connect);
+
+// lib.c
+extern int		 mai_lib_init(void);
+extern uint32_t		 mai_lib_frames(void);
+
+// loop.c
+typedef void (*mai_loop_func)(uint8_t *data, ssize_t len, void *arg);
+
+extern int		 mai_loop_init(void);
+extern int		 mai_loop_start(void);
+extern int		 mai_loop_add(const char *name, int sk, mai_loop_func func, void *arg);
+extern int		 mai_loop_join(const char *name, int sk, mai_loop_func func, void *arg, int with);
+extern int		 mai_loop_del(int sk);
+extern int		 mai_loop_stop(void);
+extern int		 mai_loop_dispatch(struct in_addr dst, uint16_t port, uint8_t *data, ssize_t len);
 
 // log.c
 extern int 		 mai_log_str(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
@@ -119,29 +356,121 @@ extern int 		 mai_log_str(const char *fmt, ...) __attribute__ ((format (printf,
 extern int		 mai_sap_init( void);
 extern int		 mai_sap_start(void);
 extern int		 mai_sap_stop( void);
+extern int		 mai_sap_listen(void);
+
+// sdp.c
+extern int		 mai_sdp_init(void);
+extern int		 mai_sdp_parse(const char *text, size_t len, struct mai_sdp *sdp);
+extern int		 mai_sdp_update(const struct mai_sdp *sdp);
+extern int		 mai_sdp_refresh(uint32_t source, uint16_t hash);
+extern int		 mai_sdp_delete(uint32_t source, uint16_t hash);
+extern void		 mai_sdp_expire(void);
+extern int		 mai_sdp_find(const char *name, struct mai_sdp *out);
+extern int		 mai_sdp_find_addr(const char *addr, uint16_t port, struct mai_sdp *out);
+
+// state.c
+extern int		 mai_state_init(void);
+extern int		 mai_state_fini(void);
+extern int		 mai_state_find(const char *master, double *ratio, int64_t *delay);
 
 // sock.c
 extern int  		 mai_sock_open(int mode, const char *ip, const uint16_t port);
+extern int		 mai_sock_l2_open(uint16_t proto, const uint8_t *mac);
+extern ssize_t		 mai_sock_l2_send(int sk, uint16_t proto, const uint8_t *mac, const void *data, size_t len);
+extern int		 mai_sock_mute(int sk);
+extern int		 mai_sock_unmute(int sk);
+extern int		 mai_sock_tune(int sk);
 
 extern int 		 mai_sock_if_set(const char *name);
 extern size_t		 mai_sock_if_mtu(void);
+extern int		 mai_sock_if_index(void);
 extern const void 	*mai_sock_if_addr(void);
 extern const char	*mai_sock_if_name(void);
 extern void	 	 mai_sock_if_local(uint8_t *out);
 
+// stat.c
+extern struct mai_stat	*mai_stat_slot(void);
+extern void		 mai_stat_sum(struct mai_stat *out);
+extern int		 mai_stat_init(void);
+extern int		 mai_stat_stop(void);
+
+// thread.c
+extern int		 mai_thread_config(const char *spec);
+extern int		 mai_thread_create(pthread_t *tid, const char *name, void *(*func)(void *), void *arg);
+extern int		 mai_thread_pin(pthread_t tid, const char *name, size_t nth);
+extern int		 mai_thread_stop(pthread_t *tid);
+extern int		 mai_thread_inherit(pthread_t tid, const char *name);
+
+// measure.c
+extern int		 mai_measure_init(void);
+extern void		 mai_measure_encode(float *buffer, size_t frames, uint64_t tai);
+extern void		 mai_measure_decode(const float *buffer, size_t frames, uint64_t tai);
+extern void		 mai_measure_report(void);
+
+// meter.c
+extern struct mai_meter	 mai_meter[MAI_STREAM_MAX];
+
+extern int		 mai_meter_init(void);
+extern void		 mai_meter_block(size_t stream, const float *in, size_t frames);
+extern int		 mai_meter_get(size_t stream, struct mai_meter *out);
+extern void		 mai_meter_report(void);
+
+// mix.c
+extern int		 mai_mix_route(const char *spec);
+extern int		 mai_mix_init(void);
+extern int		 mai_mix_active(uint32_t streams);
+extern void		 mai_mix_gain(size_t port, size_t stream, size_t channel, float gain, uint32_t ramp);
+extern void		 mai_mix_process(float *out, float * const *in, size_t frames, uint32_t streams);
+
 // ptp.c
 extern int		 mai_ptp_init( void);
 extern int		 mai_ptp_start(void);
 extern int		 mai_ptp_stop( void);
 
 extern uint32_t		 mai_ptp_rate(uint32_t rate);
+extern uint64_t		 mai_ptp_time(void);
+extern uint64_t		 mai_ptp_media(uint64_t tai);
+extern int64_t		 mai_ptp_delay(void);
+extern void		 mai_ptp_delay_set(int64_t ns);
 extern const char	*mai_ptp_source(void);
 
+// local.c
+extern int		 mai_local_start(void);
+extern int		 mai_local_quit(void);
+extern int		 mai_local_stop(void);
+extern void		 mai_local_write(const float *data, size_t frames);
+extern void		 mai_local_read(size_t period);
+
+// replay.c
+extern void		(*mai_replay_done)(void);
+extern int		 mai_replay_impair(const char *spec);
+extern int		 mai_replay_start(void);
+extern int		 mai_replay_stop(void);
+
+// record.c
+extern int		 mai_record_config(const char *spec);
+extern int		 mai_record_init(void);
+extern int		 mai_record_stop(void);
+extern int		 mai_record_track(size_t stream);
+extern void		 mai_record_tap(size_t stream, const char *wire, const float *decoded, size_t samples, uint32_t time);
+
+// ring.c
+extern int		 mai_ring_open(const char *ip, uint16_t port);
+extern void		 mai_ring_close(void);
+extern ssize_t		 mai_ring_next(uint8_t **data);
+
 // rtp.c
 extern int		 mai_rtp_init( void);
 extern int		 mai_rtp_start(void);
 extern int		 mai_rtp_stop( void);
 
+extern int		 mai_rtp_stream_add(const char *addr, uint16_t port);
+extern int		 mai_rtp_stream_del(size_t stream);
+extern int		 mai_rtp_network(void);
+extern uint32_t		 mai_rtp_streams(void);
+
+extern uint32_t		 mai_rtp_samples(void);
+extern int		 mai_rtp_batch(const char *spec);
 extern uint64_t 	 mai_rtp_clock(void);
 extern void 		 mai_rtp_offset(int64_t offset);
 
@@ -0,0 +1,245 @@
+#include "mai.h"
+
+/* ######################################################################## */
+#define MEASURE_SYNC	0xF98Au				// 16 bit sync word
+#define MEASURE_BITS	128				// sync(16) tai(64) index(32) check(16)
+#define MEASURE_LEVEL	0.5f				// code sample level (survives 16 bit and dither)
+#define MEASURE_QUIET	8				// silent samples required before a sync word
+
+struct code {
+	uint64_t	tai;				// TAI time of the first code sample (ns)
+	uint32_t	index;				// code number since sender start
+	uint16_t	check;				// fnv-1a over tai and index
+};
+
+static uint32_t		 meas_period;			// samples between codes (100ms)
+static double		 meas_ns;			// nanoseconds per sample
+
+// sender
+static float		 enc_code[MEASURE_BITS];	// current code samples
+static uint32_t		 enc_phase = 0;			// sample within period
+static uint32_t		 enc_index = 0;			// next code number
+
+// receiver
+static uint64_t		 dec_pos   = 0;			// samples decoded
+static uint32_t		 dec_quiet = 0;			// silent samples before this run
+static uint32_t		 dec_run   = 0;			// non-silent samples in this run
+static uint32_t		 dec_shift = 0;			// sync word shift register
+static uint32_t		 dec_bit   = 0;			// bits collected (0: searching)
+static uint64_t		 dec_word[2];			// tai, then index and check (48 bits)
+static uint64_t		 dec_start;			// position of current code
+static int64_t		 dec_tai;			// playout time of current code
+static struct code	 dec_last;			// last good code
+static uint64_t		 dec_last_pos;			// position of last good code
+
+static struct summary {
+	uint32_t	seq;				// seqlock: odd while writing
+	size_t		count;				// latency samples
+	int64_t		min, max;			// latency range (ns)
+	double		sum;				// latency sum (ns)
+	double		sx, sy, sxx, sxy;		// latency over time regression (s, ns)
+	uint64_t	first, last;			// sender time of first and last code (ns)
+} meas;
+
+/* ######################################################################## */
+static uint16_t measure_check(uint64_t tai, uint32_t index) {
+	uint32_t h = 2166136261u;
+	
+	for (int lp=0; lp < 8; lp++, tai >>= 8)
+		h = (h ^ (tai & 0xFF)) * 16777619u;
+		
+	for (int lp=0; lp < 4; lp++, index >>= 8)
+		h = (h ^ (index & 0xFF)) * 16777619u;
+		
+	return(h ^ (h >> 16));
+}
+
+static void measure_code(uint64_t tai) {
+	// sync word, then tai, index and check, most significant bit first
+	uint64_t word[2] = {
+		tai,
+		((uint64_t)enc_index << 32) | ((uint64_t)measure_check(tai, enc_index) << 16)
+	};
+	
+	for (uint32_t lp=0; lp < 16; lp++)
+		enc_code[lp] = ((MEASURE_SYNC >> (15 - lp)) & 1) ? MEASURE_LEVEL : -MEASURE_LEVEL;
+		
+	for (uint32_t lp=16; lp < MEASURE_BITS; lp++)
+		enc_code[lp] = ((word[(lp - 16) / 64] >> (63 - ((lp - 16) % 64))) & 1) ? MEASURE_LEVEL : -MEASURE_LEVEL;
+		
+	enc_index += 1;
+}
+
+/* ######################################################################## */
+void mai_measure_encode(float *buffer, size_t frames, uint64_t tai) {
+	// the last channel carries a time code every period, silence between
+	const size_t channels = mai.args.channels;
+	float       *out      = &buffer[channels - 1];
+	
+	for (size_t lp=0; lp < frames; lp++, out += channels) {
+		if (enc_phase == 0)
+			measure_code(tai + (uint64_t)(lp * meas_ns));
+			
+		*out = (enc_phase < MEASURE_BITS) ? enc_code[enc_phase] : 0.0f;
+		
+		if (++enc_phase >= meas_period)
+			enc_phase = 0;
+	}
+}
+
+/* ######################################################################## */
+static void measure_result(const struct code *c) {
+	int64_t latency = dec_tai - (int64_t)c->tai;
+	
+	MAI_STAT_INC(measure.codes);
+	MAI_HIST_ADD(hist.latency, (latency > 0) ? (latency / 1000) : 0);
+	
+	// continuity: codes are exactly one period apart in the sample stream
+	if (dec_last.tai && (c->index > dec_last.index)) {
+		int64_t expect = (int64_t)(c->index - dec_last.index) * meas_period;
+		int64_t actual = dec_start - dec_last_pos;
+		
+		MAI_STAT_ADD(measure.lost, c->index - dec_last.index - 1);
+		
+		if (actual != expect) {
+			MAI_STAT_INC(measure.slips);
+			MAI_STAT_ADD(measure.slipped, actual - expect);
+		}
+	}
+	
+	dec_last     = *c;
+	dec_last_pos = dec_start;
+	
+	// latency range and drift (least squares slope of latency over time)
+	__atomic_store_n(&meas.seq, meas.seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	
+	if (!meas.count++) {
+		meas.first = c->tai;
+		meas.min   = meas.max = latency;
+	}
+	
+	meas.last = c->tai;
+	
+	if (latency < meas.min) meas.min = latency;
+	if (latency > meas.max) meas.max = latency;
+	
+	double x = (c->tai - meas.first) / 1e9, y = latency;
+	
+	meas.sum += y;
+	meas.sx  += x;
+	meas.sy  += y;
+	meas.sxx += x * x;
+	meas.sxy += x * y;
+	
+	__atomic_store_n(&meas.seq, meas.seq + 1, __ATOMIC_RELEASE);
+}
+
+static void measure_bit(int bit) {
+	// collect 112 bits after the sync word
+	uint32_t n = dec_bit++ - 16;
+	
+	dec_word[n / 64] = (dec_word[n / 64] << 1) | bit;
+	
+	if (dec_bit < MEASURE_BITS)
+		return;
+		
+	struct code c = (struct code){ .tai = dec_word[0], .index = dec_word[1] >> 16, .check = dec_word[1] };
+	
+	dec_bit = 0;
+	
+	if (c.check != measure_check(c.tai, c.index)) {
+		MAI_STAT_INC(measure.corrupt);
+		return;
+	}
+	
+	if (c.index < dec_last.index)
+		dec_last.tai = 0;			// sender restarted
+		
+	measure_result(&c);
+}
+
+void mai_measure_decode(const float *buffer, size_t frames, uint64_t tai) {
+	const size_t  channels = mai.args.channels;
+	const float  *in       = &buffer[channels - 1];
+	
+	for (size_t lp=0; lp < frames; lp++, in += channels, dec_pos++) {
+		float s = *in;
+		
+		if ((s < (MEASURE_LEVEL / 2)) && (s > (-MEASURE_LEVEL / 2))) {
+			// silence (or a dropout inside a code)
+			if (dec_bit)
+				MAI_STAT_INC(measure.corrupt);
+				
+			dec_bit   = 0;
+			dec_quiet = dec_run ? 1 : (dec_quiet + 1);
+			dec_run   = 0;
+			continue;
+		}
+		
+		if (dec_bit) {
+			measure_bit(s > 0);
+			continue;
+		}
+		
+		// search: the sync word is the first 16 samples after silence
+		dec_shift = ((dec_shift << 1) | (s > 0)) & 0xFFFF;
+		
+		if ((++dec_run == 16) && (dec_quiet >= MEASURE_QUIET) && (dec_shift == MEASURE_SYNC)) {
+			dec_bit   = 16;
+			dec_start = dec_pos - 15;
+			dec_tai   = tai + (int64_t)(((int64_t)lp - 15) * meas_ns);
+		}
+	}
+}
+
+/* ######################################################################## */
+void mai_measure_report(void) {
+	struct summary m;
+	uint32_t       seq;
+	
+	do {
+		seq = __atomic_load_n(&meas.seq, __ATOMIC_ACQUIRE);
+		memcpy(&m, &meas, sizeof(m));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || (seq != __atomic_load_n(&meas.seq, __ATOMIC_RELAXED)));
+	
+	double n     = m.count;
+	double slope = ((n * m.sxx) - (m.sx * m.sx)) ? (((n * m.sxy) - (m.sx * m.sy)) / ((n * m.sxx) - (m.sx * m.sx))) : 0;
+	
+	fprintf(stderr, "Measure Codes:         %zu\n",   MAI_STAT_GET(measure.codes));
+	fprintf(stderr, "Measure Corrupt:       %zu\n",   MAI_STAT_GET(measure.corrupt));
+	fprintf(stderr, "Measure Lost:          %zu\n",   MAI_STAT_GET(measure.lost));
+	fprintf(stderr, "Measure Slips:         %zu\n",   MAI_STAT_GET(measure.slips));
+	fprintf(stderr, "Measure Slipped:       %zd\n",   MAI_STAT_GET(measure.slipped));
+	
+	if (!m.count) {
+		fprintf(stderr, "Measure Latency (us):  -\n\n");
+		return;
+	}
+	
+	// slope is ns of latency per second of sender time: ppb
+	fprintf(stderr, "Measure Latency (us):  %.1f min, %.1f avg, %.1f max\n", m.min / 1e3, (m.sum / n) / 1e3, m.max / 1e3);
+	fprintf(stderr, "Measure Drift (ppm):   %.3f over %.0fs\n\n", slope / 1e3, (m.last - m.first) / 1e9);
+}
+
+/* ######################################################################## */
+int mai_measure_init(void) {
+	if (!mai.args.measure)
+		return(0);
+		
+	// codes and results from an earlier open
+	enc_phase = enc_index = 0;
+	dec_pos   = dec_quiet = dec_run = dec_shift = dec_bit = 0;
+	
+	memset(&dec_last, 0, sizeof(dec_last));
+	memset(&meas, 0, sizeof(meas));
+	
+	// one code every 100ms, well apart from the packet and period sizes
+	meas_period = mai.args.rate / 10;
+	meas_ns     = 1e9 / mai.args.rate;
+	
+	return(mai_debug("Measure: %s time code on channel %u every %u samples\n", MAI_SENDER ? "sending" : "receiving", mai.args.channels, meas_period));
+}
+
+/* ######################################################################## */
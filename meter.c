@@ -0,0 +1,158 @@
+#include "mai.h"
+
+/* ######################################################################## */
+#define METER_WINDOW	10				// snapshots per second
+#define METER_LANES	8				// floats per vector
+
+typedef float   meter_v __attribute__((vector_size(METER_LANES * sizeof(float))));
+typedef int32_t meter_i __attribute__((vector_size(METER_LANES * sizeof(int32_t))));
+
+struct window {
+	double		sum[MAI_METER_CHANNELS];	// sum of squares
+	float		peak[MAI_METER_CHANNELS];	// largest magnitude
+	uint64_t	frames;				// frames in this window
+};
+
+static struct window	 meter_win[MAI_STREAM_MAX];	// hot thread only
+struct mai_meter	 mai_meter[MAI_STREAM_MAX];	// published, seqlock per stream
+
+/* ######################################################################## */
+int mai_meter_init(void) {
+	// before any audio thread runs: levels start from silence
+	memset(meter_win, 0, sizeof(meter_win));
+	memset(mai_meter, 0, sizeof(mai_meter));
+	return(0);
+}
+
+static void meter_publish(size_t stream, struct window *w) {
+	struct mai_meter *m = &mai_meter[stream];
+	
+	// seqlock: readers retry while seq is odd or changed during their copy
+	__atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	
+	m->channels = mai.args.channels;
+	m->frames  += w->frames;
+	
+	for (size_t ch=0; ch < mai.args.channels; ch++) {
+		m->peak[ch] = w->peak[ch];
+		m->rms[ch]  = sqrt(w->sum[ch] / w->frames);
+	}
+	
+	__atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELEASE);
+	
+	memset(w, 0, sizeof(*w));
+}
+
+/* ######################################################################## */
+void mai_meter_block(size_t stream, const float *in, size_t frames) {
+	// interleaved floats: vector lane l of vector v is channel ((v * 8) + l) % channels,
+	// so a group of lcm(8, channels) samples maps every lane to a fixed channel
+	const size_t channels = mai.args.channels;
+	const size_t vectors  = channels / ((channels & 7) ? (channels & -channels) : 8);
+	const size_t samples  = frames * channels;
+	
+	const meter_i mag  = (meter_i){ 0 } + 0x7FFFFFFF;
+	const meter_v full = (meter_v){ 0 } + 1.0f;
+	
+	meter_v sum[METER_LANES], peak[METER_LANES];
+	meter_i clip[METER_LANES];
+	
+	struct window    *w = &meter_win[stream];
+	struct mai_meter *m = &mai_meter[stream];
+	size_t            pos = 0;
+	
+	for (size_t v=0; v < vectors; v++) {
+		sum[v]  = peak[v] = (meter_v){ 0 };
+		clip[v] = (meter_i){ 0 };
+	}
+	
+	for (; (pos + (vectors * METER_LANES)) <= samples; ) {
+		for (size_t v=0; v < vectors; v++, pos += METER_LANES) {
+			meter_v x, a;
+			
+			memcpy(&x, in + pos, sizeof(x));
+			
+			a = (meter_v)((meter_i)x & mag);
+			
+			meter_i more = a > peak[v];
+			
+			sum[v]  += x * x;
+			peak[v]  = (meter_v)(((meter_i)a & more) | ((meter_i)peak[v] & ~more));
+			clip[v] -= a >= full;
+		}
+	}
+	
+	// fold the lanes into channels
+	uint64_t clips[MAI_METER_CHANNELS] = { 0 };
+	
+	for (size_t v=0, ch=0; v < vectors; v++) {
+		for (size_t l=0; l < METER_LANES; l++, ch = ((ch + 1) < channels) ? (ch + 1) : 0) {
+			w->sum[ch] += sum[v][l];
+			clips[ch]  += clip[v][l];
+			
+			if (peak[v][l] > w->peak[ch])
+				w->peak[ch] = peak[v][l];
+		}
+	}
+	
+	// partial group: whole frames remain, so pos is channel 0
+	for (size_t ch=0; pos < samples; pos++, ch = (ch + 1) % channels) {
+		float a = fabsf(in[pos]);
+		
+		w->sum[ch] += in[pos] * in[pos];
+		clips[ch]  += (a >= 1.0f);
+		
+		if (a > w->peak[ch])
+			w->peak[ch] = a;
+	}
+	
+	// clip counts are totals: readers only see them grow
+	for (size_t ch=0; ch < channels; ch++) {
+		if (clips[ch])
+			__atomic_store_n(&m->clips[ch], m->clips[ch] + clips[ch], __ATOMIC_RELAXED);
+	}
+	
+	if ((w->frames += frames) >= (mai.args.rate / METER_WINDOW))
+		meter_publish(stream, w);
+}
+
+/* ######################################################################## */
+int mai_meter_get(size_t stream, struct mai_meter *out) {
+	// any thread, never blocks the writer
+	const struct mai_meter *m = &mai_meter[stream];
+	uint32_t                seq;
+	
+	do {
+		seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+		memcpy(out, m, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || (seq != __atomic_load_n(&m->seq, __ATOMIC_RELAXED)));
+	
+	return(out->frames ? 0 : -1);
+}
+
+void mai_meter_report(void) {
+	struct mai_meter m;
+	
+	for (size_t s=0; s < MAI_STREAM_MAX; s++) {
+		if (mai_meter_get(s, &m))
+			continue;
+			
+		fprintf(stderr, "Meter Stream %zu:       ", s + 1);
+		
+		for (size_t ch=0; ch < m.channels; ch++)
+			fprintf(stderr, "%s%.1f/%.1f", ch ? ", " : "", 20 * log10(m.peak[ch] + 1e-10), 20 * log10(m.rms[ch] + 1e-10));
+			
+		fprintf(stderr, " dBFS peak/rms\n");
+		
+		fprintf(stderr, "Meter Clips %zu:        ", s + 1);
+		
+		for (size_t ch=0; ch < m.channels; ch++)
+			fprintf(stderr, "%s%" PRIu64, ch ? ", " : "", m.clips[ch]);
+			
+		fprintf(stderr, "\n\n");
+	}
+}
+
+/* ######################################################################## */
@@ -0,0 +1,239 @@
+#include "mai.h"
+
+/* ######################################################################## */
+#define MIX_INPUTS	(MAI_STREAM_MAX * MAI_MIX_WIDTH)	// stream channels: stream * MAI_MIX_WIDTH + channel
+#define MIX_QUEUE	64				// pending gain changes
+
+// one vector lane per output port: every input adds to all ports at once
+typedef float mix_v __attribute__((vector_size(MAI_MIX_WIDTH * sizeof(float))));
+
+struct route {
+	uint8_t		port;				// output port (0 based)
+	uint8_t		input;				// stream * MAI_MIX_WIDTH + channel
+	float		gain;				// linear gain
+};
+
+struct request {
+	uint8_t		port;				// output port
+	uint8_t		input;				// stream channel
+	float		gain;				// target gain
+	uint32_t	ramp;				// frames to reach it
+};
+
+static struct route	 mix_route[MIX_INPUTS];		// -x arguments
+static size_t		 mix_routes = 0;
+
+static mix_v		 mix_gain[MIX_INPUTS];		// current gain per input and port
+static mix_v		 mix_step[MIX_INPUTS];		// gain change per frame while ramping
+static mix_v		 mix_target[MIX_INPUTS];	// gain at the end of the ramp
+static uint32_t		 mix_ramp[MIX_INPUTS];		// frames left in the ramp
+
+static uint8_t		 mix_list[MIX_INPUTS];		// inputs with a non zero gain or ramp
+static size_t		 mix_used = 0;
+static size_t		 mix_ramping = 0;		// inputs in mix_list still ramping
+static int		 mix_unity = 1;			// first stream: channel n at unity into port n only
+
+static struct request	 mix_queue[MIX_QUEUE];		// control to process thread
+static uint32_t		 mix_head = 0, mix_tail = 0;
+
+/* ######################################################################## */
+int mai_mix_route(const char *spec) {
+	// <port>=<stream>.<channel>[@<dB>], all 1 based; NULL forgets them all
+	unsigned port, stream, channel;
+	double   db = 0;
+	int      len = 0;
+	
+	if (!spec) {
+		mix_routes = 0;
+		return(0);
+	}
+	
+	if ((sscanf(spec, "%u=%u.%u%n", &port, &stream, &channel, &len) != 3) || (spec[len] && (sscanf(spec + len, "@%lf", &db) != 1)))
+		return(-1);
+		
+	if (!port || (port > MAI_MIX_WIDTH) || !stream || (stream > MAI_STREAM_MAX) || !channel || (channel > MAI_MIX_WIDTH))
+		return(-1);
+		
+	mix_route[mix_routes++ % MIX_INPUTS] = (struct route){
+		.port  = port - 1,
+		.input = ((stream - 1) * MAI_MIX_WIDTH) + (channel - 1),
+		.gain  = pow(10, db / 20)
+	};
+	
+	return(0);
+}
+
+/* ######################################################################## */
+static void mix_list_update(void) {
+	static const mix_v zero = { 0 };
+	
+	mix_used    = 0;
+	mix_ramping = 0;
+	mix_unity   = !mix_routes;
+	
+	for (size_t in=0; in < MIX_INPUTS; in++) {
+		// the first stream alone plays straight through only while its gains are the default
+		if (in < MAI_MIX_WIDTH) {
+			mix_v unity = { 0 };
+			
+			if (in < mai.args.channels)
+				unity[in] = 1.0f;
+				
+			if (mix_ramp[in] || memcmp(&mix_gain[in], &unity, sizeof(unity)))
+				mix_unity = 0;
+		}
+		
+		if (!mix_ramp[in] && !memcmp(&mix_gain[in], &zero, sizeof(zero)))
+			continue;
+			
+		mix_list[mix_used++] = in;
+		mix_ramping += !!mix_ramp[in];
+	}
+}
+
+static void mix_apply(void) {
+	// process thread: take queued changes at the period boundary
+	uint32_t tail = __atomic_load_n(&mix_tail, __ATOMIC_ACQUIRE);
+	
+	if (mix_head == tail)
+		return;
+		
+	for (; mix_head != tail; mix_head++) {
+		const struct request *r  = &mix_queue[mix_head % MIX_QUEUE];
+		const size_t          in = r->input;
+		
+		mix_target[in][r->port] = r->gain;
+		
+		// the whole input ramps together: other ports finish on the new schedule
+		if ((mix_ramp[in] = r->ramp) == 0)
+			mix_gain[in] = mix_target[in];
+		else
+			mix_step[in] = (mix_target[in] - mix_gain[in]) / (float)r->ramp;
+	}
+	
+	mix_list_update();
+}
+
+static void mix_ramp_frame(void) {
+	// one frame of every running ramp, exact target on the last frame
+	for (size_t lp=0; lp < mix_used; lp++) {
+		const size_t in = mix_list[lp];
+		
+		if (!mix_ramp[in])
+			continue;
+			
+		if (--mix_ramp[in]) {
+			mix_gain[in] += mix_step[in];
+			continue;
+		}
+		
+		mix_gain[in] = mix_target[in];
+		mix_ramping -= 1;
+	}
+}
+
+/* ######################################################################## */
+void mai_mix_gain(size_t port, size_t stream, size_t channel, float gain, uint32_t ramp) {
+	// single producer (control), single consumer (process callback)
+	if ((port >= MAI_MIX_WIDTH) || (stream >= MAI_STREAM_MAX) || (channel >= MAI_MIX_WIDTH))
+		return;
+		
+	if ((mix_tail - __atomic_load_n(&mix_head, __ATOMIC_RELAXED)) >= MIX_QUEUE)
+		return;
+		
+	mix_queue[mix_tail % MIX_QUEUE] = (struct request){
+		.port  = port,
+		.input = (stream * MAI_MIX_WIDTH) + channel,
+		.gain  = gain,
+		.ramp  = ramp
+	};
+	
+	__atomic_store_n(&mix_tail, mix_tail + 1, __ATOMIC_RELEASE);
+}
+
+void mai_mix_process(float *out, float * const *in, size_t frames, uint32_t streams) {
+	// out: MAI_MIX_WIDTH floats per frame, 32 byte aligned
+	const size_t  channels = mai.args.channels;
+	const float  *src[MIX_INPUTS];
+	const mix_v  *gain[MIX_INPUTS];
+	mix_v        *dst = (mix_v *)out;
+	size_t        used = 0;
+	
+	mix_apply();
+	
+	const size_t ramping = mix_ramping;
+	
+	// streams switched off keep their gains, they just do not play
+	for (size_t lp=0; lp < mix_used; lp++) {
+		const size_t in_stream = mix_list[lp] / MAI_MIX_WIDTH;
+		
+		if (!(streams & (1u << in_stream)))
+			continue;
+			
+		src[used]    = in[in_stream] + (mix_list[lp] % MAI_MIX_WIDTH);
+		gain[used++] = &mix_gain[mix_list[lp]];
+	}
+	
+	// one pass over the input frames, every output port per multiply-add
+	for (size_t frame=0, pos=0; frame < frames; frame++, pos += channels) {
+		mix_v acc = { 0 };
+		
+		for (size_t lp=0; lp < used; lp++)
+			acc += src[lp][pos] * *gain[lp];
+			
+		dst[frame] = acc;
+		
+		if (mix_ramping)
+			mix_ramp_frame();
+	}
+	
+	// finished ramps to silence leave the list
+	if (ramping && !mix_ramping)
+		mix_list_update();
+}
+
+/* ######################################################################## */
+int mai_mix_active(uint32_t streams) {
+	// anything but the first stream alone at its default gains, or gain changes to take
+	return((streams & ~1u) || !mix_unity || (__atomic_load_n(&mix_tail, __ATOMIC_ACQUIRE) != mix_head));
+}
+
+int mai_mix_init(void) {
+	const size_t channels = mai.args.channels;
+	
+	memset(mix_gain, 0, sizeof(mix_gain));
+	memset(mix_step, 0, sizeof(mix_step));
+	memset(mix_ramp, 0, sizeof(mix_ramp));
+	
+	mix_head = mix_tail = 0;
+	
+	if (mix_routes > MIX_INPUTS)
+		return(mai_error("mix: at most %d routes\n", MIX_INPUTS));
+		
+	// default: channel n of every stream sums into port n, streams added later too
+	if (!mix_routes) {
+		for (size_t s=0; s < MAI_STREAM_MAX; s++) {
+			for (size_t ch=0; ch < channels; ch++)
+				mix_gain[(s * MAI_MIX_WIDTH) + ch][ch] = 1.0f;
+		}
+	}
+	
+	for (size_t lp=0; lp < mix_routes; lp++) {
+		const struct route *r = &mix_route[lp];
+		
+		if (((r->input % MAI_MIX_WIDTH) >= channels) || (r->port >= channels))
+			return(mai_error("mix: route %u=%u.%u outside %zu channels\n", r->port + 1, (r->input / MAI_MIX_WIDTH) + 1, (r->input % MAI_MIX_WIDTH) + 1, channels));
+			
+		mix_gain[r->input][r->port] += r->gain;
+	}
+	
+	memcpy(mix_target, mix_gain, sizeof(mix_target));
+	mix_list_update();
+	
+	if (!mai_mix_active((1u << mai.args.streams) - 1))
+		return(0);
+		
+	return(mai_debug("Mix: %zu streams into %zu ports\n", mai.args.streams, channels));
+}
+
+/* ######################################################################## */
@@ -17,23 +17,59 @@ struct packet {
         uint8_t		payload[];
 } __attribute__((__packed__));
 
+struct announce {
+	uint8_t		origin[10];
+	uint16_t	utc_offset;
+	uint8_t		reserved;
+	uint8_t		priority1;		// BMCA: datasets compare in order
+	uint8_t		clock_class;		//       from priority1 ...
+	uint8_t		clock_accuracy;
+	uint16_t	clock_variance;
+	uint8_t		priority2;
+	uint8_t		identity[8];		//       ... through identity
+	uint16_t	steps;
+	uint8_t		time_source;
+} __attribute__((__packed__));
+
+#define PTP_BMCA_LEN (offsetof(struct announce, steps) - offsetof(struct announce, priority1))
+
+#define PTP_SYNC_NS	125000000		// grandmaster: sync interval (2^-3 s)
+#define PTP_SYNC_LOG	-3			// grandmaster: sync interval (log2)
+#define PTP_LISTEN_NS	500000000		// grandmaster: listen before taking over
+
 /* ######################################################################## */
 static char		ptp_source[32];		// PTP master source (decoded/text)
+static uint8_t		ptp_clock[8];		// PTP master source (clock identity)
+static const uint8_t	ptp_mac[6] = { 0x01, 0x1B, 0x19, 0x00, 0x00, 0x00 };	// layer 2 multicast
 
-static int 		ptp_sock  = -1;		// port 319: event messages
+static int 		ptp_sock  = -1;		// port 319: event messages (or layer 2)
 static uint64_t		ptp_rate  =  0;		// audio system sample rate
 static uint64_t         ptp_recv  =  0;   	// PTP SYNC Receiver  Timestamp (T'1)
 static uint64_t         ptp_sync  =  0;   	// PTP SYNC Sender    Timestamp (T1)
+static uint64_t		ptp_tai   =  0;		// local TAI clock at the SYNC (T'1)
+static int64_t		ptp_error =  0;		// local TAI clock - PTP media clock (ns)
 
 static int		gen_sock  = -1;		// port 320: general messages
 static uint16_t	 	clk_seq   =  0;		// PTP Two Phase SYNC Sequence
 static uint64_t	 	clk_recv  =  0;		// PTP Two Phase SYNC Received
+static uint64_t	 	clk_tai   =  0;		// PTP Two Phase SYNC Received (local TAI)
 
 static int		req_sock  = -1;		// socket for sending messages
 static uint16_t 	req_seq   =  0;		// request message sequence
 static uint64_t		req_sent  =  0;		// PTP DELAY Sender   Timestamp (T2)
 static uint64_t		req_sync  =  0;		// PTP DELAY Receiver Timestamp (T'2)
 
+static uint8_t		ptp_local[10];		// local clock and port identity
+static int64_t		ptp_delay =  0;		// path delay (samples)
+static int		ptp_seed  =  0;		// path delay is a saved estimate
+
+static int		gms_sock   = -1;	// socket for sending general messages
+static int		gms_active =  0;	// grandmaster: we are the best clock
+static uint16_t		gms_seq    =  0;	// grandmaster: SYNC sequence
+static uint16_t		gms_ann    =  0;	// grandmaster: ANNOUNCE sequence
+static uint64_t		gms_until  =  0;	// grandmaster: passive until (monotonic ns)
+static struct announce	gms_self;		// grandmaster: our announce dataset
+
 /* ######################################################################## */
 static uint64_t ptp_stamp(uint8_t *in) {
 	// 48bit seconds in network/msb order
@@ -48,8 +84,55 @@ static uint64_t ptp_stamp(uint8_t *in) {
 	return((sec * ptp_rate) + ((nsec * ptp_rate) / 1000000000));
 }
 
+static void ptp_stamp_set(uint8_t *out, uint64_t ns) {
+	uint64_t sec  = ns / 1000000000;
+	uint32_t nsec = ns % 1000000000;
+	
+	// 48bit seconds, then 32bit nanoseconds in network/msb order
+	for (int lp=6; lp--; sec  >>= 8) out[lp]   = sec  & 0xFF;
+	for (int lp=4; lp--; nsec >>= 8) out[6+lp] = nsec & 0xFF;
+}
+
+/* ######################################################################## */
+static ssize_t ptp_send(int sk, const struct packet *packet, size_t len) {
+	// layer 2: all messages go out of the one socket to the forwardable group
+	if (mai.args.ptp_l2)
+		return(mai_sock_l2_send(req_sock, ETH_P_1588, ptp_mac, packet, len));
+		
+	return(send(sk, packet, len, 0));
+}
+
+/* ######################################################################## */
+static void ptp_header(struct packet *packet, uint8_t type, size_t len, uint16_t seq, uint8_t control, int8_t interval) {
+	memset(packet, 0, len);
+	memcpy(packet->source, ptp_local, sizeof(packet->source));
+	
+	packet->type     = type;		// PTP: Message Type
+	packet->version  = 2;			// PTP: VERSION 2
+	packet->length   = htons(len);		// PTP: Header + Body Length
+	packet->sequence = seq;			// PTP: Sequence (opaque, network order)
+	packet->control  = control;		// PTP: Control Field (v1 compatibility)
+	packet->interval = interval;		// PTP: Log Message Interval
+}
+
 /* ######################################################################## */
+static void ptp_offset(int64_t offset) {
+	// record offset magnitude in ns, then send it to the RTP system
+	if (ptp_rate)
+		MAI_HIST_ADD(hist.offset, (llabs(offset) * 1000000000ULL) / ptp_rate);
+		
+	mai_rtp_offset(offset);
+}
+
 static void ptp_update(void) {
+	// the local TAI clock against the master, aligned playout runs on the master's clock
+	if (ptp_rate)
+		__atomic_store_n(&ptp_error, (((int64_t)ptp_tai - (int64_t)ptp_sync - ptp_delay) * 1000000000LL) / (int64_t)ptp_rate, __ATOMIC_RELAXED);
+		
+	// until the first delay response, use the saved path delay estimate
+	if (ptp_seed)
+		ptp_offset((int64_t)ptp_recv - (int64_t)ptp_sync - ptp_delay);
+		
 	// send delay requests only in sender mode and only every 2 seconds
 	if (!MAI_SENDER || (req_sync > ptp_sync) || ((ptp_sync - req_sync) < (ptp_rate * 2)))
 		return;
@@ -58,16 +141,10 @@ static void ptp_update(void) {
 	static const size_t pktlen = sizeof(struct packet) + ((48 + 32) / 8);
 	
 	struct packet *packet = alloca(pktlen);
-	memset(packet, 0, pktlen);
 	
-	mai_sock_if_local(packet->source);	// PTP: Local Source
-	
-	packet->type     = 1;			// PTP: DELAY REQUEST
-	packet->version  = 2;			// PTP: VERSION 2
-	packet->length   = pktlen;		// PTP: Header + Body Length
-	packet->sequence = ++req_seq;		// PTP: Expected Response Sequence
+	ptp_header(packet, 1, pktlen, ++req_seq, 1, 0x7F);	// PTP: DELAY REQUEST
 	
-	if ((send(req_sock, packet, pktlen, 0)) <= 0)
+	if (ptp_send(req_sock, packet, pktlen) <= 0)
 		mai_error("send: %m\n");
 		
 	req_sent = mai_rtp_clock();		// set delay request time (T2)
@@ -75,119 +152,249 @@ static void ptp_update(void) {
 }
 
 /* ######################################################################## */
-static void *ptp_general(void *arg) {
-	// packet data buffer and header overlay
-	uint8_t	type, data[2048];
+static void ptp_master_sync(void) {
+	// expected size of SYNC and FOLLOW UP packets (header + 48bits + 32bits)
+	static const size_t pktlen = sizeof(struct packet) + ((48 + 32) / 8);
+	
+	struct packet *packet = alloca(pktlen);
+	uint16_t       seq    = htons(++gms_seq);
+	
+	// two-phase SYNC: origin is sent in the FOLLOW UP after the SYNC leaves
+	ptp_header(packet, 0x00, pktlen, seq, 0, PTP_SYNC_LOG);
+	packet->flags = htons(0x0200);
+	
+	if (ptp_send(req_sock, packet, pktlen) <= 0)
+		mai_error("send sync: %m\n");
+		
+	ptp_header(packet, 0x08, pktlen, seq, 2, PTP_SYNC_LOG);
+	ptp_stamp_set(packet->payload, mai_clock_ns(CLOCK_TAI));
+	
+	if (ptp_send(gms_sock, packet, pktlen) <= 0)
+		mai_error("send follow up: %m\n");
+		
+	MAI_STAT_INC(ptp.syncs);
+}
 
-	// state data
-	struct packet *packet = (struct packet *)data;
+static void ptp_master_announce(void) {
+	static const size_t pktlen = sizeof(struct packet) + sizeof(struct announce);
 	
-	for (ssize_t r; 1; ) {
-		if ((r = recv(gen_sock, data, sizeof(data), 0)) <= 0)
-			mai_error("recv: %m\n");
-			
-		if (((packet->version & 0x0F) != 2) || (packet->domain != 0))
-			continue;				// skip: PTP VERSION != 2 or PTP DOMAIN != 0
-			
-		MAI_STAT_INC(ptp.general);
-			
-		type = packet->type & 0x0F;
-		
-		if (type == 0x08) { 				// is this the second phase of a two-phase clock?
-			if (packet->sequence != clk_seq)	// is this the right sequence?
-				continue;
-				
-			ptp_recv = clk_recv;			// set received time (T'1)
-			ptp_sync = ptp_stamp(packet->payload);	// set master time   (T1)
-			
-			ptp_update();
+	struct packet   *packet = alloca(pktlen);
+	struct announce *body   = (struct announce *)packet->payload;
+	
+	ptp_header(packet, 0x0B, pktlen, htons(++gms_ann), 5, 0);
+	
+	*body = gms_self;
+	ptp_stamp_set(body->origin, mai_clock_ns(CLOCK_TAI));
+	
+	if (ptp_send(gms_sock, packet, pktlen) <= 0)
+		mai_error("send announce: %m\n");
+}
+
+static void ptp_master_delay(const struct packet *req, uint64_t stamp) {
+	// expected size of DELAY RESPONSE packet (header + 48bits + 32bits + port identity)
+	static const size_t pktlen = sizeof(struct packet) + ((48 + 32) / 8) + sizeof(req->source);
+	
+	if (!gms_active)
+		return;
+	
+	struct packet *packet = alloca(pktlen);
+	
+	ptp_header(packet, 0x09, pktlen, req->sequence, 3, 0);
+	ptp_stamp_set(packet->payload, stamp);
+	memcpy(packet->payload + 10, req->source, sizeof(req->source));
+	
+	if (ptp_send(gms_sock, packet, pktlen) <= 0)
+		mai_error("send delay response: %m\n");
+}
+
+static void ptp_master_compare(const struct packet *packet, size_t len) {
+	const struct announce *body = (const struct announce *)packet->payload;
+	
+	if (len < (sizeof(*packet) + sizeof(*body)))
+		return;			// skip: short ANNOUNCE
+		
+	if (!memcmp(packet->source, ptp_local, sizeof(ptp_local)))
+		return;			// skip: our own ANNOUNCE
+		
+	int cmp = memcmp(&body->priority1, &gms_self.priority1, PTP_BMCA_LEN);
+	
+	if ((cmp > 0) || (!cmp && (memcmp(packet->source, ptp_local, sizeof(ptp_local)) > 0)))
+		return;			// skip: we are the better clock (port breaks identity ties)
+		
+	// a better clock exists: stay passive for 3 of its announce intervals,
+	// within the profile's range (1/128s .. 16s) whatever the wire says
+	int8_t   wire     = packet->interval;
+	int8_t   interval = (wire < -7) ? -7 : ((wire > 4) ? 4 : wire);
+	uint64_t timeout  = (interval < 0) ? (3000000000ULL >> -interval) : (3000000000ULL << interval);
+	
+	__sync_lock_test_and_set(&gms_until, mai_clock_ns(CLOCK_MONOTONIC) + timeout);
+}
+
+/* ######################################################################## */
+static void *ptp_master(void *arg) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	for (uint32_t tick=0; 1; tick++) {
+		// wait for the next sync interval
+		if ((ts.tv_nsec += PTP_SYNC_NS) >= 1000000000) {
+			ts.tv_nsec -= 1000000000;
+			ts.tv_sec  += 1;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		
+		// take over as soon as no better clock has been announced
+		int active = mai_clock_ns(CLOCK_MONOTONIC) > gms_until;
+		
+		if (active != gms_active) {
+			gms_active = active;
+			mai_info("Grandmaster: %s.\n", active ? "active" : "passive, better clock announced");
+		}
+		
+		if (!active)
+			continue;
 			
-		} else if (type == 0x09) { 			// is this a delay response message?
-			if (packet->sequence != req_seq)	// is this the right sequence?
-				continue;
-				
-			req_sync = ptp_stamp(packet->payload);	// set master delay (T'2)
+		if (!(tick % 8))		// announce once per second
+			ptp_master_announce();
 			
-			// send calculated PTP offset to RTP system
-			mai_rtp_offset(((int64_t)ptp_recv - (int64_t)ptp_sync - (int64_t)req_sync + (int64_t)req_sent) / 2);
-		}
+		ptp_master_sync();
 	}
-
+	
 	mai_error("Unexpected Thread Exit!");
 	return(arg);
 }
 
 /* ######################################################################## */
-static void *ptp_event(void *arg) {
-	const uint16_t flag_two_step = htons(0x0200);
-	
-	// packet data buffer and header overlay
-	uint8_t	data[2048];
-
-	// state data
-	struct packet 	    *packet = (struct packet *)data;
-	static const size_t  pktlen = sizeof(*packet) + ((48 + 32) / 8);
-	
-	uint8_t source[sizeof(packet->source)];		// current PTP SYNC source
-	memset(source, 0, sizeof(source));		// clear current source and initiate sync
+static void ptp_general_packet(struct packet *packet, ssize_t r) {
+	if ((r < (ssize_t)sizeof(*packet)) || ((packet->version & 0x0F) != 2) || (packet->domain != 0))
+		return;					// skip: PTP VERSION != 2 or PTP DOMAIN != 0
+		
+	MAI_STAT_INC(ptp.general);
+		
+	uint8_t type = packet->type & 0x0F;
 	
-	// receive packet loop
-	for (ssize_t r; 1; ) {
-		if ((r = recv(ptp_sock, data, sizeof(data), 0)) <= 0)
-			mai_error("recv: %m\n");
-			
-		if (((packet->version & 0x0F) != 2) || (packet->domain != 0))
-			continue;	// skip: PTP VERSION != 2 or PTP DOMAIN != 0
-			
-		MAI_STAT_INC(ptp.event);
-			
-		if (((size_t)r < pktlen) || (ntohs(packet->length) < pktlen))
-			continue;	// skip: PTP LENGTH < (sizeof(header) + sizeof(SYNC))
-			
-		if ((packet->type & 0x0F) != 0)
-			continue;	// skip: PTP TYPE != SYNC
+	if (type == 0x08) { 				// is this the second phase of a two-phase clock?
+		if (packet->sequence != clk_seq)	// is this the right sequence?
+			return;
 			
-		// check synchronization source
-		if (memcmp(source, packet->source, sizeof(source))) {
-			// we just got a SYNC from a different clock, start RESYNC
-			memcpy(source, packet->source, sizeof(source));
-			
-			// save a string copy of clock source (for SAP/SDP broadcasts)
-			sprintf(ptp_source, "%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X:0", 
-				packet->source[0], packet->source[1], packet->source[2], packet->source[3],
-				packet->source[4], packet->source[5], packet->source[6], packet->source[7]
-			);
+		ptp_recv = clk_recv;			// set received time (T'1)
+		ptp_tai  = clk_tai;
+		ptp_sync = ptp_stamp(packet->payload);	// set master time   (T1)
+		
+		ptp_update();
+		
+	} else if (type == 0x09) { 			// is this a delay response message?
+		if (packet->sequence != req_seq)	// is this the right sequence?
+			return;
 			
-			mai_info("Source: %s (#%zu).\n", ptp_source, MAI_STAT_INC(ptp.masters));
-		}
+		req_sync = ptp_stamp(packet->payload);	// set master delay (T'2)
 		
-		// convert ptp timestamp to clk sample stamp
-		uint64_t stamp = ptp_stamp(packet->payload);
+		// save path delay for the calibration state
+		ptp_delay = ((int64_t)ptp_recv - (int64_t)ptp_sync + (int64_t)req_sync - (int64_t)req_sent) / 2;
+		ptp_seed  = 0;
 		
-		// let jack adjust it's sample rate from ptp rate
-		mai_jack_clock(stamp);
+		// send calculated PTP offset to RTP system
+		ptp_offset(((int64_t)ptp_recv - (int64_t)ptp_sync - (int64_t)req_sync + (int64_t)req_sent) / 2);
 		
-		if (packet->flags & flag_two_step) {	// is this a two-phase clock?
-			clk_seq  = packet->sequence;	// save sequence
-			clk_recv = mai_rtp_clock();	// save received time
+	} else if ((type == 0x0B) && mai.args.grandmaster) {	// is this an announce message?
+		ptp_master_compare(packet, r);
+	}
+}
 
-		} else {				// otherwise, it's a single phase clock
-			ptp_recv = mai_rtp_clock();	// set received time
-			ptp_sync = stamp;		// set master time
+/* ######################################################################## */
+static void ptp_event_packet(struct packet *packet, ssize_t r, uint64_t now) {
+	const        uint16_t flag_two_step = htons(0x0200);
+	static const size_t   pktlen        = sizeof(*packet) + ((48 + 32) / 8);
+	
+	if ((r < (ssize_t)sizeof(*packet)) || ((packet->version & 0x0F) != 2) || (packet->domain != 0))
+		return;		// skip: PTP VERSION != 2 or PTP DOMAIN != 0
+		
+	MAI_STAT_INC(ptp.event);
+		
+	if (((size_t)r < pktlen) || (ntohs(packet->length) < pktlen))
+		return;		// skip: PTP LENGTH < (sizeof(header) + sizeof(SYNC))
+		
+	if ((packet->type & 0x0F) == 1) {
+		ptp_master_delay(packet, now);
+		return;		// done: PTP TYPE == DELAY REQUEST
+	}
+		
+	if ((packet->type & 0x0F) != 0)
+		return;		// skip: PTP TYPE != SYNC
+		
+	// check synchronization source
+	if (memcmp(ptp_clock, packet->source, sizeof(ptp_clock))) {
+		// we just got a SYNC from a different clock, start RESYNC
+		memcpy(ptp_clock, packet->source, sizeof(ptp_clock));
+		
+		// save a string copy of clock source (for SAP/SDP broadcasts)
+		sprintf(ptp_source, "%02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X:0", 
+			packet->source[0], packet->source[1], packet->source[2], packet->source[3],
+			packet->source[4], packet->source[5], packet->source[6], packet->source[7]
+		);
+		
+		MAI_STAT_INC(ptp.masters);
+		mai_info("Source: %s (#%zu).\n", ptp_source, MAI_STAT_GET(ptp.masters));
+		
+		if (!MAI_STAT_GET(ptp.locked))
+			MAI_STAT_ADD(ptp.locked, MAI_ELAPSED_US());
 			
-			ptp_update();
+		// restore saved calibration for this master
+		double  ratio;
+		int64_t delay;
+		
+		if (!mai_state_find(ptp_source, &ratio, &delay)) {
+			mai_backend_ratio_set(ratio);
+			mai_ptp_delay_set(delay);
 		}
 	}
 	
-	mai_error("Unexpected Thread Exit!");
-	return(arg);
+	// convert ptp timestamp to clk sample stamp
+	uint64_t stamp = ptp_stamp(packet->payload);
+	
+	// let the audio backend adjust it's sample rate from ptp rate
+	mai_backend_clock(stamp);
+	
+	if (packet->flags & flag_two_step) {	// is this a two-phase clock?
+		clk_seq  = packet->sequence;	// save sequence
+		clk_recv = mai_rtp_clock();	// save received time
+		clk_tai  = mai_ptp_time();
+
+	} else {				// otherwise, it's a single phase clock
+		ptp_recv = mai_rtp_clock();	// set received time
+		ptp_tai  = mai_ptp_time();
+		ptp_sync = stamp;		// set master time
+		
+		ptp_update();
+	}
 }
 
 /* ######################################################################## */
-static pthread_t evt_tid;
-static pthread_t gen_tid;
+static void ptp_general(uint8_t *data, ssize_t len, void *arg __attribute__((__unused__))) {
+	ptp_general_packet((struct packet *)data, len);
+}
 
-int mai_ptp_init(void) {
+static void ptp_event(uint8_t *data, ssize_t len, void *arg __attribute__((__unused__))) {
+	// receive time, only needed to answer DELAY REQUESTS as grandmaster
+	uint64_t now = mai.args.grandmaster ? mai_clock_ns(CLOCK_TAI) : 0;
+	
+	ptp_event_packet((struct packet *)data, len, now);
+}
+
+static void ptp_layer2(uint8_t *data, ssize_t len, void *arg __attribute__((__unused__))) {
+	uint64_t now = mai.args.grandmaster ? mai_clock_ns(CLOCK_TAI) : 0;
+	
+	// one socket carries both: message types 0..7 are event messages
+	if ((data[0] & 0x08) == 0)
+		ptp_event_packet((struct packet *)data, len, now);
+	else
+		ptp_general_packet((struct packet *)data, len);
+}
+
+/* ######################################################################## */
+static pthread_t gms_tid;
+
+static int ptp_init_udp(void) {
 	if ((ptp_sock = mai_sock_open('r', "224.0.1.129", 319)) < 0)
 		return(mai_error("could not open PTP event socket\n"));
 		
@@ -197,40 +404,102 @@ int mai_ptp_init(void) {
 	if ((req_sock = mai_sock_open('s', "224.0.1.129", 319)) < 0)
 		return(mai_error("could not open PTP message socket\n"));
 		
+	if (mai.args.grandmaster && ((gms_sock = mai_sock_open('s', "224.0.1.129", 320)) < 0))
+		return(mai_error("could not open PTP general message socket\n"));
+		
 	return(mai_debug("PTP Domain: 224.0.1.129 (0)\n"));
 }
 
-int mai_ptp_start(void) {
-	// kick off ptp general messages thread
-	if (pthread_create(&gen_tid, NULL, ptp_general, NULL))
-		return(mai_error("could not start general thread: %m\n"));
+static int ptp_init_l2(void) {
+	if ((ptp_sock = mai_sock_l2_open(ETH_P_1588, ptp_mac)) < 0)
+		return(mai_error("could not open PTP layer 2 socket\n"));
+		
+	if ((req_sock = mai_sock_l2_open(ETH_P_1588, NULL)) < 0)
+		return(mai_error("could not open PTP layer 2 message socket\n"));
+		
+	return(mai_debug("PTP Domain: %s 01-1B-19-00-00-00 (0)\n", mai_sock_if_name()));
+}
+
+int mai_ptp_init(void) {
+	// no master yet, nothing measured
+	memset(ptp_source, 0, sizeof(ptp_source));
+	memset(ptp_clock,  0, sizeof(ptp_clock));
+	memset(ptp_local,  0, sizeof(ptp_local));
+	memset(&gms_self,  0, sizeof(gms_self));
+	
+	ptp_recv  = ptp_sync = ptp_tai = clk_recv = clk_tai = req_sent = req_sync = 0;
+	ptp_error = ptp_delay = 0;
+	ptp_seed  = 0;
+	gms_active = 0;
+	gms_until  = 0;
+	
+	if (mai.args.ptp_l2 ? ptp_init_l2() : ptp_init_udp())
+		return(-1);
+		
+	if (mai_sock_tune(ptp_sock) || ((gen_sock >= 0) && mai_sock_tune(gen_sock)))
+		return(-1);
+		
+	// local port identity: interface eui-64, random if no interface was given
+	mai_sock_if_local(ptp_local);
+	
+	if (!memcmp(ptp_local, (uint8_t[sizeof(ptp_local)]){ 0 }, sizeof(ptp_local))) {
+		for (size_t lp=0; lp < 8; lp++)
+			ptp_local[lp] = lrand48() & 0xFF;
+	}
+	
+	if (mai.args.grandmaster) {
+		// port number from pid so that instances on one host are distinct
+		ptp_local[8] = (getpid() >> 8) & 0xFF;
+		ptp_local[9] = (getpid()     ) & 0xFF;
+		
+		gms_self.priority1      = mai.args.grandmaster;
+		gms_self.clock_class    = 248;			// default, slave capable
+		gms_self.clock_accuracy = 0xFE;			// unknown
+		gms_self.clock_variance = htons(0xFFFF);	// unknown
+		gms_self.priority2      = 128;
+		gms_self.time_source    = 0xA0;			// internal oscillator
+		
+		memcpy(gms_self.identity, ptp_local, sizeof(gms_self.identity));
+	}
+	
+	return(0);
+}
 
-	// kick off ptp thread
-	if (pthread_create(&evt_tid, NULL, ptp_event, NULL))
-		return(mai_error("could not start ptp thread: %m\n"));
+int mai_ptp_start(void) {
+	if (mai.args.ptp_l2) {
+		// ptp layer 2: one socket for all messages
+		if (mai_loop_add("ptp", ptp_sock, ptp_layer2, NULL))
+			return(mai_error("could not start ptp receive\n"));
+	} else {
+		// ptp general and event messages
+		if (mai_loop_add("ptp", gen_sock, ptp_general, NULL) || mai_loop_add("ptp", ptp_sock, ptp_event, NULL))
+			return(mai_error("could not start ptp receive\n"));
+	}
+		
+	// kick off grandmaster after a short listen for better clocks
+	if (mai.args.grandmaster) {
+		gms_until = mai_clock_ns(CLOCK_MONOTONIC) + PTP_LISTEN_NS;
+		
+		if (mai_thread_create(&gms_tid, "ptp", ptp_master, NULL))
+			return(-1);
+	}
         
-	// wait for PTP to synchronize
-	struct timespec ts;
+	// fast start: let PTP lock in the background while audio runs
+	if (mai.args.fast)
+		return(mai_debug("PTP: locking in background.\n"));
+		
+	// wait for PTP to synchronize, 100ms at a time
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 100000000 };
 	
-	for (int count=1; !MAI_STAT_GET(ptp.masters); count++) {
+	for (int count=1; !MAI_STAT_GET(ptp.masters); count++, nanosleep(&ts, NULL)) {
 		// loop banner
-		if (!(count % 5))
+		if (!(count % 50))
 			mai_info("Waiting.\n");
 			
-		// get current time
-		if (clock_gettime(CLOCK_REALTIME, &ts))
-			return(mai_error("could not get system clock: %m\n"));
-			
-		// try to join thread, 1s timeout
-		ts.tv_sec  += 1;
-		
-		if (!pthread_timedjoin_np(evt_tid, NULL, &ts))
-			return(mai_error("startup aborted.\n"));
-			
 		// loop overflow
-		if (count > 60) {
+		if (count > 600) {
 			mai_error("Timeout.\n");
-			return(mai_ptp_stop());
+			return(mai_thread_stop(&gms_tid));
 		}
 	}
 	
@@ -238,17 +507,51 @@ int mai_ptp_start(void) {
 }
 
 int mai_ptp_stop(void) {
-	pthread_cancel(evt_tid);
-	pthread_cancel(gen_tid);
+	// after the event loop, which received on the first two
+	mai_thread_stop(&gms_tid);
+	
+	int *sock[] = { &ptp_sock, &gen_sock, &req_sock, &gms_sock };
+	
+	for (size_t lp=0; lp < (sizeof(sock) / sizeof(sock[0])); lp++) {
+		if (*sock[lp] >= 0)
+			close(*sock[lp]);
+			
+		*sock[lp] = -1;
+	}
 	return(0);
 }
 
 /* ######################################################################## */
 uint32_t mai_ptp_rate(uint32_t rate) {
-	ptp_rate = rate;
+	if (rate)
+		ptp_rate = rate;
+		
 	return(ptp_rate);
 }
 
+uint64_t mai_ptp_time(void) {
+	// local TAI clock in sample time (free-running estimate of PTP time)
+	uint64_t ns = mai_clock_ns(CLOCK_TAI);
+	return(((ns / 1000000000) * ptp_rate) + (((ns % 1000000000) * ptp_rate) / 1000000000));
+}
+
+uint64_t mai_ptp_media(uint64_t tai) {
+	// local TAI time (ns) on the master's media clock, as its senders stamp rtp;
+	// until the first SYNC (or as grandmaster) the local clock is the media clock
+	return(tai - __atomic_load_n(&ptp_error, __ATOMIC_RELAXED));
+}
+
+int64_t mai_ptp_delay(void) {
+	return(ptp_rate ? ((ptp_delay * 1000000000LL) / (int64_t)ptp_rate) : 0);
+}
+
+void mai_ptp_delay_set(int64_t ns) {
+	// receivers send no delay requests, so no response would end the
+	// seeding: there the estimate only serves ptp_error
+	ptp_delay = (ns * (int64_t)ptp_rate) / 1000000000LL;
+	ptp_seed  = MAI_SENDER;
+}
+
 const char *mai_ptp_source(void) {
 	return(ptp_source);
 }
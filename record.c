@@ -0,0 +1,406 @@
+#include "mai.h"
+#include <fcntl.h>
+
+/* ######################################################################## */
+#define RECORD_RING	4				// seconds of audio between tap and writer
+#define RECORD_BLOCK	(256 * 1024)			// bytes per disk write
+#define RECORD_ALIGN	4096				// write buffer and audio data alignment
+#define RECORD_POLL_NS	20000000			// writer wakeup interval
+#define RECORD_ROTATE	3600				// default seconds per file
+
+struct wave {
+	char		riff[4];			// "RIFF" or "RF64"
+	uint32_t	riff_size;			// 0xFFFFFFFF for RF64
+	char		wave[4];			// "WAVE"
+	
+	char		ds64[4];			// "JUNK", becomes "ds64" beyond 4GiB
+	uint32_t	ds64_size;			// 28
+	uint64_t	ds64_riff;			// RF64 riff size
+	uint64_t	ds64_data;			// RF64 data size
+	uint64_t	ds64_frames;			// RF64 sample count
+	uint32_t	ds64_table;			// no table entries
+	
+	char		fmt[4];				// "fmt "
+	uint32_t	fmt_size;			// 18
+	uint16_t	format;				// 1: PCM, 3: IEEE float
+	uint16_t	channels;
+	uint32_t	rate;
+	uint32_t	byte_rate;
+	uint16_t	block_align;
+	uint16_t	bits;
+	uint16_t	cb_size;			// 0
+	
+	char		bext[4];			// "bext" (EBU Tech 3285)
+	uint32_t	bext_size;			// 602
+	char		description[256];
+	char		originator[32];
+	char		originator_ref[32];
+	char		date[10];			// yyyy-mm-dd
+	char		time[8];			// hh:mm:ss
+	uint32_t	time_ref_low;			// samples since midnight
+	uint32_t	time_ref_high;
+	uint16_t	version;			// 1
+	uint8_t		umid[64];
+	uint8_t		loudness[10];
+	uint8_t		reserved[180];
+	
+	char		junk[4];			// "JUNK": pads audio data to RECORD_ALIGN
+	uint32_t	junk_size;
+	uint8_t		pad[RECORD_ALIGN - 700];
+	
+	char		data[4];			// "data"
+	uint32_t	data_size;			// 0xFFFFFFFF for RF64
+} __attribute__((__packed__));
+
+_Static_assert(sizeof(struct wave) == RECORD_ALIGN, "audio data must start aligned");
+
+static const char	*rec_dir;			// output directory
+static int		 rec_float  = 0;		// record decoded float, not wire format
+static uint32_t		 rec_rotate = RECORD_ROTATE;	// seconds per file
+
+// one file set per stream, each with its own ring and rtp timeline
+struct track {
+	jack_ringbuffer_t *ring;			// tap to writer ring (NULL: not recorded)
+	uint32_t	 next;				// tap: rtp time of the next frame
+	int		 synced;			// tap: next is known
+	
+	int		 fd;				// current file
+	struct wave	 head;				// current file header
+	uint64_t	 bytes;				// audio bytes in current file
+};
+
+static struct track	 rec_track[MAI_STREAM_MAX] = { [0 ... MAI_STREAM_MAX-1] = { .fd = -1 } };
+
+static size_t		 rec_stride;			// bytes per frame in file
+static size_t		 rec_chunk;			// whole frames and whole RECORD_ALIGN blocks
+static pthread_t	 rec_tid;			// writer thread
+static int		 rec_active = 1;		// writer: cleared to drain and return
+static uint8_t		*rec_block;			// aligned write buffer
+
+/* ######################################################################## */
+int mai_record_config(const char *spec) {
+	// <dir>[,float][,rotate=<seconds>]; NULL: the defaults
+	rec_float  = 0;
+	rec_rotate = RECORD_ROTATE;
+	
+	if (!spec)
+		return(0);
+		
+	char *copy = strdup(spec), *save = NULL;
+	
+	rec_dir = strtok_r(copy, ",", &save);
+	
+	for (char *opt; (opt = strtok_r(NULL, ",", &save)) != NULL; ) {
+		if (!strcmp(opt, "float"))
+			rec_float = 1;
+		else if (!strncmp(opt, "rotate=", 7) && ((rec_rotate = atoi(opt + 7)) > 0))
+			continue;
+		else
+			return(-1);
+	}
+	return(rec_dir ? 0 : -1);
+}
+
+/* ######################################################################## */
+static void record_silence(jack_ringbuffer_t *ring, size_t frames) {
+	// lost packets keep their place in the file: zero is silence in either format
+	jack_ringbuffer_data_t vec[2];
+	size_t                 bytes = frames * rec_stride;
+	
+	if (jack_ringbuffer_write_space(ring) < bytes) {
+		MAI_STAT_ADD(record.dropped, frames);
+		return;
+	}
+	
+	jack_ringbuffer_get_write_vector(ring, vec);
+	
+	memset(vec[0].buf, 0, (bytes < vec[0].len) ? bytes : vec[0].len);
+	memset(vec[1].buf, 0, (bytes < vec[0].len) ? 0 : (bytes - vec[0].len));
+	
+	jack_ringbuffer_write_advance(ring, bytes);
+	MAI_STAT_ADD(record.padded, frames);
+}
+
+void mai_record_tap(size_t stream, const char *wire, const float *decoded, size_t samples, uint32_t time) {
+	// network or process thread: one copy into the stream's ring, the writer does the rest
+	struct track      *t      = &rec_track[stream];
+	jack_ringbuffer_t *ring   = __atomic_load_n(&t->ring, __ATOMIC_ACQUIRE);
+	const void        *data   = rec_float ? (const void *)decoded : (const void *)wire;
+	size_t             bytes  = samples * (rec_float ? sizeof(float) : (mai.args.bits / 8));
+	size_t             frames = samples / mai.args.channels;
+	int32_t            gap    = time - t->next;
+	int32_t            span   = RECORD_RING * mai.args.rate;
+	
+	if (!ring)
+		return;
+		
+	// the file keeps the rtp timeline its bext time reference starts: silence for
+	// lost packets, nothing for late ones, a jump beyond the ring restarts it;
+	// less than a block off is a slewed clock or local period jitter, not a gap
+	if (t->synced && (gap > -(int32_t)frames) && (gap < (int32_t)frames))
+		time = t->next;
+		
+	if (t->synced && (gap <= -(int32_t)frames) && (gap > -span))
+		return;
+		
+	if (t->synced && (gap >= (int32_t)frames) && (gap < span))
+		record_silence(ring, gap);
+		
+	t->next   = time + frames;
+	t->synced = 1;
+	
+	if (jack_ringbuffer_write_space(ring) < bytes) {
+		MAI_STAT_ADD(record.dropped, frames);
+		return;
+	}
+	
+	jack_ringbuffer_write(ring, data, bytes);
+}
+
+/* ######################################################################## */
+static void record_close(struct track *t) {
+	if (t->fd < 0)
+		return;
+		
+	// sizes go in the header once known, RF64 (EBU Tech 3306) beyond 4GiB
+	uint64_t riff = sizeof(t->head) - 8 + t->bytes;
+	
+	if (riff > UINT32_MAX) {
+		memcpy(&t->head, "RF64", 4);		// riff, through the header: gcc sizes the pwrite by the field
+		memcpy(t->head.ds64, "ds64", 4);
+		
+		t->head.riff_size   = UINT32_MAX;
+		t->head.data_size   = UINT32_MAX;
+		t->head.ds64_riff   = riff;
+		t->head.ds64_data   = t->bytes;
+		t->head.ds64_frames = t->bytes / rec_stride;
+	} else {
+		t->head.riff_size   = riff;
+		t->head.data_size   = t->bytes;
+	}
+	
+	if (pwrite(t->fd, &t->head, sizeof(t->head), 0) != sizeof(t->head))
+		mai_error("record header: %m\n");
+		
+	close(t->fd);
+	t->fd = -1;
+}
+
+static int record_open(size_t stream) {
+	struct track   *t = &rec_track[stream];
+	struct timespec ts;
+	struct tm       tm;
+	char            path[PATH_MAX], stamp[32], date[16], time[16], track[8] = "";
+	
+	clock_gettime(CLOCK_REALTIME, &ts);
+	localtime_r(&ts.tv_sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	
+	// the first stream keeps the plain name, the others are numbered from 2
+	if (stream)
+		snprintf(track, sizeof(track), "-%zu", stream + 1);
+		
+	snprintf(path, sizeof(path), "%s/%s-%s%s.wav", rec_dir, mai.args.session, stamp, track);
+	
+	if ((t->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+		return(mai_error("record (%s): %m\n", path));
+		
+	// broadcast wave header, sizes are filled in on close
+	uint64_t ref = ((((tm.tm_hour * 3600) + (tm.tm_min * 60) + tm.tm_sec) * 1000000000ULL) + ts.tv_nsec) / (1000000000ULL / mai.args.rate);
+	
+	t->head = (struct wave){
+		.riff = "RIFF", .wave = "WAVE",
+		.ds64 = "JUNK", .ds64_size = 28,
+		.fmt  = "fmt ", .fmt_size  = 18,
+		
+		.format      = rec_float ? 3 : 1,
+		.channels    = mai.args.channels,
+		.rate        = mai.args.rate,
+		.byte_rate   = mai.args.rate * rec_stride,
+		.block_align = rec_stride,
+		.bits        = (rec_stride / mai.args.channels) * 8,
+		
+		.bext = "bext", .bext_size = 602,
+		.time_ref_low  = ref & 0xFFFFFFFF,
+		.time_ref_high = ref >> 32,
+		.version       = 1,
+		
+		.junk = "JUNK", .junk_size = sizeof(t->head.pad),
+		.data = "data"
+	};
+	
+	snprintf(t->head.description, sizeof(t->head.description), "%s (%s:%u)", mai.args.session, mai.args.stream[stream].addr, mai.args.stream[stream].port);
+	snprintf(t->head.originator,  sizeof(t->head.originator),  "mai %s", MAI_VERSION);
+	
+	// bext text fields are fixed width, not terminated
+	strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+	strftime(time, sizeof(time), "%H:%M:%S", &tm);
+	
+	memcpy(t->head.date, date, sizeof(t->head.date));
+	memcpy(t->head.time, time, sizeof(t->head.time));
+	memcpy(t->head.originator_ref, stamp, strlen(stamp));
+	
+	if (write(t->fd, &t->head, sizeof(t->head)) != sizeof(t->head))
+		return(mai_error("record header: %m\n"));
+		
+	t->bytes = 0;
+	MAI_STAT_INC(record.files);
+	
+	return(mai_debug("Record: %s\n", path));
+}
+
+/* ######################################################################## */
+static void record_swap(uint8_t *data, size_t bytes) {
+	// wire format is big endian, wave is little endian
+	const size_t unit = mai.args.bits / 8;
+	
+	for (uint8_t *end = data + bytes, t; data < end; data += unit) {
+		t = data[0]; data[0] = data[unit - 1]; data[unit - 1] = t;
+		
+		if (unit == 4) {
+			t = data[1]; data[1] = data[2]; data[2] = t;
+		}
+	}
+}
+
+static size_t record_drain(size_t stream, int flush) {
+	// one large aligned write, never past the rotation point
+	struct track *t     = &rec_track[stream];
+	size_t        bytes = jack_ringbuffer_read_space(t->ring);
+	size_t        limit = ((uint64_t)rec_rotate * mai.args.rate * rec_stride) - t->bytes;
+	size_t block = RECORD_BLOCK - (RECORD_BLOCK % rec_chunk);
+	
+	if (bytes > block) bytes = block;
+	
+	// only the end of a file may be a partial chunk
+	if (bytes >= limit)
+		bytes = limit;
+	else if (!flush)
+		bytes -= bytes % rec_chunk;
+		
+	if ((bytes -= bytes % rec_stride) == 0)
+		return(0);
+		
+	jack_ringbuffer_read(t->ring, (char *)rec_block, bytes);
+	
+	if (!rec_float)
+		record_swap(rec_block, bytes);
+		
+	if ((t->fd >= 0) && (write(t->fd, rec_block, bytes) != (ssize_t)bytes))
+		mai_error("record write: %m\n");
+		
+	t->bytes += bytes;
+	MAI_STAT_ADD(record.frames, bytes / rec_stride);
+	
+	if (t->bytes >= ((uint64_t)rec_rotate * mai.args.rate * rec_stride)) {
+		record_close(t);
+		record_open(stream);
+	}
+	return(bytes);
+}
+
+static size_t record_drain_all(int flush) {
+	// every stream that is recorded, added ones once their ring is published
+	size_t bytes = 0;
+	
+	for (size_t s=0; s < MAI_STREAM_MAX; s++) {
+		if (__atomic_load_n(&rec_track[s].ring, __ATOMIC_ACQUIRE))
+			bytes += record_drain(s, flush);
+	}
+	return(bytes);
+}
+
+static void *record_thread(void *arg) {
+	const struct timespec ts = (struct timespec){ .tv_nsec = RECORD_POLL_NS };
+	
+	// the tap never signals: poll, then write everything that is ready
+	while (__atomic_load_n(&rec_active, __ATOMIC_ACQUIRE)) {
+		nanosleep(&ts, NULL);
+		
+		while (record_drain_all(0))
+			;
+	}
+	
+	// stopping: the rest, partial chunks included
+	while (record_drain_all(1))
+		;
+		
+	return(arg);
+}
+
+/* ######################################################################## */
+int mai_record_track(size_t stream) {
+	// before the stream's first packet: its file, then the ring the tap looks for
+	struct track      *t = &rec_track[stream];
+	jack_ringbuffer_t *ring;
+	
+	if (!mai.args.record || t->ring)
+		return(0);
+		
+	if ((ring = jack_ringbuffer_create(RECORD_RING * mai.args.rate * rec_stride)) == NULL)
+		return(mai_error("failed to create record ringbuffer!\n"));
+		
+	if (record_open(stream)) {
+		jack_ringbuffer_free(ring);
+		return(-1);
+	}
+	
+	t->synced = 0;
+	__atomic_store_n(&t->ring, ring, __ATOMIC_RELEASE);
+	return(0);
+}
+
+int mai_record_init(void) {
+	if (!mai.args.record)
+		return(0);
+		
+	rec_stride = mai.args.channels * (rec_float ? sizeof(float) : (mai.args.bits / 8));
+	rec_chunk  = RECORD_ALIGN;
+	
+	while (rec_chunk % rec_stride)
+		rec_chunk += RECORD_ALIGN;
+		
+	rec_active = 1;
+	
+	if (posix_memalign((void **)&rec_block, RECORD_ALIGN, RECORD_BLOCK))
+		return(mai_error("failed to allocate record buffer!\n"));
+		
+	// streams added later get theirs from mai_rtp_stream_add()
+	for (size_t s=0; s < mai.args.streams; s++) {
+		if (mai_record_track(s))
+			return(-1);
+	}
+	
+	return(mai_thread_create(&rec_tid, "record", record_thread, NULL));
+}
+
+int mai_record_stop(void) {
+	if (!mai.args.record)
+		return(0);
+		
+	// the writer drains what the tap left, then returns
+	if (rec_tid) {
+		__atomic_store_n(&rec_active, 0, __ATOMIC_RELEASE);
+		pthread_join(rec_tid, NULL);
+	}
+	
+	rec_tid = 0;
+	
+	for (size_t s=0; s < MAI_STREAM_MAX; s++) {
+		struct track *t = &rec_track[s];
+		
+		record_close(t);
+		
+		if (t->ring)
+			jack_ringbuffer_free(t->ring);
+			
+		*t = (struct track){ .fd = -1 };
+	}
+	
+	free(rec_block);
+	
+	rec_block = NULL;
+	return(0);
+}
+
+/* ######################################################################## */
@@ -0,0 +1,441 @@
+#include "mai.h"
+
+/* ######################################################################## */
+#define REPLAY_QUEUE	256				// packets held back for jitter/reorder
+#define REPLAY_MTU	9216				// largest packet replayed
+#define REPLAY_SYNC_NS	125000000			// generator: ptp sync interval
+#define REPLAY_LEVEL	0.1				// generator: 1kHz sine at -20dBFS
+
+struct pending {
+	uint64_t	 due;				// delivery time (virtual ns)
+	struct in_addr	 dst;				// destination address
+	uint16_t	 port;				// destination port
+	uint16_t	 len;				// packet length
+	uint8_t		 data[REPLAY_MTU + 1];		// packet (+1: handlers may terminate text)
+};
+
+void			(*mai_replay_done)(void) = NULL;	// finished (NULL: keep running)
+
+static struct pending	 pool[REPLAY_QUEUE];		// pending packet storage
+static struct pending	*pool_free[REPLAY_QUEUE];	// unused entries
+static size_t		 pool_left = 0;
+
+static struct pending	*heap[REPLAY_QUEUE];		// pending packets, earliest due first
+static size_t		 heap_len  = 0;
+
+static struct {
+	double		 loss;				// drop probability
+	double		 dup;				// duplicate probability
+	double		 reorder;			// late delivery probability
+	uint32_t	 depth;				// ... by this many packets
+	uint64_t	 jitter;			// random delay up to (ns)
+	int64_t		 step;				// ptp clock step (ns)
+	uint64_t	 step_at;			// ... from this virtual time (ns)
+} impair = { .depth = 4 };
+
+static struct {
+	size_t		 read;				// packets from source
+	size_t		 lost;				// dropped by impairment
+	size_t		 duplicated;			// duplicated by impairment
+	size_t		 reordered;			// delayed past later packets
+	size_t		 delivered;			// handed to a receive handler
+} count;
+
+static uint64_t		 replay_first = 0;		// virtual time of first packet
+static uint64_t		 replay_wall  = 0;		// wall clock at first packet (monotonic ns)
+static uint64_t		 replay_last  = 0;		// virtual time of previous packet
+static uint64_t		 replay_gap   = 0;		// average packet interval (ns)
+
+static pthread_t	 replay_tid;
+
+/* ######################################################################## */
+static void heap_push(struct pending *p) {
+	size_t lp = heap_len++;
+	
+	for (size_t up; lp && (heap[up = (lp - 1) / 2]->due > p->due); lp = up)
+		heap[lp] = heap[up];
+		
+	heap[lp] = p;
+}
+
+static struct pending *heap_pop(void) {
+	struct pending *top = heap[0], *last = heap[--heap_len];
+	size_t          lp  = 0;
+	
+	for (size_t down; (down = (lp * 2) + 1) < heap_len; lp = down) {
+		if (((down + 1) < heap_len) && (heap[down + 1]->due < heap[down]->due))
+			down += 1;
+			
+		if (heap[down]->due >= last->due)
+			break;
+			
+		heap[lp] = heap[down];
+	}
+	
+	heap[lp] = last;
+	return(top);
+}
+
+/* ######################################################################## */
+static void replay_deliver(struct pending *p) {
+	// real time: wait until the packet is due, relative to the first packet
+	if (!mai.args.asap) {
+		uint64_t        at = replay_wall + (p->due - replay_first);
+		struct timespec ts = { .tv_sec = at / 1000000000, .tv_nsec = at % 1000000000 };
+		
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+	}
+	
+	if (!mai_loop_dispatch(p->dst, p->port, p->data, p->len))
+		count.delivered += 1;
+		
+	pool_free[pool_left++] = p;
+}
+
+static void replay_release(uint64_t now) {
+	// nothing later from the source can be due before its own time
+	while (heap_len && (heap[0]->due <= now))
+		replay_deliver(heap_pop());
+}
+
+static void replay_queue(uint64_t due, struct in_addr dst, uint16_t port, const uint8_t *data, size_t len) {
+	if (!pool_left)
+		replay_deliver(heap_pop());		// full: deliver the earliest now
+		
+	struct pending *p = pool_free[--pool_left];
+	
+	p->due  = due;
+	p->dst  = dst;
+	p->port = port;
+	p->len  = len;
+	memcpy(p->data, data, len);
+	
+	heap_push(p);
+}
+
+/* ######################################################################## */
+static void replay_step(uint8_t *data, size_t len) {
+	// ptp sync (0), follow up (8) or delay response (9): move the 80 bit timestamp
+	if ((len < 44) || (((data[0] & 0x0F) != 0) && ((data[0] & 0x0F) != 8) && ((data[0] & 0x0F) != 9)))
+		return;
+		
+	uint64_t sec = 0;
+	
+	for (size_t lp=34; lp < 40; lp++)
+		sec = (sec << 8) | data[lp];
+		
+	int64_t ns = (int64_t)(sec * 1000000000ULL) + (int64_t)ntohl(*(uint32_t *)&data[40]) + impair.step;
+	
+	sec = ns / 1000000000;
+	
+	for (size_t lp=40; lp-- > 34; sec >>= 8)
+		data[lp] = sec & 0xFF;
+		
+	*(uint32_t *)&data[40] = htonl(ns % 1000000000);
+}
+
+static void replay_packet(uint64_t now, struct in_addr dst, uint16_t port, uint8_t *data, size_t len) {
+	if (len > REPLAY_MTU)
+		return;		// skip: too large
+		
+	if (!count.read++) {
+		replay_first = replay_last = now;
+		replay_wall  = mai_clock_ns(CLOCK_MONOTONIC);
+	}
+	
+	// packet interval, for reorder depth in time
+	replay_gap  += ((int64_t)(now - replay_last) - (int64_t)replay_gap) / 16;
+	replay_last  = now;
+	
+	replay_release(now);
+	
+	if ((impair.loss > 0) && (drand48() < impair.loss)) {
+		count.lost += 1;
+		return;
+	}
+	
+	if (impair.step && (now >= (replay_first + impair.step_at)) && ((port == 319) || (port == 320)))
+		replay_step(data, len);
+		
+	uint64_t due = now + (uint64_t)(drand48() * impair.jitter);
+	
+	if ((impair.reorder > 0) && (drand48() < impair.reorder)) {
+		due += impair.depth * replay_gap;
+		count.reordered += 1;
+	}
+	
+	replay_queue(due, dst, port, data, len);
+	
+	if ((impair.dup > 0) && (drand48() < impair.dup)) {
+		replay_queue(due + 1, dst, port, data, len);
+		count.duplicated += 1;
+	}
+}
+
+/* ######################################################################## */
+static FILE		*pcap_file  = NULL;
+static int		 pcap_swap  = 0;		// file is other endian
+static int		 pcap_nano  = 0;		// timestamps are ns, not us
+static uint32_t		 pcap_link  = 0;		// link layer type
+
+static uint32_t pcap_u32(uint32_t v) {
+	return(pcap_swap ? __builtin_bswap32(v) : v);
+}
+
+static int pcap_open(const char *path) {
+	uint32_t hdr[6];		// magic, version, zone, sigfigs, snaplen, link
+	
+	if ((pcap_file = fopen(path, "rb")) == NULL)
+		return(mai_error("replay file (%s): %m\n", path));
+		
+	if (fread(hdr, sizeof(hdr), 1, pcap_file) != 1)
+		return(mai_error("replay file (%s): short header\n", path));
+		
+	switch (hdr[0]) {
+		case 0xA1B2C3D4: pcap_swap = 0; pcap_nano = 0; break;
+		case 0xD4C3B2A1: pcap_swap = 1; pcap_nano = 0; break;
+		case 0xA1B23C4D: pcap_swap = 0; pcap_nano = 1; break;
+		case 0x4D3CB2A1: pcap_swap = 1; pcap_nano = 1; break;
+		default:
+			return(mai_error("replay file (%s): not a pcap file (pcapng is not supported)\n", path));
+	}
+	
+	pcap_link = pcap_u32(hdr[5]) & 0xFFFF;
+	
+	if ((pcap_link != 1) && (pcap_link != 101) && (pcap_link != 113) && (pcap_link != 228) && (pcap_link != 276))
+		return(mai_error("replay file (%s): unsupported link type %u\n", path, pcap_link));
+		
+	return(mai_debug("Replay: %s (link type %u)\n", path, pcap_link));
+}
+
+static ssize_t pcap_next(uint64_t *now, uint8_t *frame, size_t size) {
+	uint32_t rec[4];		// seconds, fraction, captured, original
+	
+	while (fread(rec, sizeof(rec), 1, pcap_file) == 1) {
+		uint32_t len = pcap_u32(rec[2]);
+		
+		*now = (pcap_u32(rec[0]) * 1000000000ULL) + (pcap_u32(rec[1]) * (pcap_nano ? 1 : 1000));
+		
+		if (len > size) {
+			fseek(pcap_file, len, SEEK_CUR);
+			continue;	// skip: larger than any packet we replay
+		}
+		
+		if (fread(frame, len, 1, pcap_file) == 1)
+			return(len);
+	}
+	return(-1);
+}
+
+static uint8_t *pcap_udp(uint8_t *frame, size_t len, struct in_addr *dst, uint16_t *port, size_t *out) {
+	uint8_t *ip   = frame;
+	uint16_t type = 0x0800;
+	
+	// link layer header to ip header
+	switch (pcap_link) {
+		case 1:				// ethernet, with any vlan tags
+			for (ip = frame + 12; (ip + 2) <= (frame + len); ip += 4) {
+				if (((type = (ip[0] << 8) | ip[1]) != 0x8100) && (type != 0x88A8))
+					break;
+			}
+			ip += 2;
+			break;
+			
+		case 113:			// linux cooked
+			type = (len >= 16) ? ((frame[14] << 8) | frame[15]) : 0;
+			ip   = frame + 16;
+			break;
+			
+		case 276:			// linux cooked v2
+			type = (len >= 20) ? ((frame[0] << 8) | frame[1]) : 0;
+			ip   = frame + 20;
+			break;
+	}
+	
+	uint8_t *end = frame + len;
+	
+	if ((type != 0x0800) || ((ip + 20) > end) || ((ip[0] >> 4) != 4) || (ip[9] != IPPROTO_UDP))
+		return(NULL);		// skip: not udp over ipv4
+		
+	if (((ip[6] << 8) | ip[7]) & 0x3FFF)
+		return(NULL);		// skip: fragment
+		
+	uint8_t *udp = ip + ((ip[0] & 0x0F) * 4);
+	
+	if (((udp + 8) > end) || ((udp + ((udp[4] << 8) | udp[5])) > end))
+		return(NULL);		// skip: truncated
+		
+	memcpy(&dst->s_addr, ip + 16, sizeof(dst->s_addr));
+	
+	*port = (udp[2] << 8) | udp[3];
+	*out  = ((udp[4] << 8) | udp[5]) - 8;
+	
+	return(udp + 8);
+}
+
+static void replay_pcap(void) {
+	uint8_t  frame[REPLAY_MTU + 64];
+	uint64_t now;
+	
+	for (ssize_t len; (len = pcap_next(&now, frame, sizeof(frame))) > 0; ) {
+		struct in_addr dst;
+		uint16_t       port;
+		size_t         size;
+		uint8_t       *data = pcap_udp(frame, len, &dst, &port, &size);
+		
+		if (data)
+			replay_packet(now, dst, port, data, size);
+	}
+}
+
+/* ######################################################################## */
+static void replay_generate(uint64_t seconds) {
+	// synthetic stream in the configured format, plus a one step ptp master
+	const uint32_t samples = mai_rtp_samples();
+	const size_t   unit    = mai.args.bits / 8;
+	const size_t   pktlen  = 12 + (samples * mai.args.channels * unit);
+	const double   scale   = REPLAY_LEVEL * (pow(2, mai.args.bits - 1) - 1);
+	
+	uint8_t  rtp[REPLAY_MTU], ptp[44] = { 0 };
+	uint16_t seq  = lrand48();
+	uint32_t ssrc = lrand48();
+	uint64_t tai  = mai_clock_ns(CLOCK_TAI);
+	
+	struct in_addr rtp_dst, ptp_dst;
+	
+	inet_aton(mai.args.addr, &rtp_dst);
+	inet_aton("224.0.1.129", &ptp_dst);
+	
+	if (pktlen > sizeof(rtp))
+		return;
+		
+	// ptp sync: version 2, length 44, domain 0, one step, random clock identity
+	ptp[1] = 2;
+	ptp[3] = sizeof(ptp);
+	
+	for (size_t lp=20; lp < 28; lp++)
+		ptp[lp] = lrand48();
+		
+	rtp[0] = 0b10000000;
+	rtp[1] = 96;
+	*(uint32_t *)&rtp[8] = htonl(ssrc);
+	
+	for (uint64_t n=0, now=0, sync=0; !seconds || (now < (seconds * 1000000000ULL)); n++) {
+		now = (n * samples * 1000000000ULL) / mai.args.rate;
+		
+		for (; sync <= now; sync += REPLAY_SYNC_NS) {
+			uint64_t stamp = tai + sync;
+			
+			*(uint16_t *)&ptp[30] = htons(sync / REPLAY_SYNC_NS);
+			
+			for (size_t lp=40, sec = stamp / 1000000000; lp-- > 34; sec >>= 8)
+				ptp[lp] = sec & 0xFF;
+				
+			*(uint32_t *)&ptp[40] = htonl(stamp % 1000000000);
+			
+			replay_packet(sync, ptp_dst, 319, ptp, sizeof(ptp));
+		}
+		
+		*(uint16_t *)&rtp[2] = htons(seq++);
+		*(uint32_t *)&rtp[4] = htonl(n * samples);
+		
+		uint8_t *out = rtp + 12;
+		
+		for (uint64_t s = n * samples; s < ((n + 1) * samples); s++) {
+			int32_t v = lrint(sin((2 * M_PI * 1000 * s) / mai.args.rate) * scale);
+			
+			for (uint32_t ch=0; ch < mai.args.channels; ch++) {
+				for (size_t b=unit; b--; )
+					*out++ = (v >> (b * 8)) & 0xFF;
+			}
+		}
+		
+		replay_packet(now, rtp_dst, mai.args.port, rtp, pktlen);
+	}
+}
+
+/* ######################################################################## */
+static void *replay_thread(void *arg) {
+	const char *spec = mai.args.replay;
+	
+	if (!strncmp(spec, "gen", 3))
+		replay_generate((spec[3] == ':') ? strtoull(spec + 4, NULL, 10) : 0);
+	else
+		replay_pcap();
+		
+	replay_release(UINT64_MAX);
+	
+	mai_info("Replay done: %zu read, %zu lost, %zu duplicated, %zu reordered, %zu delivered.\n",
+		count.read, count.lost, count.duplicated, count.reordered, count.delivered);
+		
+	// finished: the mai binary stops like on a signal, an embedding engine keeps its process
+	if (mai_replay_done)
+		mai_replay_done();
+		
+	return(arg);
+}
+
+/* ######################################################################## */
+int mai_replay_impair(const char *spec) {
+	// loss=<%>,dup=<%>,reorder=<%>,depth=<packets>,jitter=<us>,step=<ns>,at=<s>; NULL: none
+	if (!spec) {
+		memset(&impair, 0, sizeof(impair));
+		impair.depth = 4;
+		return(0);
+	}
+	
+	char *copy = strdupa(spec), *save = NULL;
+	
+	for (char *key = strtok_r(copy, ",", &save); key; key = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(key, '=');
+		
+		if (!val)
+			return(-1);
+			
+		*val++ = 0;
+		
+		     if (!strcmp(key, "loss"))    impair.loss    = atof(val) / 100;
+		else if (!strcmp(key, "dup"))     impair.dup     = atof(val) / 100;
+		else if (!strcmp(key, "reorder")) impair.reorder = atof(val) / 100;
+		else if (!strcmp(key, "depth"))   impair.depth   = atoi(val);
+		else if (!strcmp(key, "jitter"))  impair.jitter  = atof(val) * 1000;
+		else if (!strcmp(key, "step"))    impair.step    = atoll(val);
+		else if (!strcmp(key, "at"))      impair.step_at = atof(val) * 1000000000;
+		else return(-1);
+	}
+	return(0);
+}
+
+int mai_replay_start(void) {
+	if (!mai.args.replay)
+		return(0);
+		
+	if (strncmp(mai.args.replay, "gen", 3) && pcap_open(mai.args.replay))
+		return(-1);
+		
+	// nothing pending, the clocks start with the first packet
+	memset(&count, 0, sizeof(count));
+	
+	pool_left = heap_len = 0;
+	replay_first = replay_wall = replay_last = replay_gap = 0;
+	
+	for (size_t lp=0; lp < REPLAY_QUEUE; lp++)
+		pool_free[pool_left++] = &pool[lp];
+		
+	return(mai_thread_create(&replay_tid, "replay", replay_thread, NULL));
+}
+
+int mai_replay_stop(void) {
+	if (!mai.args.replay)
+		return(0);
+		
+	mai_thread_stop(&replay_tid);
+	
+	if (pcap_file)
+		fclose(pcap_file);
+		
+	pcap_file = NULL;
+	return(0);
+}
+
+/* ######################################################################## */
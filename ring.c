@@ -0,0 +1,153 @@
+#include "mai.h"
+#include <poll.h>
+#include <sys/mman.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+/* ######################################################################## */
+#define RING_BLOCK_SIZE	(1 << 16)			// bytes per ring block
+#define RING_BLOCK_NR	64				// blocks in ring
+#define RING_FRAME_SIZE	2048				// bytes per frame (hint for v3)
+#define RING_RETIRE_MS	1				// partially filled block timeout
+
+static int				 ring_sock = -1;	// packet socket
+static uint8_t				*ring_map  = NULL;	// mapped ring blocks
+static size_t				 ring_block = 0;	// current block index
+
+static struct tpacket_block_desc	*ring_desc = NULL;	// current block (owned by us)
+static struct tpacket3_hdr		*ring_hdr  = NULL;	// next packet in current block
+static uint32_t				 ring_left = 0;		// packets left in current block
+
+/* ######################################################################## */
+static int ring_filter(int sk, const struct in_addr *group, uint16_t port) {
+	// accept only udp to our group and port, the kernel drops everything else
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, 9),			// ip protocol
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   IPPROTO_UDP, 0, 8),
+		BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, 16),			// ip destination
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   ntohl(group->s_addr), 0, 6),
+		BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, 6),			// ip fragment offset
+		BPF_JUMP(BPF_JMP | BPF_JSET| BPF_K,   0x1FFF, 4, 0),
+		BPF_STMT(BPF_LDX | BPF_B   | BPF_MSH, 0),			// ip header length
+		BPF_STMT(BPF_LD  | BPF_H   | BPF_IND, 2),			// udp destination port
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   port, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K,             0xFFFF),
+		BPF_STMT(BPF_RET | BPF_K,             0),
+	};
+	struct sock_fprog prog = (struct sock_fprog){ .len = sizeof(code) / sizeof(code[0]), .filter = code };
+	
+	return(setsockopt(sk, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)));
+}
+
+/* ######################################################################## */
+int mai_ring_open(const char *ip, uint16_t port) {
+	struct in_addr group;
+	
+	if (!inet_aton(ip, &group))
+		return(mai_error("multicast address (%s): %m\n", ip));
+		
+	// packet socket delivering from the ip header on
+	if ((ring_sock = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP))) < 0)
+		return(mai_error("socket: %m\n"));
+		
+	if (ring_filter(ring_sock, &group, port))
+		return(mai_error("attach filter: %m\n"));
+		
+	// setup and map a TPACKET_V3 ring
+	int version = TPACKET_V3;
+	
+	if (setsockopt(ring_sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)))
+		return(mai_error("packet version: %m\n"));
+		
+	struct tpacket_req3 req = (struct tpacket_req3){
+		.tp_block_size = RING_BLOCK_SIZE, .tp_block_nr      = RING_BLOCK_NR,
+		.tp_frame_size = RING_FRAME_SIZE, .tp_frame_nr      = (RING_BLOCK_SIZE / RING_FRAME_SIZE) * RING_BLOCK_NR,
+		.tp_retire_blk_tov = RING_RETIRE_MS
+	};
+	
+	if (setsockopt(ring_sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)))
+		return(mai_error("packet rx ring: %m\n"));
+		
+	if ((ring_map = mmap(NULL, RING_BLOCK_SIZE * RING_BLOCK_NR, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_LOCKED, ring_sock, 0)) == MAP_FAILED)
+		return(mai_error("mmap ring: %m\n"));
+		
+	// bind to the multicast interface, or all interfaces
+	struct sockaddr_ll addr = (struct sockaddr_ll){ 
+		.sll_family = AF_PACKET, .sll_protocol = htons(ETH_P_IP), .sll_ifindex = mai_sock_if_index() 
+	};
+	
+	if (bind(ring_sock, (struct sockaddr *)&addr, sizeof(addr)))
+		return(mai_error("bind: %m\n"));
+		
+	return(mai_debug("RTP Ring: %d x %dk blocks\n", RING_BLOCK_NR, RING_BLOCK_SIZE / 1024));
+}
+
+void mai_ring_close(void) {
+	// the rtp ring thread has stopped
+	if (ring_map && (ring_map != MAP_FAILED))
+		munmap(ring_map, RING_BLOCK_SIZE * RING_BLOCK_NR);
+		
+	if (ring_sock >= 0)
+		close(ring_sock);
+		
+	ring_sock  = -1;
+	ring_map   = NULL;
+	ring_block = 0;
+	ring_desc  = NULL;
+	ring_hdr   = NULL;
+	ring_left  = 0;
+}
+
+/* ######################################################################## */
+ssize_t mai_ring_next(uint8_t **data) {
+	while (1) {
+		// next packet in the current block
+		if (ring_left) {
+			struct tpacket3_hdr *hdr = ring_hdr;
+			
+			ring_left -= 1;
+			ring_hdr   = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+			
+			uint8_t *ip  = (uint8_t *)hdr + hdr->tp_net;
+			size_t   ihl = (ip[0] & 0x0F) * 4;
+			
+			if (hdr->tp_snaplen < (ihl + 8))
+				continue;				// skip: truncated
+				
+			uint8_t *udp = ip + ihl;
+			size_t   len = ((udp[4] << 8) | udp[5]) - 8;
+			
+			if (hdr->tp_snaplen < (ihl + 8 + len))
+				continue;				// skip: truncated
+				
+			*data = udp + 8;				// udp payload, in place
+			return(len);
+		}
+		
+		// give the finished block back to the kernel
+		if (ring_desc) {
+			__atomic_store_n(&ring_desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+			
+			ring_desc  = NULL;
+			ring_block = (ring_block + 1) % RING_BLOCK_NR;
+		}
+		
+		// wait for the next block to be retired to us
+		struct tpacket_block_desc *desc = (struct tpacket_block_desc *)(ring_map + (ring_block * RING_BLOCK_SIZE));
+		
+		if (!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+			struct pollfd pfd = (struct pollfd){ .fd = ring_sock, .events = POLLIN | POLLERR };
+			
+			if (poll(&pfd, 1, -1) < 0)
+				return(mai_error("poll: %m\n"));
+				
+			continue;
+		}
+		
+		ring_desc = desc;
+		ring_left = desc->hdr.bh1.num_pkts;
+		ring_hdr  = (struct tpacket3_hdr *)((uint8_t *)desc + desc->hdr.bh1.offset_to_first_pkt);
+	}
+}
+
+/* ######################################################################## */
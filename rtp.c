@@ -1,4 +1,5 @@
 #include "mai.h"
+#include <netinet/udp.h>
 
 /* ######################################################################## */
 // rtp packet structure
@@ -14,104 +15,172 @@ struct packet {
 } __attribute__((__packed__));
 
 /* ######################################################################## */
-#define ROB_LEN 6					// reorder up to ROB_LEN packet
+#define ROB_LEN 6					// default reorder window (packets)
+#define ROB_PAYLOAD 8192				// largest payload a reorder slot holds
+#define RTP_SLEW 1000					// fast start: slew 1 sample per RTP_SLEW samples
+#define RTP_BATCH 64					// most packets per send call (and GSO segments)
 
-static int 			 rtp_sock = -1;		// rtp in/out socket
-static uint16_t	 		 rtp_next =  0;		// next expected sequence number
-static size_t			 rtp_used =  0;		// number of reorder entries used
+static int 			 rtp_sock = -1;		// rtp out socket
+static int			 rtp_first = 1;		// waiting for first packet
 
 static uint64_t			 rtp_clock = 0;		// rtp sample clock
+static int64_t			 rtp_slew  = 0;		// rtp clock error left to slew
 static uint32_t			 rtp_samples;		// samples per packet
 
-struct {
-	uint16_t         len;
-	uint16_t         seq;
-	char             payload[8192];
-} rob[ROB_LEN];
+static uint32_t			 rtp_window = 0;	// send window (us), 0: a send per packet
+static int			 rtp_gso    = 0;	// batch as one UDP GSO datagram
+static size_t			 rtp_batch  = 1;	// packets per send call
+
+static struct sockaddr_in	 rtp_dest[MAI_DEST_MAX];	// unicast copies of every packet
+static size_t			 rtp_dests = 0;
+
+static size_t			 rob_window = ROB_LEN;	// packets to wait for a missing one
+static size_t			 rob_slots;		// window and fec history, a power of 2
+static size_t			 rob_history = 0;	// fec: played packets stay in their slots
+
+struct stream {
+	size_t			 idx;			// stream number (audio buffer)
+	int			 sock;			// receive socket (-1: free slot)
+	int			 on;			// packets go to the audio buffer
+	uint16_t		 next;			// next expected sequence number
+	size_t			 used;			// number of reorder entries used
+	uint64_t		 last;			// last packet arrival (monotonic ns)
+	uint8_t			*rob;			// rob_slots reorder slots, by sequence
+};
+
+static struct stream		 rtp_stream[MAI_STREAM_MAX] = { [0 ... MAI_STREAM_MAX-1] = { .sock = -1 } };	// received streams
 
 /* ######################################################################## */
-static void rob_scan(void) {
-	for (size_t idx, lp=0; rtp_used && (lp < ROB_LEN); lp++) {
-		idx = rtp_next % ROB_LEN;				// get buffer index from sequence
+static struct mai_rtp_slot *rob_slot(void *arg, uint16_t seq) {
+	struct stream *st = arg;
+	return((struct mai_rtp_slot *)(st->rob + ((seq & (rob_slots - 1)) * (sizeof(struct mai_rtp_slot) + ROB_PAYLOAD))));
+}
 
-		if (rob[idx].seq != rtp_next)				// stop scan: entry does not match
+static void rob_put(struct stream *st, uint16_t seq, uint32_t time, const char *data, size_t len) {
+	struct mai_rtp_slot *slot = rob_slot(st, seq);
+	
+	slot->seq  = seq;
+	slot->len  = len;
+	slot->time = time;
+	memcpy(slot->payload, data, len);
+}
+
+static void rob_scan(struct stream *st) {
+	for (size_t lp=0; st->used && (lp < rob_window); lp++) {
+		struct mai_rtp_slot *slot = rob_slot(st, st->next);	// get slot from sequence
+		
+		if (!slot->len || (slot->seq != st->next))		// stop scan: entry does not match
 			return;
 			
-		mai_audio_write_int(rob[idx].payload, rob[idx].len);	// send entry to jack
-		rtp_next += 1;						// check next sequence
-		rtp_used -= 1;						// release current entry
+		mai_audio_write_int(st->idx, slot->payload, slot->len, slot->time);	// send entry to jack
+		st->next += 1;						// check next sequence
+		st->used -= 1;						// release current entry
+		
+		if (!rob_history)					// free it, or keep it for repairs
+			slot->len = 0;
 	}
 }
 
 /* ######################################################################## */
-static void *rtp_recv(void *arg) {
-	uint8_t		 buffer[8192];				// packet data buffer
+static void rtp_packet(uint8_t *buffer, ssize_t len, void *arg) {
+	struct stream	*st     = arg;				// stream this socket receives
 	struct packet	*packet = (struct packet *)buffer;	// packet structure overlay
 	char		*data;					// variable pointer (to skip extensions)
-	ssize_t		 len;					// variable data length
 	
-	// loop on ringbuffer and send samples
-	while (1) {
-		if ((len = recv(rtp_sock, buffer, sizeof(buffer), 0)) <= 0)
-			mai_error("packet recv: %m\n");				// skip: receive error
-			
-		if ((len -= sizeof(*packet)) <= 0)
-			continue;						// skip: no payload
-			
-		if ((packet->vpxcc & 0b11000000) != 0b10000000)
-			continue;						// skip: bad version
-			
-		data = packet->payload;						// copy payload start
-		data += (packet->vpxcc & 0b00001111) * sizeof(uint32_t);	// skip any CSRC's
+	if (!__atomic_load_n(&st->on, __ATOMIC_ACQUIRE))
+		return;							// skip: stream being removed
+		
+	if ((len -= sizeof(*packet)) <= 0)
+		return;							// skip: no payload
+		
+	if ((packet->vpxcc & 0b11000000) != 0b10000000)
+		return;							// skip: bad version
+		
+	data = packet->payload;						// copy payload start
+	data += (packet->vpxcc & 0b00001111) * sizeof(uint32_t);	// skip any CSRC's
 
-		if (packet->vpxcc & 0b00010000)					// extension header?
-			data += (1 + ntohs(*((uint16_t *)(data + 2)))) * sizeof(uint32_t);
-			
-		if ((len -= (data - packet->payload)) < 0)		// skip if no data
-			continue;
-			
-		MAI_STAT_INC(rtp.packets);
-			
-		uint16_t seq      = ntohs(packet->seq);			// get packet sequence number
-		 int16_t seq_dist = seq - rtp_next;			// distance from expected sequence
-		uint16_t seq_abs  = abs(seq_dist);			// absolute distance
+	if (packet->vpxcc & 0b00010000)					// extension header?
+		data += (1 + ntohs(*((uint16_t *)(data + 2)))) * sizeof(uint32_t);
 		
-		if (seq_abs > (ROB_LEN * 2)) {				// distance too far out
-			seq_abs  = 0;					// resynchronize sequence
-			rtp_used = 0;					// and drop any reorder entries
-		} else if (seq_dist < 0) {
-			continue;					// skip: sequence in recent past
-		}
+	if (((len -= (data - packet->payload)) < 0) || (len > ROB_PAYLOAD))
+		return;						// skip: no data, or larger than a slot
 		
-		if (seq_abs == 0) {					// this is the correct sequence number
-			mai_audio_write_int(data, len);			// send this packet to jack
-			rtp_next = seq + 1;				// set next sequence number from this packet
-			
-			rob_scan();					// scan buffer to see if we have next packet already
-			continue;					// ready for next packet 
-		}
+	MAI_STAT_INC(rtp.packets);
+	
+	uint64_t now = mai_clock_ns(CLOCK_MONOTONIC);		// packet arrival
+	
+	if (rtp_first) {					// first packet: time to first audio
+		MAI_STAT_ADD(rtp.first, MAI_ELAPSED_US());
+		rtp_first = 0;
+	} else if (st->last) {
+		MAI_HIST_ADD(hist.gap, (now - st->last) / 1000);
+	}
+	st->last = now;
 		
-		if (seq_abs > ROB_LEN) {				// this sequence is outside of buffer range
-			MAI_STAT_INC(rtp.skipped);
-			
-			rtp_next += 1;					// skip past current next sequence number
-			rob_scan();					// scan buffer to see if we have expected packet now
+	// repairs received since the last packet may rebuild packets still missing
+	if (rob_history && (st->used += mai_fec_recover(st->idx, st->next, 0, rob_slot, st)))
+		rob_scan(st);
+		
+	uint16_t seq      = ntohs(packet->seq);			// get packet sequence number
+	uint32_t time     = ntohl(packet->time);		// get packet rtp time
+	 int16_t seq_dist = seq - st->next;			// distance from expected sequence
+	uint16_t seq_abs  = abs(seq_dist);			// absolute distance
+	
+	if (seq_abs > (rob_window * 2)) {			// distance too far out
+		st->next = seq;					// resynchronize sequence
+		st->used = 0;					// and drop any reorder entries
+		
+		mai_fec_reset(st->idx);				// repairs are for the old sequence
+	} else if (seq_dist < 0) {
+		return;						// skip: sequence in recent past
+	}
+	
+	// outside the window: rebuild the missing packets from repairs, or stop waiting
+	while ((int16_t)(seq - st->next) > (int)rob_window) {
+		struct mai_rtp_slot *slot = rob_slot(st, st->next);
+		
+		if (rob_history)
+			st->used += mai_fec_recover(st->idx, st->next, 1, rob_slot, st);
 			
-			if (seq == rtp_next) {				// if current packet is now ready:
-				mai_audio_write_int(data, len);		// send this packet to jack
-				rtp_next = seq + 1;			// set next sequence from this packet
-				continue;				// ready for next packet
-			}
+		if (!slot->len || (slot->seq != st->next)) {
+			MAI_STAT_INC(rtp.skipped);
+			st->next += 1;				// skip past current next sequence number
 		}
 		
-		size_t idx = seq % ROB_LEN;				// get reorder index from sequence number
-		rtp_used += 1;						// increment reorder use counter
+		rob_scan(st);					// scan buffer to see if we have expected packet now
+	}
+	
+	if (seq == st->next) {					// this is the correct sequence number
+		if (rob_history)				// keep it for repairs
+			rob_put(st, seq, time, data, len);
+			
+		mai_audio_write_int(st->idx, data, len, time);	// send this packet to jack
+		st->next = seq + 1;				// set next sequence number from this packet
 		
-		rob[idx].seq = seq;
-		rob[idx].len = len;
-		memcpy(rob[idx].payload, data, len);			// put this packet into reorder buffer
+		rob_scan(st);					// scan buffer to see if we have next packet already
+		return;						// ready for next packet 
+	}
+	
+	struct mai_rtp_slot *slot = rob_slot(st, seq);		// get reorder slot from sequence number
+	
+	if (slot->len && (slot->seq == seq))
+		return;						// skip: duplicate, or rebuilt already
 		
-		MAI_STAT_INC(rtp.reordered);
+	st->used += 1;						// increment reorder use counter
+	rob_put(st, seq, time, data, len);			// put this packet into reorder buffer
+	
+	MAI_STAT_INC(rtp.reordered);
+}
+
+/* ######################################################################## */
+static void *rtp_ring(void *arg) {
+	uint8_t		*data;					// packet data, in place in the ring
+	ssize_t		 len;					// packet length
+	
+	// loop on memory mapped ring and send samples, no copy or syscall per packet
+	while (1) {
+		if ((len = mai_ring_next(&data)) > 0)
+			rtp_packet(data, len, &rtp_stream[0]);
 	}
 	
 	mai_debug("Unexpected Thread Exit!\n");
@@ -119,78 +188,411 @@ static void *rtp_recv(void *arg) {
 }
 
 /* ######################################################################## */
+static ssize_t rtp_transmit(uint8_t *packets, size_t pktlen, size_t count) {
+	// datagrams sent: every packet goes to the group, then each unicast destination
+	const size_t targets = 1 + rtp_dests;
+	const size_t total   = count * targets;
+	
+	// one packet, one target: plain send
+	if (total == 1) {
+		MAI_STAT_INC(rtp.calls);
+		return((send(rtp_sock, packets, pktlen, 0) == (ssize_t)pktlen) ? 1 : -1);
+	}
+	
+	// gso: one datagram per target that the kernel cuts into packets
+	if (rtp_gso) {
+		char          ctl[CMSG_SPACE(sizeof(uint16_t))] __attribute__((__aligned__(__alignof__(struct cmsghdr)))) = { 0 };
+		struct iovec  iov = (struct iovec){ .iov_base = packets, .iov_len = count * pktlen };
+		struct msghdr msg = (struct msghdr){ .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = sizeof(ctl) };
+		size_t        sent = 0;
+		
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+		
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type  = UDP_SEGMENT;
+		cm->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+		*(uint16_t *)CMSG_DATA(cm) = pktlen;
+		
+		for (size_t t=0; t < targets; t++) {
+			msg.msg_name    = t ? &rtp_dest[t - 1] : NULL;
+			msg.msg_namelen = t ? sizeof(rtp_dest[0]) : 0;
+			
+			MAI_STAT_INC(rtp.calls);
+			
+			if (sendmsg(rtp_sock, &msg, 0) == (ssize_t)iov.iov_len)
+				sent += count;
+		}
+		return(sent);
+	}
+	
+	// sendmmsg: packet by packet to every target, the payload is shared
+	struct mmsghdr *msg = alloca(total * sizeof(*msg));
+	struct iovec    iov[RTP_BATCH];
+	size_t          sent = 0;
+	
+	for (size_t p=0; p < count; p++) {
+		iov[p] = (struct iovec){ .iov_base = packets + (p * pktlen), .iov_len = pktlen };
+		
+		for (size_t t=0; t < targets; t++) {
+			msg[(p * targets) + t] = (struct mmsghdr){ .msg_hdr = {
+				.msg_name    = t ? &rtp_dest[t - 1] : NULL,
+				.msg_namelen = t ? sizeof(rtp_dest[0]) : 0,
+				.msg_iov     = &iov[p],
+				.msg_iovlen  = 1
+			}};
+		}
+	}
+	
+	// the kernel takes at most IOV_MAX messages per call, and may take fewer
+	while (sent < total) {
+		int done = sendmmsg(rtp_sock, msg + sent, ((total - sent) > IOV_MAX) ? IOV_MAX : (total - sent), 0);
+		
+		MAI_STAT_INC(rtp.calls);
+		
+		if (done <= 0)
+			break;
+			
+		sent += done;
+	}
+	return(sent);
+}
+
 static void *rtp_send(void *arg) {
-	// create an RTP packet and set the static header values
-	const size_t   paylen = rtp_samples * mai.args.channels * (mai.args.bits / 8);
-	const size_t   pktlen = sizeof(struct packet) + paylen;
-        struct packet *packet = alloca(pktlen);
+	// create RTP packets and set the static header values
+	const size_t   paylen  = rtp_samples * mai.args.channels * (mai.args.bits / 8);
+	const size_t   pktlen  = sizeof(struct packet) + paylen;
+	uint8_t       *packets = alloca(pktlen * rtp_batch);
 	
-	packet->vpxcc = 0b10000000;			// Version=2, P=0, X=0, CC=0
-	packet->mpt   = 96;				// M=0, PT=96
-	packet->ssrc  = lrand48();			// Set Random SSRC IV
+	for (size_t p=0; p < rtp_batch; p++) {
+		struct packet *packet = (struct packet *)(packets + (p * pktlen));
+		
+		packet->vpxcc = 0b10000000;			// Version=2, P=0, X=0, CC=0
+		packet->mpt   = 96;				// M=0, PT=96
+	}
 	
-	uint16_t seq  = lrand48() & 0xFFFF;		// Set Random Initial Sequence
+	uint32_t ssrc = lrand48();				// Set Random SSRC IV
+	uint16_t seq  = lrand48() & 0xFFFF;			// Set Random Initial Sequence
 	uint64_t time;
+	uint32_t slew = 0;					// samples since last slew step
 	
-	// loop on ringbuffer and send samples
-	for (struct timespec ts = { .tv_sec = 0, .tv_nsec = mai.args.ptime * 900 }; 1; nanosleep(&ts, NULL)) {
-		mai_audio_read_int(packet->payload, paylen);		// get packet payload
+	// loop on ringbuffer and send samples, napping for most of the packet times sent
+	for (struct timespec ts = { 0 }; 1; nanosleep(&ts, NULL)) {
+		size_t count = 0;
 		
-		time = __sync_fetch_and_add(&rtp_clock, rtp_samples);
+		// the first packet waits for audio, a batch takes what is already due
+		do {
+			struct packet *packet = (struct packet *)(packets + (count * pktlen));
+			
+			mai_audio_read_int(packet->payload, paylen);		// get packet payload
+			
+			int64_t step = 0;
+			
+			if (rtp_slew && ((slew += rtp_samples) >= RTP_SLEW)) {	// slew clock one sample towards master
+				slew -= RTP_SLEW;
+				step  = (rtp_slew < 0) ? -1 : 1;
+				
+				__sync_fetch_and_sub(&rtp_slew, step);
+				MAI_STAT_INC(rtp.slewed);
+			}
+			
+			time = __sync_fetch_and_add(&rtp_clock, rtp_samples - step);
+			
+			packet->ssrc = ssrc;
+			packet->time = htonl(time & 0xFFFFFFFF);
+			packet->seq  = htons(seq++);
+			
+			mai_fec_encode(seq - 1, time, packet->payload, paylen);	// repairs cover this packet
+		} while ((++count < rtp_batch) && mai_audio_ready(paylen));
 		
-		packet->time = htonl(time & 0xFFFFFFFF);
-		packet->seq  = htons(seq++);
+		ssize_t sent = rtp_transmit(packets, pktlen, count);		// send packets to network
 		
-		if (send(rtp_sock, packet, pktlen, 0) <= 0)		// send packet to network
+		if (sent < (ssize_t)(count * (1 + rtp_dests)))
 			mai_error("packet send: %m\n");
-		else
-			MAI_STAT_INC(rtp.packets);
+			
+		if (mai_fec_send(rtp_sock) < 0)				// repairs due after these packets
+			mai_error("fec send: %m\n");
+			
+		if (sent > 0)
+			MAI_STAT_ADD(rtp.packets, sent);
+			
+		if (rtp_first) {					// first packet: time to first audio
+			MAI_STAT_ADD(rtp.first, MAI_ELAPSED_US());
+			rtp_first = 0;
+		}
+		
+		ts.tv_nsec = (count * rtp_samples * 900000000ULL) / mai.args.rate;
 	}
 	
 	mai_debug("Unexpected Thread Exit!\n");
 	return(arg);							// should not reach here
 }
 
+/* ######################################################################## */
+int mai_rtp_batch(const char *spec) {
+	// <us>[,gso]; NULL: a send per packet
+	if (!spec) {
+		rtp_window = rtp_gso = 0;
+		return(0);
+	}
+	
+	char *end;
+	long  us = strtol(spec, &end, 10);
+	
+	if ((us < 1) || (us > 20000) || (*end && strcmp(end, ",gso")))
+		return(-1);
+		
+	rtp_window = us;
+	rtp_gso    = (*end != 0);
+	return(0);
+}
+
 /* ######################################################################## */
 static pthread_t tid;
 
 int mai_rtp_init(void) {
 	// samples/packet
-	rtp_samples = (mai.args.ptime * ((mai.args.rate == 96000) ? 96000 : 48000)) / 1000000;
+	rtp_samples = mai_rtp_samples();
+	rtp_first   = 1;
+	rtp_clock   = 0;
+	rtp_slew    = 0;
+	rtp_batch   = 1;
 	
-	if ((rtp_sock = mai_sock_open(mai.args.mode, mai.args.addr, mai.args.port)) <= 0)
+	if (MAI_SENDER && ((rtp_sock = mai_sock_open(mai.args.mode, mai.args.addr, mai.args.port)) <= 0))
 		return(mai_error("could not open multicast socket\n"));
 		
-	mai_audio_size(rtp_samples * (ROB_LEN+1));
+	// sender fan out: the same encoded packets, addressed per message
+	for (rtp_dests=0; rtp_dests < mai.args.dests; rtp_dests++) {
+		struct sockaddr_in *d = &rtp_dest[rtp_dests];
+		
+		*d = (struct sockaddr_in){ .sin_family = AF_INET, .sin_port = htons(mai.args.dest[rtp_dests].port ? mai.args.dest[rtp_dests].port : mai.args.port) };
+		
+		if (!inet_aton(mai.args.dest[rtp_dests].addr, &d->sin_addr))
+			return(mai_error("dest address (%s): invalid\n", mai.args.dest[rtp_dests].addr));
+			
+		mai_debug("RTP Dest: %s:%d\n", mai.args.dest[rtp_dests].addr, ntohs(d->sin_port));
+	}
+	
+	// receiver: the reorder window, and with fec the packets repairs reach back to
+	rob_window  = mai.args.window ? mai.args.window : ROB_LEN;
+	rob_history = mai_fec_span();
+	
+	for (rob_slots = 1; rob_slots < (rob_window + rob_history + 1); rob_slots <<= 1)
+		;
+		
+	// receiver: one socket and reorder buffer per stream
+	for (size_t s=0; s < MAI_STREAM_MAX; s++) {
+		rtp_stream[s] = (struct stream){ .idx = s, .sock = -1 };
+		
+		if (!MAI_SENDER && ((rtp_stream[s].rob = calloc(rob_slots, sizeof(struct mai_rtp_slot) + ROB_PAYLOAD)) == NULL))
+			return(mai_error("failed to allocate reorder buffers!\n"));
+	}
+	
+	for (size_t s=0; !MAI_SENDER && (s < mai.args.streams); s++) {
+		struct stream *st = &rtp_stream[s];
+		
+		st->on = 1;
+		
+		if ((st->sock = mai_sock_open(mai.args.mode, mai.args.stream[s].addr, mai.args.stream[s].port)) <= 0)
+			return(mai_error("could not open multicast socket\n"));
+			
+		if (!mai.args.ring && mai_sock_tune(st->sock))
+			return(-1);
+			
+		mai_debug("RTP Stream %zu: %s:%d\n", s + 1, mai.args.stream[s].addr, mai.args.stream[s].port);
+	}
+	
+	// ring receive: the socket only keeps the group joined, the ring gets the packets
+	if (!MAI_SENDER && mai.args.ring) {
+		if (mai_ring_open(mai.args.addr, mai.args.port) || mai_sock_mute(rtp_stream[0].sock))
+			return(mai_error("could not open receive ring\n"));
+	}
+	
+	// local receive: the first stream comes from shared memory, its socket keeps the group joined
+	// and takes over without a publisher (mai_rtp_network())
+	if (!MAI_SENDER && mai.args.local && mai_sock_mute(rtp_stream[0].sock))
+		return(mai_error("could not mute the first stream\n"));
+		
+	mai_audio_size(rtp_samples * (rob_window+1));
 	
 	// bytes/packet + rtp(12) + udp(8) + ip overhead(20)
 	size_t rtp_bytes = (rtp_samples * mai.args.channels * (mai.args.bits / 8)) + 40;
 	size_t rtp_mtu   = mai_sock_if_mtu();
 	
 	if (rtp_bytes > rtp_mtu)
-		return(mai_error("packet size (%zu) is larger than interface mtu (%zu).\n", rtp_bytes, rtp_mtu));
+		return(mai_error("packet size (%zu: %u samples at %uHz) is larger than interface mtu (%zu), use a shorter ptime.\n", rtp_bytes, rtp_samples, mai.args.rate, rtp_mtu));
 		
+	// sender batch: whole packet times within the window, a GSO datagram stays below 64k
+	if (MAI_SENDER && rtp_window) {
+		size_t fit = rtp_gso ? (65507 / (rtp_bytes - 28)) : RTP_BATCH;
+		
+		rtp_batch = ((uint64_t)rtp_window * mai.args.rate) / (1000000ULL * rtp_samples);
+		rtp_batch = (rtp_batch < 1) ? 1 : (rtp_batch > RTP_BATCH) ? RTP_BATCH : rtp_batch;
+		rtp_batch = (rtp_batch > fit) ? fit : rtp_batch;
+		
+		mai_audio_size(rtp_samples * rtp_batch);
+		mai_debug("RTP Batch: up to %zu packets per %s\n", rtp_batch, rtp_gso ? "GSO datagram" : "sendmmsg");
+	}
+	
 	return(mai_debug("RTP %s: %s:%d\n", (MAI_SENDER ? "Sender" : "Receiver"), mai.args.addr, mai.args.port));
 }
 
 int mai_rtp_start(void) {
-	if (pthread_create(&tid, NULL, (MAI_SENDER ? rtp_send : rtp_recv), NULL))
-		return(mai_error("could not start rtp thread: %m\n"));
+	// fast start: free-run from the local clock until PTP has locked
+	if (mai.args.fast)
+		rtp_clock = mai_ptp_time();
 		
-	return(0);
+	// socket receive runs in the event loop
+	for (size_t s=!!mai.args.local; !MAI_SENDER && !mai.args.ring && (s < mai.args.streams); s++) {
+		if (mai_loop_add("rtp", rtp_stream[s].sock, rtp_packet, &rtp_stream[s]))
+			return(-1);
+	}
+	
+	// repairs come on their own sockets, ring receive included, local receive not
+	for (size_t s=!!mai.args.local; !MAI_SENDER && (s < mai.args.streams); s++) {
+		if (mai_fec_open(s, mai.args.stream[s].addr, mai.args.stream[s].port, rtp_stream[s].sock))
+			return(-1);
+	}
+	
+	if (!MAI_SENDER && !mai.args.ring)
+		return(0);
+		
+	return(mai_thread_create(&tid, "rtp", (MAI_SENDER ? rtp_send : rtp_ring), NULL));
 }
 
 int mai_rtp_stop(void) {
-	pthread_cancel(tid);
+	// after the event loop: nothing receives on the sockets any more
+	mai_thread_stop(&tid);
+	
+	if (mai.args.ring)
+		mai_ring_close();
+		
+	for (size_t s=0; s < MAI_STREAM_MAX; s++) {
+		mai_fec_close(s);
+		
+		if (rtp_stream[s].sock >= 0)
+			close(rtp_stream[s].sock);
+			
+		free(rtp_stream[s].rob);
+		rtp_stream[s] = (struct stream){ .idx = s, .sock = -1 };
+	}
+	
+	if (rtp_sock >= 0)
+		close(rtp_sock);
+		
+	rtp_sock = -1;
 	return(0);
 }
 
 /* ######################################################################## */
+int mai_rtp_stream_add(const char *addr, uint16_t port) {
+	// control: a new receive socket, audio starts at the next period
+	size_t s = 0;
+	
+	while ((s < MAI_STREAM_MAX) && (rtp_stream[s].sock >= 0))
+		s++;
+		
+	if (MAI_SENDER || mai.args.ring || (s >= MAI_STREAM_MAX))
+		return(-1);
+		
+	struct stream *st = &rtp_stream[s];
+	
+	// the recording needs the address for its header, and its ring before the first packet
+	mai.args.stream[s].addr = strdup(addr);
+	mai.args.stream[s].port = port;
+	
+	if (mai_record_track(s))
+		return(-1);
+		
+	if ((st->sock = mai_sock_open(mai.args.mode, addr, port)) <= 0) {
+		st->sock = -1;
+		return(-1);
+	}
+	
+	if (mai_sock_tune(st->sock) || mai_loop_add("rtp", st->sock, rtp_packet, st)) {
+		close(st->sock);
+		st->sock = -1;
+		return(-1);
+	}
+	
+	if (mai_fec_open(s, addr, port, st->sock)) {
+		mai_fec_close(s);
+		mai_loop_del(st->sock);
+		st->sock = -1;
+		return(-1);
+	}
+	
+	if (mai.args.streams <= s)
+		mai.args.streams = s + 1;
+		
+	st->used = 0;
+	st->last = 0;
+	
+	__atomic_store_n(&st->on, 1, __ATOMIC_RELEASE);
+	mai_audio_stream(s, 1);
+	
+	mai_info("RTP Stream %zu: %s:%d added\n", s + 1, addr, port);
+	return(s);
+}
+
+uint32_t mai_rtp_streams(void) {
+	uint32_t on = 0;
+	
+	for (size_t s=0; s < MAI_STREAM_MAX; s++)
+		on |= (rtp_stream[s].sock >= 0) << s;
+		
+	return(on);
+}
+
+int mai_rtp_stream_del(size_t s) {
+	struct stream *st = &rtp_stream[s];
+	
+	if (MAI_SENDER || mai.args.ring || (s >= MAI_STREAM_MAX) || (st->sock < 0) || (mai.args.local && !s))
+		return(-1);
+		
+	// audio stops first, then the receive side and its socket
+	mai_audio_stream(s, 0);
+	__atomic_store_n(&st->on, 0, __ATOMIC_RELEASE);
+	
+	mai_loop_del(st->sock);
+	mai_fec_close(s);
+	st->sock = -1;
+	
+	mai_info("RTP Stream %zu: %s:%d removed\n", s + 1, mai.args.stream[s].addr, mai.args.stream[s].port);
+	return(0);
+}
+
+int mai_rtp_network(void) {
+	// local receive gave up: the first stream from its socket after all
+	struct stream *st = &rtp_stream[0];
+	
+	if (mai_sock_unmute(st->sock) || mai_loop_add("rtp", st->sock, rtp_packet, st) || mai_fec_open(0, mai.args.stream[0].addr, mai.args.stream[0].port, st->sock))
+		return(mai_error("could not receive the first stream\n"));
+		
+	return(mai_info("RTP Stream 1: %s:%d from the network\n", mai.args.stream[0].addr, mai.args.stream[0].port));
+}
+
+/* ######################################################################## */
+uint32_t mai_rtp_samples(void) {
+	// AES67 packet times are sample counts of the 48k family (6, 12, 16, 48, 192),
+	// the 44.1k family uses the same counts: 1ms is 48 samples, ptime 1.09ms
+	uint32_t base = (mai.args.rate % 11025) ? 48000 : 44100;
+	uint32_t mult = (mai.args.rate + (base / 2)) / base;
+	
+	return(lround((mai.args.ptime * 48000.0) / 1000000) * mult);
+}
+
 uint64_t mai_rtp_clock(void) {
 	return(rtp_clock);
 }
 
 void mai_rtp_offset(int64_t offset) {
+	// fast start: the clock is already running, so slew onto the master,
+	// unless the local clock was too far off (> 1s) to ever catch up
+	if (mai.args.fast && (llabs(offset) < (int64_t)mai_ptp_rate(0))) {
+		__sync_lock_test_and_set(&rtp_slew, offset);
+		return;
+	}
+	
 	// if we're within -2 .. +2 packets of master clock
 	if ((offset >= -((int64_t)(rtp_samples*2))) && (offset <= (rtp_samples*2)))
 		return;
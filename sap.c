@@ -18,6 +18,8 @@ static int	sap_active =  1;
 static uint32_t sap_source =  0;
 static char     sap_addr[INET_ADDRSTRLEN];
 
+static int	lst_sock   = -1;
+
 /* ######################################################################## */
 void *sap(void *arg) {
 	// create packet buffer and header object
@@ -35,16 +37,17 @@ void *sap(void *arg) {
 	
 	// start adding sdp lines to the packet
 	char *payload = packet->payload;
-	char *ptime = NULL;
-	
-	switch (mai.args.ptime) {
-		case 4000: ptime = (mai.args.rate == 44100) ? "4.35" : "4"; 	break;
-		case 1000: ptime = (mai.args.rate == 44100) ? "1.09" : "1"; 	break;
-		case  333: ptime = (mai.args.rate == 44100) ? "0.36" : "0.33"; 	break;
-		case  250: ptime = (mai.args.rate == 44100) ? "0.27" : "0.25"; 	break;
-		case  125: ptime = (mai.args.rate == 44100) ? "0.13" : "0.12"; 	break;
-	}
+	char  ptime[16];
 	
+	// packet time from the actual packet size: "1", "1.09", "0.33", ...
+	int len = snprintf(ptime, sizeof(ptime), "%.2f", (mai_rtp_samples() * 1000.0) / mai.args.rate);
+	
+	while (ptime[len - 1] == '0')
+		ptime[--len] = 0;
+		
+	if (ptime[len - 1] == '.')
+		ptime[--len] = 0;
+		
 	payload += sprintf(payload, "v=0\r\n");
 	payload += sprintf(payload, "o=- %ld %ld IN IP4 %s\r\n", time(NULL), time(NULL), sap_addr);
 	payload += sprintf(payload, "s=%s\r\n", mai.args.session);
@@ -55,8 +58,7 @@ void *sap(void *arg) {
 	payload += sprintf(payload, "a=rtpmap:96 L%d/%d/%d\r\n", mai.args.bits, mai.args.rate, mai.args.channels);
 	payload += sprintf(payload, "a=recvonly\r\n");
 	
-	if (ptime)
-		payload += sprintf(payload, "a=ptime:%s\r\n", ptime);
+	payload += sprintf(payload, "a=ptime:%s\r\n", ptime);
 	
 	payload += sprintf(payload, "a=ts-refclk:ptp=IEEE1588-2008:%s\r\n", mai_ptp_source());
 	payload += sprintf(payload, "a=mediaclk:direct=0\r\n");
@@ -83,6 +85,59 @@ void *sap(void *arg) {
 	return(arg);
 }
 
+/* ######################################################################## */
+static void sap_packet(uint8_t *data, ssize_t len) {
+	struct packet *packet = (struct packet *)data;
+	
+	if ((len <= 8) || ((packet->vartec & 0b11100000) != 0b00100000))
+		return;		// skip: SAP VERSION != 1
+		
+	if (packet->vartec & 0b00010011)
+		return;		// skip: IPv6 origin, encrypted or compressed
+		
+	MAI_STAT_INC(sap.received);
+	
+	if (packet->vartec & 0b00000100) {
+		mai_sdp_delete(packet->source, packet->hash);
+		return;		// done: session deleted
+	}
+	
+	if (!mai_sdp_refresh(packet->source, packet->hash))
+		return;		// done: repeated announcement
+		
+	// payload follows header and authentication data, then optional mime type
+	char *payload = (char *)data + 8 + (packet->authlen * sizeof(uint32_t));
+	char *end     = (char *)data + len;
+	
+	if ((payload < end) && strncmp(payload, "v=0", 3))
+		payload += strnlen(payload, end - payload) + 1;
+		
+	struct mai_sdp sdp;
+	
+	if ((payload >= end) || mai_sdp_parse(payload, end - payload, &sdp))
+		return;		// skip: not a session we can receive
+		
+	sdp.source = packet->source;
+	sdp.hash   = packet->hash;
+	
+	if (!mai_sdp_update(&sdp))
+		mai_debug("Session: '%s' %s:%u L%u/%u/%u\n", sdp.name, sdp.addr, sdp.port, sdp.bits, sdp.rate, sdp.channels);
+		
+	MAI_STAT_INC(sap.parsed);
+}
+
+/* ######################################################################## */
+static void sap_listen(uint8_t *data, ssize_t len, void *arg __attribute__((__unused__))) {
+	static time_t expired = 0;
+	
+	sap_packet(data, len);
+	
+	if (time(NULL) != expired) {		// expire old sessions once a second
+		expired = time(NULL);
+		mai_sdp_expire();
+	}
+}
+
 /* ######################################################################## */
 static pthread_t tid;
 
@@ -103,17 +158,79 @@ int mai_sap_init() {
 /* ######################################################################## */
 int mai_sap_start() {
 	// start sap broadcaster
-	if (pthread_create(&tid, NULL, sap, NULL))
-		return(mai_error("could not start sap thread: %m\n"));
-		
-	return(0);
+	return(mai_thread_create(&tid, "sap", sap, NULL));
 }
 
 int mai_sap_stop() {
-	sap_active = 0;				// request broadcast thread to stop
-	pthread_join(tid, NULL);		// then wait for it to terminate
+	// the listener stopped with the event loop
+	if (tid) {
+		sap_active = 0;			// request broadcast thread to stop
+		pthread_join(tid, NULL);	// then wait for it to terminate
+	}
 	
+	if (sap_sock >= 0)
+		close(sap_sock);
+		
+	if (lst_sock >= 0)
+		close(lst_sock);
+		
+	tid        = 0;
+	sap_sock   = lst_sock = -1;
+	sap_active = 1;
 	return(0);
 }
 
 /* ######################################################################## */
+int mai_sap_listen() {
+	mai_sdp_init();
+	
+	// open SAP listener socket and keep the session directory
+	if ((lst_sock = mai_sock_open('r', "239.255.255.255", 9875)) < 0)
+		return(mai_error("could not open SAP multicast socket\n"));
+		
+	if (mai_loop_add("sap", lst_sock, sap_listen, NULL))
+		return(mai_error("could not start sap receive\n"));
+		
+	if (!mai.args.discover)
+		return(mai_debug("SAP Listener: 239.255.255.255:9875\n"));
+		
+	// wait for the session we subscribe to, io_uring delivers the announcements from its thread
+	struct mai_sdp sdp;
+	
+	if (mai_loop_start())
+		return(mai_error("could not start sap receive\n"));
+		
+	for (int count=1; mai_sdp_find(mai.args.session, &sdp); count++) {
+		if (!(count % 50))
+			mai_info("Waiting for session '%s'.\n", mai.args.session);
+			
+		if (count > 600)
+			return(mai_error("Timeout.\n"));
+			
+		usleep(100000);
+	}
+	
+	if ((sdp.bits != 16) && (sdp.bits != 24) && (sdp.bits != 32))
+		return(mai_error("session '%s': unsupported bits (%u)\n", sdp.name, sdp.bits));
+		
+	if (mai_args_rate(sdp.rate))
+		return(mai_error("session '%s': unsupported rate (%u)\n", sdp.name, sdp.rate));
+		
+	if ((sdp.channels < 1) || (sdp.channels > 8))
+		return(mai_error("session '%s': unsupported channels (%u)\n", sdp.name, sdp.channels));
+		
+	// configure receiver from session
+	mai.args.addr     = strdup(sdp.addr);
+	mai.args.port     = sdp.port;
+	mai.args.stream[0].addr = mai.args.addr;
+	mai.args.stream[0].port = mai.args.port;
+	mai.args.streams  = 1;
+	mai.args.bits     = sdp.bits;
+	mai.args.rate     = sdp.rate;
+	mai.args.channels = sdp.channels;
+	mai.args.ptime    = sdp.ptime;
+	
+	return(mai_info("Subscribed: '%s' %s:%u L%u/%u/%u (%uus)\n", sdp.name, sdp.addr, sdp.port, sdp.bits, sdp.rate, sdp.channels, sdp.ptime));
+}
+
+/* ######################################################################## */
@@ -0,0 +1,288 @@
+#include "mai.h"
+
+/* ######################################################################## */
+#define SDP_MAX		1024				// sessions in directory
+#define SDP_BUCKETS	(SDP_MAX * 2)			// hash buckets per index
+#define SDP_EXPIRE	3600				// seconds before unrefreshed sessions expire
+
+enum { IDX_NAME, IDX_ADDR, IDX_SOURCE, IDX_MAX };	// directory indexes
+
+struct entry {
+	struct mai_sdp	sdp;				// session description
+	time_t		seen;				// last announcement
+	int16_t		next[IDX_MAX];			// hash chain per index (-1: end)
+	uint32_t	key[IDX_MAX];			// hash value per index
+};
+
+static struct entry		 dir[SDP_MAX];			// session entries
+static int16_t			 dir_head[IDX_MAX][SDP_BUCKETS];	// hash chain heads (-1: empty)
+static int16_t			 dir_free = -1;			// free entry list (via next[IDX_NAME])
+static size_t			 dir_used =  0;			// entries in use
+
+static pthread_mutex_t		 dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ######################################################################## */
+static uint32_t sdp_hash(const void *data, size_t len) {
+	// fnv-1a
+	const uint8_t *in = data;
+	uint32_t       h  = 2166136261u;
+	
+	while (len--)
+		h = (h ^ *in++) * 16777619u;
+		
+	return(h);
+}
+
+static uint32_t sdp_key(const struct mai_sdp *sdp, int idx) {
+	if (idx == IDX_NAME)
+		return(sdp_hash(sdp->name, strlen(sdp->name)));
+		
+	if (idx == IDX_ADDR)
+		return(sdp_hash(sdp->addr, strlen(sdp->addr)) ^ sdp->port);
+		
+	return(sdp_hash(&sdp->source, sizeof(sdp->source)) ^ sdp->hash);
+}
+
+static int sdp_match(const struct mai_sdp *a, const struct mai_sdp *b, int idx) {
+	if (idx == IDX_NAME)
+		return(!strcmp(a->name, b->name));
+		
+	if (idx == IDX_ADDR)
+		return(!strcmp(a->addr, b->addr) && (a->port == b->port));
+		
+	return((a->source == b->source) && (a->hash == b->hash));
+}
+
+/* ######################################################################## */
+static int sdp_lookup(const struct mai_sdp *sdp, int idx) {
+	uint32_t key = sdp_key(sdp, idx);
+	
+	for (int16_t e = dir_head[idx][key % SDP_BUCKETS]; e >= 0; e = dir[e].next[idx]) {
+		if ((dir[e].key[idx] == key) && sdp_match(&dir[e].sdp, sdp, idx))
+			return(e);
+	}
+	return(-1);
+}
+
+static void sdp_unlink(int16_t e) {
+	for (int idx=0; idx < IDX_MAX; idx++) {
+		int16_t *ptr = &dir_head[idx][dir[e].key[idx] % SDP_BUCKETS];
+		
+		while (*ptr != e)
+			ptr = &dir[*ptr].next[idx];
+			
+		*ptr = dir[e].next[idx];
+	}
+	
+	dir[e].seen           = 0;
+	dir[e].next[IDX_NAME] = dir_free;
+	dir_free              = e;
+	dir_used             -= 1;
+}
+
+static void sdp_link(int16_t e) {
+	for (int idx=0; idx < IDX_MAX; idx++) {
+		int16_t *head = &dir_head[idx][(dir[e].key[idx] = sdp_key(&dir[e].sdp, idx)) % SDP_BUCKETS];
+		
+		dir[e].next[idx] = *head;
+		*head            = e;
+	}
+	dir_used += 1;
+}
+
+/* ######################################################################## */
+int mai_sdp_refresh(uint32_t source, uint16_t hash) {
+	// a repeated announcement (same source and message id) needs no parsing
+	if (!hash)
+		return(-1);
+		
+	struct mai_sdp key = (struct mai_sdp){ .source = source, .hash = hash };
+	
+	pthread_mutex_lock(&dir_lock);
+	
+	int e = sdp_lookup(&key, IDX_SOURCE);
+	
+	if (e >= 0)
+		dir[e].seen = time(NULL);
+		
+	pthread_mutex_unlock(&dir_lock);
+	return((e >= 0) ? 0 : -1);
+}
+
+int mai_sdp_update(const struct mai_sdp *sdp) {
+	pthread_mutex_lock(&dir_lock);
+	
+	// a session replaces any entry with the same name, address or source
+	for (int idx=0, e; idx < IDX_MAX; idx++) {
+		if ((e = sdp_lookup(sdp, idx)) >= 0)
+			sdp_unlink(e);
+	}
+	
+	int16_t e = dir_free;
+	
+	if (e >= 0) {
+		dir_free    = dir[e].next[IDX_NAME];
+		dir[e].sdp  = *sdp;
+		dir[e].seen = time(NULL);
+		
+		sdp_link(e);
+	}
+	
+	pthread_mutex_unlock(&dir_lock);
+	return((e >= 0) ? 0 : mai_error("session directory full, dropped '%s'\n", sdp->name));
+}
+
+int mai_sdp_delete(uint32_t source, uint16_t hash) {
+	struct mai_sdp key = (struct mai_sdp){ .source = source, .hash = hash };
+	
+	pthread_mutex_lock(&dir_lock);
+	
+	int e = sdp_lookup(&key, IDX_SOURCE);
+	
+	if (e >= 0)
+		sdp_unlink(e);
+		
+	pthread_mutex_unlock(&dir_lock);
+	return((e >= 0) ? 0 : -1);
+}
+
+void mai_sdp_expire(void) {
+	time_t limit = time(NULL) - SDP_EXPIRE;
+	
+	pthread_mutex_lock(&dir_lock);
+	
+	for (int16_t e=0; dir_used && (e < SDP_MAX); e++) {
+		if (dir[e].seen && (dir[e].seen < limit))
+			sdp_unlink(e);
+	}
+	
+	pthread_mutex_unlock(&dir_lock);
+}
+
+/* ######################################################################## */
+int mai_sdp_find(const char *name, struct mai_sdp *out) {
+	struct mai_sdp key;
+	
+	snprintf(key.name, sizeof(key.name), "%s", name);
+	
+	pthread_mutex_lock(&dir_lock);
+	
+	int e = sdp_lookup(&key, IDX_NAME);
+	
+	if (e >= 0)
+		*out = dir[e].sdp;
+		
+	pthread_mutex_unlock(&dir_lock);
+	return((e >= 0) ? 0 : -1);
+}
+
+int mai_sdp_find_addr(const char *addr, uint16_t port, struct mai_sdp *out) {
+	struct mai_sdp key = (struct mai_sdp){ .port = port };
+	
+	snprintf(key.addr, sizeof(key.addr), "%s", addr);
+	
+	pthread_mutex_lock(&dir_lock);
+	
+	int e = sdp_lookup(&key, IDX_ADDR);
+	
+	if (e >= 0)
+		*out = dir[e].sdp;
+		
+	pthread_mutex_unlock(&dir_lock);
+	return((e >= 0) ? 0 : -1);
+}
+
+/* ######################################################################## */
+int mai_sdp_parse(const char *text, size_t len, struct mai_sdp *sdp) {
+	char line[256], *end;
+	int  media = 0, pt = -1;
+	
+	memset(sdp, 0, sizeof(*sdp));
+	
+	for (const char *ptr = text, *eol; (ptr < (text + len)) && *ptr; ptr = eol + 1) {
+		if ((eol = memchr(ptr, '\n', (text + len) - ptr)) == NULL)
+			eol = text + len;
+			
+		// copy line without "\r\n"
+		size_t n = eol - ptr;
+		
+		if (n && (ptr[n-1] == '\r')) n -= 1;
+		if (n >= sizeof(line))       n  = sizeof(line) - 1;
+		
+		memcpy(line, ptr, n);
+		line[n] = 0;
+		
+		if (media > 1)
+			break;				// only the first media section is used
+			
+		if (!strncmp(line, "s=", 2)) {
+			snprintf(sdp->name, sizeof(sdp->name), "%.*s", (int)sizeof(sdp->name) - 1, line + 2);
+			
+		} else if (!strncmp(line, "c=IN IP4 ", 9)) {
+			if ((end = strchr(line + 9, '/')) != NULL)
+				*end = 0;		// strip "/ttl"
+				
+			snprintf(sdp->addr, sizeof(sdp->addr), "%.*s", (int)sizeof(sdp->addr) - 1, line + 9);
+			
+		} else if (!strncmp(line, "m=", 2)) {
+			if ((media += 1) > 1)
+				continue;
+				
+			if (sscanf(line, "m=audio %" SCNu16 " RTP/AVP %d", &sdp->port, &pt) != 2)
+				return(-1);		// not an RTP audio session
+				
+		} else if (!strncmp(line, "a=rtpmap:", 9)) {
+			int      fmt;
+			uint32_t bits, rate, channels = 1;
+			
+			if (sscanf(line, "a=rtpmap:%d L%" SCNu32 "/%" SCNu32 "/%" SCNu32, &fmt, &bits, &rate, &channels) < 3)
+				continue;
+				
+			if ((fmt != pt) || sdp->bits)
+				continue;
+				
+			sdp->bits     = bits;
+			sdp->rate     = rate;
+			sdp->channels = channels;
+			
+		} else if (!strncmp(line, "a=ptime:", 8)) {
+			// milliseconds to nearest supported packet time in microseconds
+			static const uint32_t ptimes[] = { 125, 250, 333, 1000, 4000 };
+			
+			long us = lround(strtod(line + 8, NULL) * 1000);
+			
+			sdp->ptime = ptimes[0];
+			
+			for (size_t lp=1; lp < (sizeof(ptimes) / sizeof(ptimes[0])); lp++) {
+				if (labs(us - ptimes[lp]) < labs(us - (long)sdp->ptime))
+					sdp->ptime = ptimes[lp];
+			}
+		}
+	}
+	
+	if (!sdp->name[0] || !sdp->addr[0] || !sdp->port || !sdp->bits)
+		return(-1);				// not a linear PCM session we can receive
+		
+	if (!sdp->ptime)
+		sdp->ptime = 1000;			// AES67 default packet time
+		
+	return(0);
+}
+
+/* ######################################################################## */
+int mai_sdp_init(void) {
+	memset(dir_head, 0xFF, sizeof(dir_head));
+	memset(dir, 0, sizeof(dir));
+	
+	dir_free = -1;
+	dir_used =  0;
+	
+	// build free list
+	for (int16_t e = SDP_MAX; e--; ) {
+		dir[e].next[IDX_NAME] = dir_free;
+		dir_free              = e;
+	}
+	return(0);
+}
+
+/* ######################################################################## */
@@ -1,4 +1,6 @@
 #include "mai.h"
+#include <netpacket/packet.h>
+#include <linux/filter.h>
 
 /* ######################################################################## */
 static const char		*if_name;		// multicast interface name
@@ -93,9 +95,124 @@ int mai_sock_open(int mode, const char *ip, const uint16_t port) {
 	return((mode == 's') ? sock_send(ip, port) : sock_recv(ip, port));
 }
 
+/* ######################################################################## */
+static int sock_drop(int sk, int ret) {
+	// error is logged before the close, so %m still reports its errno
+	close(sk);
+	return(ret);
+}
+
+int mai_sock_l2_open(uint16_t proto, const uint8_t *mac) {
+	if (!if_name)
+		return(mai_error("layer 2 sockets require an interface\n"));
+		
+	// create packet socket, kernel handles the ethernet header
+	int sk;
+	
+	if ((sk = socket(AF_PACKET, SOCK_DGRAM, 0)) < 0)
+		return(mai_error("socket: %m\n"));
+		
+	// send only socket: without a bound protocol nothing is received
+	if (!mac)
+		return(sk);
+		
+	// filter on our protocol: unlike a protocol bound socket, this also
+	// sees frames sent from our other sockets (like multicast loopback)
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   proto, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K,             0xFFFF),
+		BPF_STMT(BPF_RET | BPF_K,             0),
+	};
+	struct sock_fprog prog = (struct sock_fprog){ .len = sizeof(code) / sizeof(code[0]), .filter = code };
+	
+	if (setsockopt(sk, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)))
+		return(sock_drop(sk, mai_error("attach filter: %m\n")));
+		
+	// receive on the selected interface only
+	struct sockaddr_ll addr = (struct sockaddr_ll){ 
+		.sll_family = AF_PACKET, .sll_protocol = htons(ETH_P_ALL), .sll_ifindex = if_index 
+	};
+	
+	if (bind(sk, (struct sockaddr *)&addr, sizeof(addr)))
+		return(sock_drop(sk, mai_error("bind: %m\n")));
+		
+	// join layer 2 multicast group
+	struct packet_mreq req = (struct packet_mreq){ 
+		.mr_ifindex = if_index, .mr_type = PACKET_MR_MULTICAST, .mr_alen = ETH_ALEN 
+	};
+	
+	memcpy(req.mr_address, mac, ETH_ALEN);
+	
+	if (setsockopt(sk, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &req, sizeof(req)))
+		return(sock_drop(sk, mai_error("packet add membership: %m\n")));
+		
+	return(sk);
+}
+
+ssize_t mai_sock_l2_send(int sk, uint16_t proto, const uint8_t *mac, const void *data, size_t len) {
+	struct sockaddr_ll addr = (struct sockaddr_ll){ 
+		.sll_family = AF_PACKET, .sll_protocol = htons(proto), .sll_ifindex = if_index, .sll_halen = ETH_ALEN
+	};
+	
+	memcpy(addr.sll_addr, mac, ETH_ALEN);
+	return(sendto(sk, data, len, 0, (struct sockaddr *)&addr, sizeof(addr)));
+}
+
+/* ######################################################################## */
+int mai_sock_mute(int sk) {
+	// keep the socket (and its group membership) but never queue packets
+	struct sock_filter code[] = { BPF_STMT(BPF_RET | BPF_K, 0) };
+	struct sock_fprog  prog   = (struct sock_fprog){ .len = 1, .filter = code };
+	
+	if (setsockopt(sk, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)))
+		return(mai_error("attach filter: %m\n"));
+		
+	return(0);
+}
+
+int mai_sock_unmute(int sk) {
+	// packets queue again from now on
+	int none = 0;
+	
+	if (setsockopt(sk, SOL_SOCKET, SO_DETACH_FILTER, &none, sizeof(none)))
+		return(mai_error("detach filter: %m\n"));
+		
+	return(0);
+}
+
+/* ######################################################################## */
+int mai_sock_tune(int sk) {
+	// busy poll the device queue instead of sleeping until the interrupt
+	if (mai.args.busy_poll && setsockopt_i(sk, SOL_SOCKET, SO_BUSY_POLL, mai.args.busy_poll))
+		return(mai_error("busy poll: %m\n"));
+		
+	if (mai.args.busy_poll && setsockopt_i(sk, SOL_SOCKET, SO_PREFER_BUSY_POLL, 1))
+		return(mai_error("prefer busy poll: %m\n"));
+		
+	// force beyond net.core.rmem_max if privileged
+	if (mai.args.rcvbuf && setsockopt_i(sk, SOL_SOCKET, SO_RCVBUFFORCE, mai.args.rcvbuf) && setsockopt_i(sk, SOL_SOCKET, SO_RCVBUF, mai.args.rcvbuf))
+		return(mai_error("receive buffer: %m\n"));
+		
+	return(0);
+}
+
 /* ######################################################################## */
 int mai_sock_if_set(const char *name) {
-	if (!name || !name[0])
+	// NULL: no interface, as before any -i
+	if (!name) {
+		free((char *)if_name);
+		
+		if_name  = NULL;
+		if_mtu   = 0;
+		if_index = 0;
+		
+		memset(&if_addr, 0, sizeof(if_addr));
+		memset(if_local, 0, sizeof(if_local));
+		return(0);
+	}
+	
+	if (!name[0])
 		return(0);
 
 	if ((if_name = strdup(name)) == NULL)
@@ -157,6 +274,7 @@ int mai_sock_if_set(const char *name) {
 
 /* ######################################################################## */
 size_t      mai_sock_if_mtu(void)           { return( if_mtu);    }
+int         mai_sock_if_index(void)         { return( if_index);  }
 const void *mai_sock_if_addr(void)          { return(&if_addr);   }
 const char *mai_sock_if_name(void)          { return( if_name);   }
       void  mai_sock_if_local(uint8_t *out) { memcpy(out, if_local, sizeof(if_local)); }
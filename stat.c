@@ -0,0 +1,337 @@
+#include "mai.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+
+/* ######################################################################## */
+#define STAT_PUBLISH_MS	100				// shared memory snapshot interval
+#define STAT_SEND_MS	200				// metrics client write timeout
+
+_Static_assert(MAI_STAT_SLOTS <= 64, "free slots are kept in one 64 bit mask");
+
+struct mai_stat			 mai_stat[MAI_STAT_SLOTS];
+size_t				 mai_stat_used = 0;
+__thread struct mai_stat	*mai_stat_self = NULL;
+
+static uint64_t			 stat_free = 0;		// slots released by exited threads
+static pthread_key_t		 stat_key;		// releases a slot on thread exit
+static pthread_once_t		 stat_once = PTHREAD_ONCE_INIT;
+
+static struct mai_stat_shm	*stat_shm  = NULL;	// published snapshot
+static int			 stat_sock = -1;	// metrics listener
+static pthread_t		 stat_tid;
+
+struct metric {
+	const char	*name;				// prometheus metric name
+	const char	*type;				// counter, gauge or histogram
+	const char	*help;				// description
+	size_t		 off;				// offset in struct mai_stat
+};
+
+#define STAT(t) offsetof(struct mai_stat, t)
+
+static const struct metric stat_metric[] = {
+	{ "mai_audio_drift_samples",		"gauge",	"Sample clock drift corrections",	STAT(audio.drift)	},
+	{ "mai_audio_overrun_total",		"counter",	"Audio buffer overruns",		STAT(audio.overrun)	},
+	{ "mai_audio_underrun_total",		"counter",	"Audio buffer underruns",		STAT(audio.underrun)	},
+	{ "mai_audio_trimmed_frames_total",	"counter",	"Frames dropped to hold a buffer target",	STAT(audio.trimmed)	},
+	{ "mai_audio_aligned_frames_total",	"counter",	"Frames moved to align stream playout",	STAT(audio.aligned)	},
+	
+	{ "mai_rtp_resynced_total",		"counter",	"RTP clock resyncs",			STAT(rtp.resynced)	},
+	{ "mai_rtp_packets_total",		"counter",	"RTP packets sent or received",		STAT(rtp.packets)	},
+	{ "mai_rtp_reordered_total",		"counter",	"RTP packets received out of order",	STAT(rtp.reordered)	},
+	{ "mai_rtp_skipped_total",		"counter",	"RTP packets dropped",			STAT(rtp.skipped)	},
+	{ "mai_rtp_slewed_total",		"counter",	"RTP clock slew samples",		STAT(rtp.slewed)	},
+	{ "mai_rtp_first_audio_us",		"gauge",	"Time to first audio",			STAT(rtp.first)		},
+	{ "mai_rtp_send_calls_total",		"counter",	"RTP send system calls",		STAT(rtp.calls)		},
+	{ "mai_rtp_fec_repair_total",		"counter",	"FEC repair packets sent or received",	STAT(rtp.repair)	},
+	{ "mai_rtp_fec_recovered_total",	"counter",	"RTP packets rebuilt from FEC repairs",	STAT(rtp.recovered)	},
+	
+	{ "mai_ptp_masters_total",		"counter",	"PTP master clock changes",		STAT(ptp.masters)	},
+	{ "mai_ptp_requests_total",		"counter",	"PTP delay requests",			STAT(ptp.requests)	},
+	{ "mai_ptp_general_total",		"counter",	"PTP general messages",			STAT(ptp.general)	},
+	{ "mai_ptp_event_total",		"counter",	"PTP event messages",			STAT(ptp.event)		},
+	{ "mai_ptp_syncs_total",		"counter",	"PTP syncs sent as grandmaster",	STAT(ptp.syncs)		},
+	{ "mai_ptp_first_lock_us",		"gauge",	"Time to first PTP master",		STAT(ptp.locked)	},
+	
+	{ "mai_sap_received_total",		"counter",	"SAP packets received",			STAT(sap.received)	},
+	{ "mai_sap_parsed_total",		"counter",	"SDP sessions parsed",			STAT(sap.parsed)	},
+	
+	{ "mai_record_files_total",		"counter",	"Recording files opened",		STAT(record.files)	},
+	{ "mai_record_frames_total",		"counter",	"Recorded frames written",		STAT(record.frames)	},
+	{ "mai_record_dropped_total",		"counter",	"Recorded frames dropped",		STAT(record.dropped)	},
+	{ "mai_record_padded_total",		"counter",	"Recorded frames padded",		STAT(record.padded)	},
+	{ "mai_local_blocks_total",		"counter",	"Periods through shared memory",	STAT(local.blocks)	},
+	{ "mai_local_lost_total",		"counter",	"Shared memory periods lapped",		STAT(local.lost)	},
+	
+	{ "mai_measure_codes_total",		"counter",	"Latency time codes decoded",		STAT(measure.codes)	},
+	{ "mai_measure_corrupt_total",		"counter",	"Latency time codes corrupted",		STAT(measure.corrupt)	},
+	{ "mai_measure_lost_total",		"counter",	"Latency time codes missing",		STAT(measure.lost)	},
+	{ "mai_measure_slips_total",		"counter",	"Audio discontinuities",		STAT(measure.slips)	},
+	{ "mai_measure_slipped_samples",	"gauge",	"Samples gained or lost",		STAT(measure.slipped)	},
+	
+	{ "mai_audio_buffer_fill_frames",	"histogram",	"Audio buffer fill at read",		STAT(hist.fill)		},
+	{ "mai_ptp_offset_ns",			"histogram",	"PTP offset from master",		STAT(hist.offset)	},
+	{ "mai_rtp_packet_gap_us",		"histogram",	"RTP packet inter-arrival time",	STAT(hist.gap)		},
+	{ "mai_measure_latency_us",		"histogram",	"End to end latency",			STAT(hist.latency)	},
+	{ "mai_audio_stream_skew_us",		"histogram",	"Aligned stream skew before correction",	STAT(hist.skew)		},
+	{ NULL }
+};
+
+/* ######################################################################## */
+static uint64_t stat_mask(size_t slots) { return((slots < 64) ? ((UINT64_C(1) << slots) - 1) : ~UINT64_C(0)); }
+static size_t   stat_last(uint64_t mask) { return(mask ? (64 - __builtin_clzll(mask)) : 0); }
+
+static void stat_release(void *ptr) {
+	// thread exit: the slot keeps its counts for the next thread to add to
+	size_t idx = (struct mai_stat *)ptr - mai_stat;
+	
+	if (idx < (MAI_STAT_SLOTS - 1))
+		__atomic_fetch_or(&stat_free, UINT64_C(1) << idx, __ATOMIC_RELEASE);
+}
+
+static void stat_key_init(void) {
+	(void)!pthread_key_create(&stat_key, stat_release);
+}
+
+struct mai_stat *mai_stat_slot(void) {
+	// first counter update on this thread: reuse a released slot or claim a new one
+	uint64_t free = __atomic_load_n(&stat_free, __ATOMIC_ACQUIRE);
+	size_t   idx;
+	
+	while (free && !__atomic_compare_exchange_n(&stat_free, &free, free & (free - 1), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		;
+		
+	if (free)
+		idx = __builtin_ctzll(free);
+	else if ((idx = __atomic_fetch_add(&mai_stat_used, 1, __ATOMIC_ACQ_REL)) >= MAI_STAT_SLOTS) {
+		mai_error("out of statistics slots, sharing the last one\n");
+		idx = MAI_STAT_SLOTS - 1;
+	}
+	
+	pthread_once(&stat_once, stat_key_init);
+	pthread_setspecific(stat_key, &mai_stat[idx]);
+	
+	return(mai_stat_self = &mai_stat[idx]);
+}
+
+void mai_stat_sum(struct mai_stat *out) {
+	// every field is a 64 bit counter, so slots add up word by word
+	uint64_t *sum = (uint64_t *)out;
+	size_t    used = __atomic_load_n(&mai_stat_used, __ATOMIC_ACQUIRE);
+	
+	memset(out, 0, sizeof(*out));
+	
+	for (size_t slot=0; (slot < used) && (slot < MAI_STAT_SLOTS); slot++) {
+		const uint64_t *in = (const uint64_t *)&mai_stat[slot];
+		
+		for (size_t lp=0; lp < (sizeof(*out) / sizeof(uint64_t)); lp++)
+			sum[lp] += __atomic_load_n(&in[lp], __ATOMIC_RELAXED);
+	}
+}
+
+/* ######################################################################## */
+static void stat_publish(void) {
+	struct mai_stat  total;
+	struct mai_meter meter[MAI_STREAM_MAX];
+	
+	mai_stat_sum(&total);
+	
+	for (size_t s=0; s < MAI_STREAM_MAX; s++)
+		mai_meter_get(s, &meter[s]);
+		
+	// seqlock: readers retry while seq is odd or changed during their copy
+	__atomic_store_n(&stat_shm->seq, stat_shm->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	
+	stat_shm->time = mai_clock_ns(CLOCK_REALTIME);
+	memcpy(&stat_shm->stat, &total, sizeof(total));
+	memcpy(stat_shm->meter, meter, sizeof(meter));
+	
+	__atomic_store_n(&stat_shm->seq, stat_shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void stat_meter(FILE *out) {
+	// levels are labelled gauges, one per stream and channel
+	static const char *name[] = { "mai_meter_peak", "mai_meter_rms", "mai_meter_clips_total" };
+	static const char *help[] = { "Peak level over the last 100ms (full scale 1.0)", "RMS level over the last 100ms (full scale 1.0)", "Full scale samples" };
+	
+	struct mai_meter m[MAI_STREAM_MAX];
+	
+	for (size_t s=0; s < MAI_STREAM_MAX; s++)
+		mai_meter_get(s, &m[s]);
+		
+	for (size_t lp=0; lp < 3; lp++) {
+		fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name[lp], help[lp], name[lp], lp == 2 ? "counter" : "gauge");
+		
+		for (size_t s=0; s < MAI_STREAM_MAX; s++) {
+			for (size_t ch=0; m[s].frames && (ch < m[s].channels); ch++) {
+				fprintf(out, "%s{stream=\"%zu\",channel=\"%zu\"} ", name[lp], s + 1, ch + 1);
+				
+				if (lp == 2) fprintf(out, "%" PRIu64 "\n", m[s].clips[ch]);
+				else         fprintf(out, "%.6f\n", (lp ? m[s].rms : m[s].peak)[ch]);
+			}
+		}
+	}
+}
+
+static void stat_text(FILE *out) {
+	struct mai_stat total;
+	
+	mai_stat_sum(&total);
+	
+	for (const struct metric *m = stat_metric; m->name; m++) {
+		const void *ptr = (const uint8_t *)&total + m->off;
+		
+		fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, m->type);
+		
+		if (strcmp(m->type, "histogram")) {
+			fprintf(out, "%s %" PRId64 "\n", m->name, *(const int64_t *)ptr);
+			continue;
+		}
+		
+		// prometheus buckets are cumulative
+		const struct mai_hist *h = ptr;
+		size_t                 count = 0;
+		
+		for (size_t lp=0; lp < (MAI_HIST_LEN - 1); lp++) {
+			count += h->bucket[lp];
+			fprintf(out, "%s_bucket{le=\"%" PRIu64 "\"} %zu\n", m->name, (UINT64_C(1) << lp) - 1, count);
+		}
+		
+		count += h->bucket[MAI_HIST_LEN - 1];
+		
+		fprintf(out, "%s_bucket{le=\"+Inf\"} %zu\n", m->name, count);
+		fprintf(out, "%s_sum %zu\n%s_count %zu\n",   m->name, h->sum, m->name, count);
+	}
+	
+	stat_meter(out);
+}
+
+static void stat_serve(int sk) {
+	// answer plain connections with the text, HTTP requests with a response
+	char          req[512] = { 0 };
+	struct pollfd pfd = (struct pollfd){ .fd = sk, .events = POLLIN };
+	
+	struct timeval tv  = (struct timeval){ .tv_usec = STAT_SEND_MS * 1000 };
+	
+	if (poll(&pfd, 1, 50) > 0)
+		(void)!recv(sk, req, sizeof(req) - 1, MSG_DONTWAIT);
+		
+	// a client that stops reading must not hold up the shared memory snapshots
+	(void)!setsockopt(sk, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	
+	FILE *out = fdopen(sk, "w");
+	
+	if (!out) {
+		close(sk);
+		return;
+	}
+	
+	if (!strncmp(req, "GET ", 4))
+		fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+		
+	stat_text(out);
+	fclose(out);
+}
+
+/* ######################################################################## */
+static void *stat_thread(void *arg) {
+	struct pollfd pfd = (struct pollfd){ .fd = stat_sock, .events = POLLIN };
+	
+	for (uint64_t next = 0, now; 1; ) {
+		if ((poll(&pfd, (stat_sock >= 0), STAT_PUBLISH_MS) > 0) && (pfd.revents & POLLIN)) {
+			int sk = accept(stat_sock, NULL, NULL);
+			
+			if (sk >= 0)
+				stat_serve(sk);
+		}
+		
+		if (stat_shm && ((now = mai_clock_ns(CLOCK_MONOTONIC)) >= next)) {
+			next = now + (STAT_PUBLISH_MS * 1000000ULL);
+			stat_publish();
+		}
+	}
+	
+	mai_error("Unexpected Thread Exit!");
+	return(arg);
+}
+
+/* ######################################################################## */
+int mai_stat_init(void) {
+	// counts start over with every open, threads still running keep their slots
+	size_t used = __atomic_load_n(&mai_stat_used, __ATOMIC_ACQUIRE);
+	
+	used = stat_last(stat_mask(used) & ~stat_free);
+	
+	__atomic_store_n(&stat_free, stat_free & stat_mask(used), __ATOMIC_RELEASE);
+	__atomic_store_n(&mai_stat_used, used, __ATOMIC_RELEASE);
+	
+	memset(mai_stat, 0, sizeof(mai_stat));
+	
+	if (mai.args.shm) {
+		// read-only for everyone else, readers map with PROT_READ
+		int fd = shm_open(mai.args.shm, O_CREAT|O_RDWR|O_TRUNC, 0644);
+		
+		if ((fd < 0) || ftruncate(fd, sizeof(*stat_shm)))
+			return(mai_error("statistics shared memory (%s): %m\n", mai.args.shm));
+			
+		stat_shm = mmap(NULL, sizeof(*stat_shm), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		
+		if (stat_shm == MAP_FAILED) {
+			stat_shm = NULL;
+			return(mai_error("statistics mmap: %m\n"));
+		}
+			
+		stat_shm->magic = MAI_STAT_MAGIC;
+		stat_shm->size  = sizeof(*stat_shm);
+		stat_shm->pid   = getpid();
+		
+		mai_debug("Statistics: shared memory %s\n", mai.args.shm);
+	}
+	
+	if (mai.args.metrics) {
+		struct sockaddr_un addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+		
+		if (strlen(mai.args.metrics) >= sizeof(addr.sun_path))
+			return(mai_error("metrics socket path too long\n"));
+			
+		strcpy(addr.sun_path, mai.args.metrics);
+		unlink(addr.sun_path);
+		
+		if ((stat_sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return(mai_error("socket: %m\n"));
+			
+		if (bind(stat_sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(stat_sock, 4))
+			return(mai_error("metrics socket (%s): %m\n", mai.args.metrics));
+			
+		mai_debug("Statistics: metrics %s\n", mai.args.metrics);
+	}
+	
+	if (!stat_shm && (stat_sock < 0))
+		return(0);
+		
+	return(mai_thread_create(&stat_tid, "stat", stat_thread, NULL));
+}
+
+int mai_stat_stop(void) {
+	mai_thread_stop(&stat_tid);
+	
+	if (stat_shm) {
+		munmap(stat_shm, sizeof(*stat_shm));
+		shm_unlink(mai.args.shm);
+	}
+	
+	if (stat_sock >= 0) {
+		close(stat_sock);
+		unlink(mai.args.metrics);
+	}
+	
+	stat_shm  = NULL;
+	stat_sock = -1;
+	return(0);
+}
+
+/* ######################################################################## */
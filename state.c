@@ -0,0 +1,122 @@
+#include "mai.h"
+
+/* ######################################################################## */
+#define STATE_MAX 64					// calibrations kept in state file
+
+struct entry {
+	char		iface[IFNAMSIZ];		// interface name
+	char		master[32];			// ptp master source (text)
+	double		ratio;				// jack vs ptp clock ratio error
+	int64_t		delay;				// ptp path delay (ns)
+};
+
+static struct entry		 state[STATE_MAX];	// calibrations, most recent first
+static size_t			 state_used = 0;	// number of calibrations loaded
+
+/* ######################################################################## */
+static const char *state_iface(void) {
+	return(mai_sock_if_name() ? mai_sock_if_name() : "default");
+}
+
+/* ######################################################################## */
+int mai_state_find(const char *master, double *ratio, int64_t *delay) {
+	for (size_t lp=0; lp < state_used; lp++) {
+		if (strcmp(state[lp].iface, state_iface()))
+			continue;
+			
+		if (master && strcmp(state[lp].master, master))
+			continue;
+			
+		*ratio = state[lp].ratio;
+		*delay = state[lp].delay;
+		return(0);
+	}
+	return(-1);
+}
+
+/* ######################################################################## */
+int mai_state_init(void) {
+	state_used = 0;
+	
+	if (!mai.args.state)
+		return(0);
+		
+	FILE *fp;
+	
+	if ((fp = fopen(mai.args.state, "r")) == NULL)
+		return((errno == ENOENT) ? 0 : mai_error("could not open state file (%s): %m\n", mai.args.state));
+		
+	char line[256];
+	
+	while (fgets(line, sizeof(line), fp) && (state_used < STATE_MAX)) {
+		struct entry *e = &state[state_used];
+		
+		if (line[0] == '#')
+			continue;
+			
+		if (sscanf(line, "%15s %31s %lf %" SCNd64, e->iface, e->master, &e->ratio, &e->delay) == 4)
+			state_used += 1;
+	}
+	fclose(fp);
+	
+	// seed the backend servo with the last ratio learned on this interface
+	double  ratio;
+	int64_t delay;
+	
+	if (!mai_state_find(NULL, &ratio, &delay))
+		mai_backend_ratio_set(ratio);
+		
+	return(mai_debug("State: %s (%zu calibrations)\n", mai.args.state, state_used));
+}
+
+/* ######################################################################## */
+int mai_state_fini(void) {
+	if (!mai.args.state || !mai_ptp_source()[0])
+		return(0);
+		
+	// current calibration goes first, replacing any older one
+	struct entry e = { .ratio = mai_backend_ratio(), .delay = mai_ptp_delay() };
+	
+	snprintf(e.iface,  sizeof(e.iface),  "%s", state_iface());
+	snprintf(e.master, sizeof(e.master), "%s", mai_ptp_source());
+	
+	for (size_t lp=0; lp < state_used; lp++) {
+		if (strcmp(state[lp].iface, e.iface) || strcmp(state[lp].master, e.master))
+			continue;
+			
+		memmove(&state[lp], &state[lp+1], (--state_used - lp) * sizeof(e));
+		break;
+	}
+	
+	if (state_used == STATE_MAX)
+		state_used -= 1;
+		
+	memmove(&state[1], &state[0], state_used++ * sizeof(e));
+	state[0] = e;
+	
+	// write to a temporary file, then atomically replace the old one
+	char *tmp;
+	FILE *fp;
+	
+	if (asprintf(&tmp, "%s.tmp", mai.args.state) <= 0)
+		return(mai_error("could not allocate state file name: %m\n"));
+		
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		mai_error("could not create state file (%s): %m\n", tmp);
+		free(tmp);
+		return(-1);
+	}
+	
+	fprintf(fp, "# interface master ratio delay(ns)\n");
+	
+	for (size_t lp=0; lp < state_used; lp++)
+		fprintf(fp, "%s %s %.12e %" PRId64 "\n", state[lp].iface, state[lp].master, state[lp].ratio, state[lp].delay);
+		
+	if (fclose(fp) || rename(tmp, mai.args.state))
+		mai_error("could not write state file (%s): %m\n", mai.args.state);
+		
+	free(tmp);
+	return(mai_debug("State: saved %s (ratio %.3e, delay %" PRId64 "ns)\n", e.master, e.ratio, e.delay));
+}
+
+/* ######################################################################## */
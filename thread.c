@@ -0,0 +1,189 @@
+#include "mai.h"
+#include <sched.h>
+
+/* ######################################################################## */
+struct config {
+	const char	*name;				// thread name
+	int		 pinned;			// cpu affinity set
+	cpu_set_t	 cpus;				// cpu affinity
+	int		 policy;			// scheduling policy (-1: inherit)
+	int		 priority;			// scheduling priority
+};
+
+static struct config thread_config[] = {
+	{ .name = "rtp",     .policy = -1 },		// rtp sender or ring receive
+	{ .name = "ptp",     .policy = -1 },		// ptp receive and grandmaster
+	{ .name = "sap",     .policy = -1 },		// sap announce and listen
+	{ .name = "loop",    .policy = -1 },		// io_uring event loop
+	{ .name = "shard",   .policy = -1 },		// sharded stream receive
+	{ .name = "fec",     .policy = -1 },		// fec repair receive
+	{ .name = "stat",    .policy = -1 },		// statistics export
+	{ .name = "audio",   .policy = -1 },		// headless backend process
+	{ .name = "record",  .policy = -1 },		// recording writer
+	{ .name = "control", .policy = -1 },		// control socket
+	{ .name = NULL }
+};
+
+/* ######################################################################## */
+static struct config *thread_find(const char *name, size_t len) {
+	for (struct config *cfg = thread_config; cfg->name; cfg++) {
+		if ((strlen(cfg->name) == len) && !strncmp(cfg->name, name, len))
+			return(cfg);
+	}
+	return(NULL);
+}
+
+static int thread_cpus(const char *list, cpu_set_t *cpus) {
+	// cpu list: "2", "2,3" or "2-5"
+	CPU_ZERO(cpus);
+	
+	for (char *end; *list && (*list != ':'); list = end + (*end == ',')) {
+		long first = strtol(list, &end, 10), last = first;
+		
+		if (end == list)
+			return(-1);
+			
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+			
+		if ((first < 0) || (last < first) || (last >= CPU_SETSIZE))
+			return(-1);
+			
+		for (; first <= last; first++)
+			CPU_SET(first, cpus);
+	}
+	return(CPU_COUNT(cpus) ? 0 : -1);
+}
+
+/* ######################################################################## */
+int mai_thread_config(const char *spec) {
+	// <name>:<cpus>[:<fifo|rr|other>[:<priority>]], cpus may be empty; NULL: all inherit
+	if (!spec) {
+		for (struct config *cfg = thread_config; cfg->name; cfg++)
+			*cfg = (struct config){ .name = cfg->name, .policy = -1 };
+			
+		return(0);
+	}
+	
+	const char    *ptr = strchr(spec, ':');
+	struct config *cfg = thread_find(spec, ptr ? (size_t)(ptr - spec) : strlen(spec));
+	
+	if (!cfg || !ptr++)
+		return(-1);
+		
+	if ((*ptr != ':') && *ptr) {
+		if (thread_cpus(ptr, &cfg->cpus))
+			return(-1);
+			
+		cfg->pinned = 1;
+	}
+	
+	if ((ptr = strchr(ptr, ':')) == NULL)
+		return(0);
+		
+	ptr += 1;
+	
+	     if (!strncmp(ptr, "fifo",  4)) cfg->policy = SCHED_FIFO;
+	else if (!strncmp(ptr, "rr",    2)) cfg->policy = SCHED_RR;
+	else if (!strncmp(ptr, "other", 5)) cfg->policy = SCHED_OTHER;
+	else return(-1);
+	
+	ptr = strchr(ptr, ':');
+	cfg->priority = (cfg->policy == SCHED_OTHER) ? 0 : (ptr ? atoi(ptr + 1) : 90);
+	
+	if ((cfg->priority < sched_get_priority_min(cfg->policy)) || (cfg->priority > sched_get_priority_max(cfg->policy)))
+		return(-1);
+		
+	return(0);
+}
+
+/* ######################################################################## */
+int mai_thread_create(pthread_t *tid, const char *name, void *(*func)(void *), void *arg) {
+	struct config  *cfg = thread_find(name, strlen(name));
+	pthread_attr_t  attr;
+	
+	pthread_attr_init(&attr);
+	
+	// without configuration threads inherit from their creator
+	if (cfg && cfg->pinned)
+		pthread_attr_setaffinity_np(&attr, sizeof(cfg->cpus), &cfg->cpus);
+		
+	if (cfg && (cfg->policy >= 0)) {
+		struct sched_param p = (struct sched_param){ .sched_priority = cfg->priority };
+		
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, cfg->policy);
+		pthread_attr_setschedparam(&attr, &p);
+	}
+	
+	int rc = pthread_create(tid, &attr, func, arg);
+	
+	pthread_attr_destroy(&attr);
+	
+	if (rc) {
+		*tid = 0;
+		return(mai_error("could not start %s thread: %s\n", name, strerror(rc)));
+	}
+		
+	// visible in top -H and /proc/<pid>/task/*/comm
+	char comm[16];
+	
+	snprintf(comm, sizeof(comm), "mai-%s", name);
+	pthread_setname_np(*tid, comm);
+	
+	return(0);
+}
+
+int mai_thread_stop(pthread_t *tid) {
+	// cancel and wait, nothing when the thread never started (tid 0)
+	if (!*tid)
+		return(0);
+		
+	pthread_cancel(*tid);
+	pthread_join(*tid, NULL);
+	
+	*tid = 0;
+	return(0);
+}
+
+int mai_thread_inherit(pthread_t tid, const char *name) {
+	// a thread started early takes the scheduling its creator has now, unless configured
+	struct config      *cfg = thread_find(name, strlen(name));
+	struct sched_param  p;
+	int                 policy;
+	
+	if (cfg && (cfg->policy >= 0))
+		return(0);
+		
+	if ((errno = pthread_getschedparam(pthread_self(), &policy, &p)) || (errno = pthread_setschedparam(tid, policy, &p)))
+		return(mai_error("could not set %s thread scheduling: %m\n", name));
+		
+	return(0);
+}
+
+int mai_thread_pin(pthread_t tid, const char *name, size_t nth) {
+	// one of several same named threads on the nth cpu of their list (wraps)
+	struct config *cfg = thread_find(name, strlen(name));
+	cpu_set_t      cpu;
+	
+	if (!cfg || !cfg->pinned)
+		return(0);
+		
+	size_t skip = nth % CPU_COUNT(&cfg->cpus);
+	
+	for (int c=0; c < CPU_SETSIZE; c++) {
+		if (!CPU_ISSET(c, &cfg->cpus) || skip--)
+			continue;
+			
+		CPU_ZERO(&cpu);
+		CPU_SET(c, &cpu);
+		
+		if ((errno = pthread_setaffinity_np(tid, sizeof(cpu), &cpu)))
+			return(mai_error("could not pin %s thread to cpu %d: %m\n", name, c));
+			
+		return(mai_debug("Thread: %s %zu on cpu %d\n", name, nth, c));
+	}
+	return(0);
+}
+
+/* ######################################################################## */